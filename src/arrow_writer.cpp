@@ -0,0 +1,276 @@
+#include <stdexcept>
+#include "arrow_writer.h"
+#include "byte_writer.h"
+#include "flatbuf.h"
+
+using namespace std;
+
+// batches get written early if they get this big, whatever row_group says
+static const size_t ARROW_BATCH_BYTES = 67108864;
+
+// from Arrow's Schema.fbs, Message.fbs, and File.fbs
+static const int16_t ARROW_METADATA_V5 = 4;
+
+enum class arrow_type : uint8_t {
+    Int = 2,
+    FloatingPoint = 3,
+    Utf8 = 5,
+    Bool = 6,
+    Date = 8,
+    Time = 9,
+    Timestamp = 10
+};
+
+enum class arrow_header : uint8_t {
+    Schema = 1,
+    RecordBatch = 3
+};
+
+static const int16_t ARROW_PRECISION_DOUBLE = 2;
+static const int16_t ARROW_DATE_DAY = 0;
+static const int16_t ARROW_TIME_MILLISECOND = 1;
+static const int16_t ARROW_TIME_MICROSECOND = 2;
+
+static uint32_t build_type(flatbuf_builder& fb, columnar_type type, arrow_type& tt) {
+    fb.start_table();
+
+    switch (type) {
+        case columnar_type::INT32:
+        case columnar_type::INT64:
+            tt = arrow_type::Int;
+            fb.add_scalar<int32_t>(0, type == columnar_type::INT32 ? 32 : 64); // bitWidth
+            fb.add_scalar<uint8_t>(1, 1); // is_signed
+            break;
+
+        case columnar_type::FLOAT64:
+            tt = arrow_type::FloatingPoint;
+            fb.add_scalar(0, ARROW_PRECISION_DOUBLE);
+            break;
+
+        case columnar_type::BOOL:
+            tt = arrow_type::Bool;
+            break;
+
+        case columnar_type::DATE32:
+            tt = arrow_type::Date;
+            fb.add_scalar(0, ARROW_DATE_DAY);
+            break;
+
+        case columnar_type::TIME32_MS:
+            tt = arrow_type::Time;
+            fb.add_scalar(0, ARROW_TIME_MILLISECOND);
+            fb.add_scalar<int32_t>(1, 32); // bitWidth
+            break;
+
+        case columnar_type::TIMESTAMP_US:
+            tt = arrow_type::Timestamp;
+            fb.add_scalar(0, ARROW_TIME_MICROSECOND);
+            break;
+
+        default:
+            tt = arrow_type::Utf8;
+            break;
+    }
+
+    return fb.end_table();
+}
+
+static uint32_t build_schema(flatbuf_builder& fb, const vector<columnar_column>& cols) {
+    vector<uint32_t> fields;
+
+    for (const auto& c : cols) {
+        arrow_type tt;
+
+        auto name = fb.create_string(c.name);
+        auto type = build_type(fb, c.type, tt);
+        auto children = fb.create_offset_vector({});
+
+        fb.start_table();
+        fb.add_offset(0, name);
+        fb.add_scalar<uint8_t>(1, 1); // nullable
+        fb.add_scalar(2, (uint8_t)tt);
+        fb.add_offset(3, type);
+        fb.add_offset(5, children);
+        fields.push_back(fb.end_table());
+    }
+
+    auto fv = fb.create_offset_vector(fields);
+
+    fb.start_table();
+    fb.add_scalar<int16_t>(0, 0); // little-endian
+    fb.add_offset(1, fv);
+
+    return fb.end_table();
+}
+
+// wraps the header already in fb in a Message
+static string finish_message(flatbuf_builder& fb, arrow_header type, uint32_t header, uint64_t body_length) {
+    fb.start_table();
+    fb.add_scalar(0, ARROW_METADATA_V5);
+    fb.add_scalar(1, (uint8_t)type);
+    fb.add_offset(2, header);
+    fb.add_scalar(3, (int64_t)body_length);
+
+    return fb.finish(fb.end_table());
+}
+
+arrow_writer::arrow_writer(const filesystem::path& fn, unsigned int row_group) : f(fn, ios::binary), row_group(row_group) {
+    if (!f.good())
+        throw runtime_error("Could not create " + fn.string() + ".");
+
+    out(string_view("ARROW1\0\0", 8));
+}
+
+void arrow_writer::out(const string_view& s) {
+    f.write(s.data(), (streamsize)s.length());
+
+    if (!f.good())
+        throw runtime_error("Error writing export file.");
+
+    offset += s.length();
+}
+
+// metadata is padded so that the body starts on an 8-byte boundary
+void arrow_writer::write_message(const string& meta, const string& body, uint64_t body_length) {
+    string prefix;
+    auto padded = (meta.length() + 7) & ~(size_t)7;
+
+    append_le(prefix, (uint32_t)0xffffffff); // continuation
+    append_le(prefix, (uint32_t)padded);
+
+    blocks.push_back({offset, (uint32_t)(prefix.length() + padded), body_length});
+
+    out(prefix);
+    out(meta);
+    out(string(padded - meta.length(), '\0'));
+    out(body);
+}
+
+void arrow_writer::header(const vector<pair<string, tds::server_type>>& columns) {
+    if (have_schema) {
+        truncated = true;
+        skipping = true;
+        return;
+    }
+
+    batch.reset(columns);
+    have_schema = true;
+
+    flatbuf_builder fb;
+
+    auto schema = build_schema(fb, batch.cols);
+
+    write_message(finish_message(fb, arrow_header::Schema, schema, 0), "", 0);
+
+    // the schema message isn't a record batch, so doesn't go in the footer
+    blocks.clear();
+}
+
+void arrow_writer::row(const vector<tds::Field>& columns) {
+    if (skipping)
+        return;
+
+    batch.add_row(columns);
+
+    if (batch.rows >= row_group || batch.size() >= ARROW_BATCH_BYTES)
+        write_batch();
+}
+
+void arrow_writer::write_batch() {
+    string body, nodes, buffers;
+    auto rows = batch.rows;
+
+    auto add_buffer = [&](const string& data, size_t length) {
+        append_le(buffers, (uint64_t)body.length());
+        append_le(buffers, (uint64_t)length);
+        body.append(data, 0, length);
+        pad8(body);
+    };
+
+    for (const auto& c : batch.cols) {
+        append_le(nodes, (uint64_t)rows);
+        append_le(nodes, c.null_count);
+
+        add_buffer(c.validity, (rows + 7) / 8);
+
+        if (c.type == columnar_type::UTF8)
+            add_buffer(c.offsets, c.offsets.length());
+
+        add_buffer(c.data, c.data.length());
+    }
+
+    flatbuf_builder fb;
+
+    // FieldNode and Buffer are both 16-byte structs
+    auto nv = fb.create_struct_vector(nodes, nodes.length() / 16, 8);
+    auto bv = fb.create_struct_vector(buffers, buffers.length() / 16, 8);
+
+    fb.start_table();
+    fb.add_scalar(0, (int64_t)rows);
+    fb.add_offset(1, nv);
+    fb.add_offset(2, bv);
+
+    auto rb = fb.end_table();
+
+    write_message(finish_message(fb, arrow_header::RecordBatch, rb, body.length()), body, body.length());
+
+    batch.clear();
+}
+
+void arrow_writer::finish() {
+    if (!have_schema) {
+        // no result set, so write an empty file rather than an invalid one
+        header({});
+    }
+
+    if (batch.rows > 0)
+        write_batch();
+
+    string eos;
+
+    append_le(eos, (uint32_t)0xffffffff);
+    append_le(eos, (uint32_t)0);
+    out(eos);
+
+    flatbuf_builder fb;
+    string bl;
+
+    for (const auto& b : blocks) {
+        append_le(bl, b.offset);
+        append_le(bl, b.meta_length);
+        append_le(bl, (uint32_t)0); // padding
+        append_le(bl, b.body_length);
+    }
+
+    auto schema = build_schema(fb, batch.cols);
+    auto dicts = fb.create_struct_vector("", 0, 8);
+    auto batches = fb.create_struct_vector(bl, blocks.size(), 8);
+
+    fb.start_table();
+    fb.add_scalar(0, ARROW_METADATA_V5);
+    fb.add_offset(1, schema);
+    fb.add_offset(2, dicts);
+    fb.add_offset(3, batches);
+
+    auto footer = fb.finish(fb.end_table());
+    string trailer;
+
+    append_le(trailer, (uint32_t)footer.length());
+    trailer += "ARROW1";
+
+    out(footer);
+    out(trailer);
+
+    f.close();
+
+    if (f.fail())
+        throw runtime_error("Error writing export file.");
+}
+
+string arrow_writer::mime() const {
+    return "application/vnd.apache.arrow.file";
+}
+
+string arrow_writer::filename() const {
+    return "results.arrow";
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <tdscpp.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+#include <stdint.h>
+#include "exporter.h"
+#include "columnar.h"
+
+// Writes results as an Arrow IPC file (a.k.a. Feather v2), one record batch per
+// row_group rows, so that only one batch is ever held in memory. Only the first result
+// set is exported, as the file can only have one schema.
+//
+// The flatbuffers Arrow uses for its metadata are built by hand, so there's no
+// dependency on the Arrow or flatbuffers libraries. Bodies are uncompressed, as Arrow
+// only allows LZ4 or ZSTD.
+
+class arrow_writer : public exporter {
+public:
+    arrow_writer(const std::filesystem::path& fn, unsigned int row_group);
+    void header(const std::vector<std::pair<std::string, tds::server_type>>& columns) override;
+    void row(const std::vector<tds::Field>& columns) override;
+    void finish() override;
+    std::string mime() const override;
+    std::string filename() const override;
+
+private:
+    struct block {
+        uint64_t offset;
+        uint32_t meta_length;
+        uint64_t body_length;
+    };
+
+    void write_batch();
+    void write_message(const std::string& meta, const std::string& body, uint64_t body_length);
+    void out(const std::string_view& s);
+
+    std::ofstream f;
+    unsigned int row_group;
+    columnar_batch batch;
+    bool have_schema = false;
+    bool skipping = false;
+    std::vector<block> blocks;
+    uint64_t offset = 0;
+};
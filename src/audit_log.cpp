@@ -0,0 +1,504 @@
+#include <fstream>
+#include <algorithm>
+#include <array>
+#include <utility>
+#include <time.h>
+#include "audit_log.h"
+#include "config.h"
+#include "tdsweb.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+using namespace std;
+using json = nlohmann::json;
+
+// the writer wakes up when this many entries are waiting, or after AUDIT_FLUSH_INTERVAL
+static const size_t AUDIT_BATCH_SIZE = 500;
+static const auto AUDIT_FLUSH_INTERVAL = chrono::seconds(1);
+
+// the most rows inserted in one transaction
+static const size_t AUDIT_INSERT_ROWS = 1000;
+
+// the most rows in one INSERT - each has five parameters, and SQL Server allows 2100
+static const size_t AUDIT_VALUES_ROWS = 256;
+
+// how long the writer keeps a connection it hasn't used
+static const auto AUDIT_CONN_IDLE = chrono::seconds(60);
+
+static const char DB_APP[] = "tdsweb";
+
+// beyond this, entries go straight to the journal rather than using more memory
+static const size_t AUDIT_QUEUE_MAX = 100000;
+
+unique_ptr<audit_log> audit;
+
+// local time, to match what GETDATE() would have given
+static string iso_time(chrono::system_clock::time_point tp) {
+    auto t = chrono::system_clock::to_time_t(tp);
+    auto ms = (unsigned int)(chrono::duration_cast<chrono::milliseconds>(tp.time_since_epoch()).count() % 1000);
+    struct tm tm;
+    char buf[32];
+
+#ifdef _WIN32
+    localtime_s(&tm, &t);
+#else
+    localtime_r(&t, &tm);
+#endif
+
+    auto len = strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    snprintf(buf + len, sizeof(buf) - len, ".%03u", ms);
+
+    return buf;
+}
+
+// Relative to the executable rather than the working directory, which for a Windows
+// service is System32.
+static filesystem::path exe_dir() {
+#ifdef _WIN32
+    wchar_t buf[MAX_PATH];
+    auto len = GetModuleFileNameW(nullptr, buf, MAX_PATH);
+
+    if (len == 0 || len == MAX_PATH)
+        throw runtime_error("GetModuleFileName failed.");
+
+    return filesystem::path(wstring_view(buf, len)).parent_path();
+#else
+    return filesystem::read_symlink("/proc/self/exe").parent_path();
+#endif
+}
+
+audit_log::audit_log() {
+    run_id = make_token().substr(0, 16);
+
+    journal_path = config.audit_journal;
+
+    if (journal_path.is_relative())
+        journal_path = exe_dir() / journal_path;
+
+    // whatever the last run left is kept, as it might have starts that never finished
+    {
+        error_code ec;
+
+        if (filesystem::file_size(journal_path, ec) > 0 && !ec)
+            archive_journal();
+    }
+
+    t = thread(&audit_log::run, this);
+}
+
+audit_log::~audit_log() {
+    {
+        lock_guard<mutex> lg(lock);
+
+        stop = true;
+        cv.notify_one();
+    }
+
+    t.join();
+
+    // closed here rather than by the writer, so that destroying conns doesn't race with it
+    conns.clear();
+}
+
+// Throws if the start can't be journaled, in which case the query mustn't run.
+void audit_log::start(audit_entry& e) {
+    {
+        lock_guard<mutex> lg(lock);
+
+        e.id = run_id + "-" + to_string(next_id++);
+    }
+
+    lock_guard<mutex> lg(journal_lock);
+
+    open_journal();
+
+    journal_file << json{
+        {"event", "start"},
+        {"id", e.id},
+        {"server", e.server},
+        {"username", e.username},
+        {"query", e.query},
+        {"start_time", iso_time(e.start)}
+    }.dump(-1, ' ', false, json::error_handler_t::replace) << "\n";
+
+    journal_file.flush();
+
+    if (!journal_file) {
+        // try opening it again next time
+        journal_file.close();
+        journal_file.clear();
+
+        lock_guard<mutex> lg2(lock);
+
+        start_failures++;
+
+        throw runtime_error("Unable to write to the query log, so the query can't be run.");
+    }
+
+    open_starts++;
+
+    lock_guard<mutex> lg2(lock);
+
+    started++;
+}
+
+// For a query that was journaled but never got as far as running.
+void audit_log::abandon(const audit_entry& e) {
+    lock_guard<mutex> lg(journal_lock);
+
+    open_journal();
+
+    journal_file << json{
+        {"event", "abandoned"},
+        {"id", e.id}
+    }.dump() << "\n";
+
+    journal_file.flush();
+
+    {
+        lock_guard<mutex> lg2(lock);
+
+        abandoned++;
+    }
+
+    journal_settled(1);
+}
+
+void audit_log::add(audit_entry&& e) {
+    {
+        lock_guard<mutex> lg(lock);
+
+        queued++;
+
+        if (queue.size() < AUDIT_QUEUE_MAX) {
+            queue.push_back(move(e));
+
+            if (queue.size() >= AUDIT_BATCH_SIZE)
+                cv.notify_one();
+
+            return;
+        }
+    }
+
+    vector<audit_entry> v;
+
+    v.push_back(move(e));
+    journal(v.begin(), v.end());
+}
+
+void audit_log::run() {
+    unique_lock<mutex> ul(lock);
+    vector<audit_entry> batch;
+
+    while (true) {
+        cv.wait_for(ul, AUDIT_FLUSH_INTERVAL, [&]() {
+            return stop || queue.size() >= AUDIT_BATCH_SIZE;
+        });
+
+        if (queue.empty()) {
+            if (stop)
+                break;
+
+            ul.unlock();
+            close_idle_conns();
+            ul.lock();
+
+            continue;
+        }
+
+        batch.swap(queue);
+
+        ul.unlock();
+
+        write(batch);
+        batch.clear();
+
+        ul.lock();
+    }
+}
+
+// Which connection an entry gets inserted on.
+static string conn_key(const audit_entry& e) {
+    if (!config.audit_username.empty())
+        return e.server;
+
+    return e.server + '\0' + e.username + '\0' + e.password;
+}
+
+void audit_log::write(vector<audit_entry>& entries) {
+    stable_sort(entries.begin(), entries.end(), [](const audit_entry& a, const audit_entry& b) {
+        return conn_key(a) < conn_key(b);
+    });
+
+    auto it = entries.begin();
+
+    while (it != entries.end()) {
+        auto end = it + 1;
+        auto key = conn_key(*it);
+
+        while (end != entries.end() && (size_t)(end - it) < AUDIT_INSERT_ROWS && conn_key(*end) == key) {
+            end++;
+        }
+
+        try {
+            insert(it, end);
+
+            {
+                lock_guard<mutex> lg(lock);
+
+                written += (uint64_t)(end - it);
+                batches++;
+            }
+
+            journal_logged(it, end);
+        } catch (...) {
+            {
+                lock_guard<mutex> lg(lock);
+
+                failures++;
+            }
+
+            journal(it, end);
+        }
+
+        it = end;
+    }
+}
+
+template<size_t N, size_t... I>
+static void run_insert(tds::Conn& conn, const string& sql, const array<string, N>& params, index_sequence<I...>) {
+    conn.run(sql, params[I]...);
+}
+
+// Inserts as many ROWS-row chunks as there are, then hands what's left on to ROWS / 2,
+// so the number of rows in a statement, and so its parameters, are known at compile time.
+// The numbers go as strings, so that every parameter has the same type.
+template<size_t ROWS>
+static void insert_chunks(tds::Conn& conn, const string& cols, vector<audit_entry>::iterator& it,
+                          vector<audit_entry>::iterator end) {
+    if ((size_t)(end - it) >= ROWS) {
+        string sql = "INSERT INTO master.dbo.query_log(" + cols + ") SELECT " + cols + " FROM (VALUES";
+
+        for (size_t i = 0; i < ROWS; i++) {
+            sql += i == 0 ? "(" : ", (";
+            sql += "?, ?, CAST(? AS DATETIME2(3)), CAST(? AS BIGINT), CAST(? AS BIGINT))";
+        }
+
+        sql += ") v(query, username, start_time, duration_ms, row_count)";
+
+        do {
+            array<string, ROWS * 5> params;
+
+            for (size_t i = 0; i < ROWS; i++, it++) {
+                params[(i * 5) + 0] = it->query;
+                params[(i * 5) + 1] = it->username;
+                params[(i * 5) + 2] = iso_time(it->start);
+                params[(i * 5) + 3] = to_string(it->duration_ms);
+                params[(i * 5) + 4] = to_string(it->row_count);
+            }
+
+            run_insert(conn, sql, params, make_index_sequence<ROWS * 5>{});
+        } while ((size_t)(end - it) >= ROWS);
+    }
+
+    if constexpr (ROWS > 1)
+        insert_chunks<ROWS / 2>(conn, cols, it, end);
+}
+
+// The entries go in multi-row INSERTs, inside one transaction so that it's a single
+// commit. If anything goes wrong the connection's thrown away, which rolls back whatever
+// got done.
+void audit_log::insert(vector<audit_entry>::iterator begin, vector<audit_entry>::iterator end) {
+    auto key = conn_key(*begin);
+    auto& ac = conns[key];
+
+    try {
+        if (!ac.conn || ac.conn->is_dead()) {
+            ac.conn.reset();
+
+            if (!config.audit_username.empty())
+                ac.conn.reset(new tds::Conn(begin->server, config.audit_username, config.audit_password, DB_APP));
+            else
+                ac.conn.reset(new tds::Conn(begin->server, begin->username, begin->password, DB_APP));
+        }
+
+        auto& conn = *ac.conn;
+
+        if (columns.empty()) {
+            tds::Query sq(conn, "SELECT name FROM master.sys.columns WHERE object_id = OBJECT_ID('master.dbo.query_log')");
+
+            while (sq.fetch_row()) {
+                columns.push_back((string)sq[0]);
+            }
+
+            if (columns.empty())
+                throw runtime_error("master.dbo.query_log not found.");
+
+            // every entry's values are bound, and the SELECT picks out the ones the table has
+            insert_cols = "query";
+
+            for (auto c : { "username", "start_time", "duration_ms", "row_count" }) {
+                if (find(columns.begin(), columns.end(), c) != columns.end()) {
+                    insert_cols += ", ";
+                    insert_cols += c;
+                }
+            }
+        }
+
+        conn.run("SET NOCOUNT ON; BEGIN TRANSACTION");
+
+        auto it = begin;
+
+        insert_chunks<AUDIT_VALUES_ROWS>(conn, insert_cols, it, end);
+
+        conn.run("COMMIT");
+
+        ac.last_used = chrono::steady_clock::now();
+    } catch (...) {
+        conns.erase(key);
+        throw;
+    }
+}
+
+void audit_log::close_idle_conns() {
+    auto cutoff = chrono::steady_clock::now() - AUDIT_CONN_IDLE;
+
+    for (auto it = conns.begin(); it != conns.end(); ) {
+        if (it->second.last_used <= cutoff)
+            it = conns.erase(it);
+        else
+            it++;
+    }
+}
+
+// Called with journal_lock held.
+void audit_log::open_journal() {
+    if (!journal_file.is_open())
+        journal_file.open(journal_path, ios::app | ios::binary);
+}
+
+// Called with journal_lock held, or before the writer's started. Renamed to
+// query_log-YYYYMMDD-HHMMSS.jsonl, with a number added if that's taken.
+void audit_log::archive_journal() {
+    auto t = chrono::system_clock::to_time_t(chrono::system_clock::now());
+    struct tm tm;
+    char buf[32];
+
+#ifdef _WIN32
+    localtime_s(&tm, &t);
+#else
+    localtime_r(&t, &tm);
+#endif
+
+    strftime(buf, sizeof(buf), "-%Y%m%d-%H%M%S", &tm);
+
+    auto base = journal_path.stem().string() + buf;
+    auto fn = journal_path.parent_path() / (base + journal_path.extension().string());
+    error_code ec;
+
+    for (unsigned int i = 2; filesystem::exists(fn, ec); i++) {
+        fn = journal_path.parent_path() / (base + "-" + to_string(i) + journal_path.extension().string());
+    }
+
+    journal_file.close();
+    journal_file.clear();
+
+    filesystem::rename(journal_path, fn, ec);
+
+    if (!ec) {
+        lock_guard<mutex> lg(lock);
+
+        archives++;
+    }
+}
+
+// Called with journal_lock held, once n more starts have been accounted for. If that's
+// all of them, the journal's got nothing we'd need after a crash.
+void audit_log::journal_settled(uint64_t n) {
+    open_starts -= n;
+
+    if (open_starts > 0)
+        return;
+
+    if (journal_has_finishes) {
+        archive_journal();
+        journal_has_finishes = false;
+        return;
+    }
+
+    journal_file.close();
+    journal_file.clear();
+    journal_file.open(journal_path, ios::trunc | ios::binary);
+
+    lock_guard<mutex> lg(lock);
+
+    truncations++;
+}
+
+// never includes the password
+void audit_log::journal(vector<audit_entry>::iterator begin, vector<audit_entry>::iterator end) {
+    lock_guard<mutex> lg(journal_lock);
+
+    open_journal();
+
+    for (auto it = begin; it != end; it++) {
+        journal_file << json{
+            {"event", "finish"},
+            {"id", it->id},
+            {"server", it->server},
+            {"username", it->username},
+            {"query", it->query},
+            {"start_time", iso_time(it->start)},
+            {"duration_ms", it->duration_ms},
+            {"row_count", it->row_count}
+        }.dump(-1, ' ', false, json::error_handler_t::replace) << "\n";
+    }
+
+    journal_file.flush();
+    journal_has_finishes = true;
+
+    {
+        lock_guard<mutex> lg2(lock);
+
+        journaled += (uint64_t)(end - begin);
+    }
+
+    journal_settled((uint64_t)(end - begin));
+}
+
+// Not flushed, as losing these only means the entry might get looked for later.
+void audit_log::journal_logged(vector<audit_entry>::iterator begin, vector<audit_entry>::iterator end) {
+    lock_guard<mutex> lg(journal_lock);
+
+    open_journal();
+
+    for (auto it = begin; it != end; it++) {
+        journal_file << json{
+            {"event", "logged"},
+            {"id", it->id}
+        }.dump() << "\n";
+    }
+
+    journal_settled((uint64_t)(end - begin));
+}
+
+json audit_log::get_stats() {
+    lock_guard<mutex> lg(lock);
+
+    return json{
+        {"started", started},
+        {"start_failures", start_failures},
+        {"queued", queued},
+        {"waiting", queue.size()},
+        {"written", written},
+        {"batches", batches},
+        {"journaled", journaled},
+        {"failures", failures},
+        {"abandoned", abandoned},
+        {"journal_truncations", truncations},
+        {"journal_archives", archives}
+    };
+}
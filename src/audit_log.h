@@ -0,0 +1,111 @@
+#pragma once
+
+#include <tdscpp.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <chrono>
+#include <fstream>
+#include <filesystem>
+#include <stdint.h>
+#include <nlohmann/json.hpp>
+
+#ifdef __MINGW32__
+#include "mingw.thread.h"
+#include "mingw.mutex.h"
+#include "mingw.condition_variable.h"
+#else
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#endif
+
+// Writes the query log. Before a query runs, start writes a "start" line to the journal
+// file and flushes it, and if that fails the query doesn't run - so a query can't go
+// unlogged, even if we crash or get killed while it's running.
+//
+// Finished queries are queued here, and a writer thread inserts them into
+// master.dbo.query_log in batches. Besides query, it fills in whichever of username,
+// start_time, duration_ms and row_count the table has. The writer has connections of its
+// own, outside the pool, so it can't hold up users' sessions or be held up by them: one
+// per server logging in as audit_username if that's set, otherwise one per user with
+// their own credentials. They're closed once they've been idle for a while.
+//
+// Once inserted, an entry gets a "logged" line in the journal. If the insert fails, or
+// the queue gets too long, it gets a "finish" line with everything instead. A "start"
+// with neither is a query that never finished.
+//
+// Whenever every start has been accounted for, the journal's emptied - or if it's got
+// "finish" lines, which are the only record of those queries, it's renamed aside with
+// the time appended. The same happens to whatever a previous run left behind. Ids are
+// prefixed with a random token for each run, so they can't be confused across runs.
+
+struct audit_entry {
+    std::string server;
+    std::string username;
+    std::string password;
+    std::string query;
+    std::chrono::system_clock::time_point start;
+    uint64_t duration_ms;
+    uint64_t row_count;
+    std::string id{}; // set by start
+};
+
+class audit_log {
+public:
+    audit_log();
+    ~audit_log();
+    void start(audit_entry& e);
+    void add(audit_entry&& e);
+    void abandon(const audit_entry& e);
+    nlohmann::json get_stats();
+
+private:
+    struct audit_conn {
+        std::unique_ptr<tds::Conn> conn;
+        std::chrono::steady_clock::time_point last_used;
+    };
+
+    void run();
+    void write(std::vector<audit_entry>& entries);
+    void insert(std::vector<audit_entry>::iterator begin, std::vector<audit_entry>::iterator end);
+    void journal(std::vector<audit_entry>::iterator begin, std::vector<audit_entry>::iterator end);
+    void journal_logged(std::vector<audit_entry>::iterator begin, std::vector<audit_entry>::iterator end);
+    void close_idle_conns();
+    void open_journal();
+    void archive_journal();
+    void journal_settled(uint64_t n);
+
+    std::mutex lock;
+    std::condition_variable cv;
+    std::vector<audit_entry> queue;
+    bool stop = false;
+    std::string run_id;
+    uint64_t next_id = 1;
+    std::filesystem::path journal_path;
+    std::mutex journal_lock;
+    std::ofstream journal_file; // protected by journal_lock
+    uint64_t open_starts = 0; // protected by journal_lock
+    bool journal_has_finishes = false; // protected by journal_lock
+
+    // only used by the writer thread
+    std::vector<std::string> columns;
+    std::string insert_cols;
+    std::unordered_map<std::string, audit_conn> conns;
+
+    std::thread t;
+
+    uint64_t started = 0;
+    uint64_t start_failures = 0;
+    uint64_t queued = 0;
+    uint64_t written = 0;
+    uint64_t batches = 0;
+    uint64_t journaled = 0;
+    uint64_t failures = 0;
+    uint64_t abandoned = 0;
+    uint64_t truncations = 0;
+    uint64_t archives = 0;
+};
+
+extern std::unique_ptr<audit_log> audit;
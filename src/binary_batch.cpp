@@ -0,0 +1,261 @@
+#include "binary_batch.h"
+#include "byte_writer.h"
+#include "tdsweb.h"
+
+using namespace std;
+
+// sets the row's bit in the null bitmap, and returns true if the value is NULL
+static bool mark_null(bin_column& c, unsigned int row, const tds::Field& col) {
+    bool null = col.is_null();
+
+    append_bit(c.nulls, row, null);
+
+    return null;
+}
+
+template<bin_type T>
+static void encode_binary(bin_column& c, unsigned int row, const tds::Field& col);
+
+template<>
+void encode_binary<bin_type::INT32>(bin_column& c, unsigned int row, const tds::Field& col) {
+    append_le(c.data, (uint32_t)(mark_null(c, row, col) ? 0 : (int32_t)(int64_t)col));
+}
+
+template<>
+void encode_binary<bin_type::INT64>(bin_column& c, unsigned int row, const tds::Field& col) {
+    append_le(c.data, (uint64_t)(mark_null(c, row, col) ? 0 : (int64_t)col));
+}
+
+template<>
+void encode_binary<bin_type::FLOAT64>(bin_column& c, unsigned int row, const tds::Field& col) {
+    append_double(c.data, mark_null(c, row, col) ? 0.0 : (double)col);
+}
+
+template<>
+void encode_binary<bin_type::BOOL>(bin_column& c, unsigned int row, const tds::Field& col) {
+    c.data += (char)(mark_null(c, row, col) ? 0 : ((int)col != 0 ? 1 : 0));
+}
+
+template<>
+void encode_binary<bin_type::STRING>(bin_column& c, unsigned int row, const tds::Field& col) {
+    if (!mark_null(c, row, col))
+        c.strings += (string)col;
+
+    append_le(c.offsets, (uint32_t)c.strings.length());
+}
+
+template<>
+void encode_binary<bin_type::STRING_DICT>(bin_column& c, unsigned int row, const tds::Field& col) {
+    const string* added;
+    uint32_t id = 0;
+
+    if (!mark_null(c, row, col)) {
+        id = c.dict.lookup((string)col, added);
+
+        if (added) {
+            c.strings += *added;
+            append_le(c.offsets, (uint32_t)c.strings.length());
+            c.dict_new++;
+        }
+    }
+
+    append_le(c.data, id);
+}
+
+template<>
+void encode_binary<bin_type::DATE>(bin_column& c, unsigned int row, const tds::Field& col) {
+    int32_t v = 0;
+
+    if (!mark_null(c, row, col)) {
+        auto d = (tds::Date)col;
+
+        v = days_from_civil(d.year(), d.month(), d.day());
+    }
+
+    append_le(c.data, (uint32_t)v);
+}
+
+template<>
+void encode_binary<bin_type::TIME>(bin_column& c, unsigned int row, const tds::Field& col) {
+    int32_t v = 0;
+
+    if (!mark_null(c, row, col)) {
+        auto t = (tds::Time)col;
+
+        v = (t.h * 3600) + (t.m * 60) + t.s;
+    }
+
+    append_le(c.data, (uint32_t)v);
+}
+
+template<>
+void encode_binary<bin_type::DATETIME>(bin_column& c, unsigned int row, const tds::Field& col) {
+    double v = 0.0;
+
+    if (!mark_null(c, row, col)) {
+        auto dt = (tds::DateTime)col;
+
+        v = ((double)days_from_civil(dt.d.year(), dt.d.month(), dt.d.day()) * 86400.0) +
+            (dt.t.h * 3600) + (dt.t.m * 60) + dt.t.s;
+    }
+
+    append_double(c.data, v);
+}
+
+static bin_type get_bin_type(tds::server_type type) {
+    switch (classify_type(type)) {
+        case type_class::int32:
+            return bin_type::INT32;
+
+        case type_class::int64:
+            return bin_type::INT64;
+
+        case type_class::floating:
+            return bin_type::FLOAT64;
+
+        case type_class::bit:
+            return bin_type::BOOL;
+
+        case type_class::date:
+            return bin_type::DATE;
+
+        case type_class::time:
+            return bin_type::TIME;
+
+        case type_class::datetime:
+            return bin_type::DATETIME;
+
+        default:
+            return bin_type::STRING;
+    }
+}
+
+static binary_encoder get_binary_encoder(bin_type type) {
+    switch (type) {
+        case bin_type::INT32:
+            return encode_binary<bin_type::INT32>;
+
+        case bin_type::INT64:
+            return encode_binary<bin_type::INT64>;
+
+        case bin_type::FLOAT64:
+            return encode_binary<bin_type::FLOAT64>;
+
+        case bin_type::BOOL:
+            return encode_binary<bin_type::BOOL>;
+
+        case bin_type::DATE:
+            return encode_binary<bin_type::DATE>;
+
+        case bin_type::TIME:
+            return encode_binary<bin_type::TIME>;
+
+        case bin_type::DATETIME:
+            return encode_binary<bin_type::DATETIME>;
+
+        case bin_type::STRING_DICT:
+            return encode_binary<bin_type::STRING_DICT>;
+
+        default:
+            return encode_binary<bin_type::STRING>;
+    }
+}
+
+void binary_batch::reset(const vector<pair<string, tds::server_type>>& columns) {
+    cols.resize(columns.size());
+    plan.resize(columns.size());
+    string_cols.resize(columns.size());
+
+    for (size_t i = 0; i < columns.size(); i++) {
+        cols[i].type = get_bin_type(get<1>(columns[i]));
+        string_cols[i] = cols[i].type == bin_type::STRING;
+        cols[i].dict.reset();
+    }
+
+    clear();
+}
+
+void binary_batch::clear() {
+    // clear() keeps the buffers' capacity, so they get reused for the next batch
+    for (size_t i = 0; i < cols.size(); i++) {
+        auto& c = cols[i];
+
+        c.nulls.clear();
+        c.data.clear();
+        c.offsets.clear();
+        c.strings.clear();
+
+        // string columns decide whether to use the dictionary for each batch
+        if (string_cols[i]) {
+            c.dict.end_batch();
+            c.type = c.dict.enabled ? bin_type::STRING_DICT : bin_type::STRING;
+            c.dict_new = 0;
+            append_le(c.offsets, (uint32_t)0);
+        }
+
+        plan[i] = get_binary_encoder(c.type);
+    }
+
+    rows = 0;
+}
+
+void binary_batch::add_row(const vector<tds::Field>& columns) {
+    for (size_t i = 0; i < columns.size(); i++) {
+        plan[i](cols[i], rows, columns[i]);
+    }
+
+    rows++;
+}
+
+size_t binary_batch::size() const {
+    size_t len = 0;
+
+    for (const auto& c : cols) {
+        len += c.nulls.length() + c.data.length() + c.offsets.length() + c.strings.length();
+    }
+
+    return len;
+}
+
+void binary_batch::write(string& frame) const {
+    frame.clear();
+
+    frame += (char)BINARY_FRAME_ROWS;
+    frame += (char)1; // version
+    append_le(frame, (uint16_t)cols.size());
+    append_le(frame, (uint32_t)rows);
+
+    for (const auto& c : cols) {
+        frame += (char)c.type;
+    }
+
+    pad8(frame);
+
+    for (const auto& c : cols) {
+        frame += c.nulls;
+        pad8(frame);
+
+        switch (c.type) {
+            case bin_type::STRING:
+                frame += c.offsets;
+                pad8(frame);
+                frame += c.strings;
+                pad8(frame);
+            break;
+
+            case bin_type::STRING_DICT:
+                frame += c.data;
+                pad8(frame);
+                append_le(frame, c.dict_new);
+                frame += c.offsets;
+                pad8(frame);
+                frame += c.strings;
+                pad8(frame);
+            break;
+
+            default:
+                frame += c.data;
+                pad8(frame);
+        }
+    }
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <tdscpp.h>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "string_dict.h"
+
+// Column-oriented binary encoding of a batch of rows, used instead of JSON when the
+// browser asks for "format": "binary" in its query message.
+//
+// Everything is little-endian, and every section starts on an 8-byte boundary so that
+// the browser can map it straight onto a typed array:
+//
+//   u8  frame type (BINARY_FRAME_ROWS)
+//   u8  version (1)
+//   u16 number of columns
+//   u32 number of rows
+//   u8  wire type of each column (enum bin_type), padded
+//
+// then for each column:
+//
+//   null bitmap, one bit per row, LSB first, bit set if NULL, padded
+//   values, depending on the column's type:
+//     INT32 / DATE / TIME: int32 per row
+//     INT64: int64 per row
+//     FLOAT64 / DATETIME: double per row
+//     BOOL: u8 per row
+//     STRING: u32 offset per row plus one, padded, then the UTF-8 data, padded
+//     STRING_DICT: u32 dictionary id per row, padded, then the entries this batch adds
+//       to the column's dictionary: u32 count, u32 offset per entry plus one, padded,
+//       then the UTF-8 data, padded
+//
+// DATE is days since 1970-01-01, TIME seconds since midnight, and DATETIME seconds
+// since 1970-01-01. NULL values are zero. Dictionaries last for the whole result set,
+// and a string column can switch between STRING and STRING_DICT from batch to batch.
+
+static const uint8_t BINARY_FRAME_ROWS = 1;
+
+enum class bin_type : uint8_t {
+    INT32 = 1,
+    INT64,
+    FLOAT64,
+    BOOL,
+    STRING,
+    DATE,
+    TIME,
+    DATETIME,
+    STRING_DICT
+};
+
+struct bin_column {
+    bin_type type;
+    std::string nulls;
+    std::string data;
+    std::string offsets;
+    std::string strings;
+    string_dict dict;
+    uint32_t dict_new;
+};
+
+typedef void (*binary_encoder)(bin_column& c, unsigned int row, const tds::Field& col);
+
+class binary_batch {
+public:
+    void reset(const std::vector<std::pair<std::string, tds::server_type>>& columns);
+    void add_row(const std::vector<tds::Field>& columns);
+    void write(std::string& frame) const;
+    void clear();
+    size_t size() const;
+
+    unsigned int rows = 0;
+
+private:
+    std::vector<bin_column> cols;
+    std::vector<binary_encoder> plan;
+    std::vector<bool> string_cols;
+};
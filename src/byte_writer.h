@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string>
+#include <string.h>
+#include <stdint.h>
+
+// Little-endian output helpers for the binary formats - the browser's binary rows,
+// Parquet, Arrow, and ZIP - appending onto a caller-owned buffer.
+
+template<typename T>
+static inline void append_le(std::string& s, T v) {
+    for (size_t i = 0; i < sizeof(T); i++) {
+        s += (char)(uint8_t)(v & 0xff);
+        v >>= 8;
+    }
+}
+
+static inline void append_double(std::string& s, double v) {
+    uint64_t u;
+
+    memcpy(&u, &v, sizeof(u));
+
+    append_le(s, u);
+}
+
+// pads to a multiple of 8 bytes with zeros
+static inline void pad8(std::string& s) {
+    s.append((8 - (s.length() % 8)) % 8, 0);
+}
+
+// sets a row's bit in a bitmap, LSB first, adding a byte for every eighth row
+static inline void append_bit(std::string& bitmap, unsigned int row, bool bit) {
+    if ((row & 7) == 0)
+        bitmap += (char)0;
+
+    if (bit)
+        bitmap.back() |= (char)(1 << (row & 7));
+}
@@ -0,0 +1,193 @@
+#include "columnar.h"
+#include "byte_writer.h"
+#include "tdsweb.h"
+
+using namespace std;
+
+// sets the row's bit in the validity bitmap, and returns true if the value is NULL
+static bool mark_valid(columnar_column& c, unsigned int row, const tds::Field& col) {
+    bool null = col.is_null();
+
+    append_bit(c.validity, row, !null);
+
+    if (null)
+        c.null_count++;
+
+    return null;
+}
+
+template<columnar_type T>
+static void encode_columnar(columnar_column& c, unsigned int row, const tds::Field& col);
+
+template<>
+void encode_columnar<columnar_type::INT32>(columnar_column& c, unsigned int row, const tds::Field& col) {
+    append_le(c.data, (uint32_t)(mark_valid(c, row, col) ? 0 : (int32_t)(int64_t)col));
+}
+
+template<>
+void encode_columnar<columnar_type::INT64>(columnar_column& c, unsigned int row, const tds::Field& col) {
+    append_le(c.data, (uint64_t)(mark_valid(c, row, col) ? 0 : (int64_t)col));
+}
+
+template<>
+void encode_columnar<columnar_type::FLOAT64>(columnar_column& c, unsigned int row, const tds::Field& col) {
+    append_double(c.data, mark_valid(c, row, col) ? 0.0 : (double)col);
+}
+
+template<>
+void encode_columnar<columnar_type::BOOL>(columnar_column& c, unsigned int row, const tds::Field& col) {
+    bool null = mark_valid(c, row, col);
+
+    append_bit(c.data, row, !null && (int)col != 0);
+}
+
+template<>
+void encode_columnar<columnar_type::DATE32>(columnar_column& c, unsigned int row, const tds::Field& col) {
+    int32_t v = 0;
+
+    if (!mark_valid(c, row, col)) {
+        auto d = (tds::Date)col;
+
+        v = days_from_civil(d.year(), d.month(), d.day());
+    }
+
+    append_le(c.data, (uint32_t)v);
+}
+
+template<>
+void encode_columnar<columnar_type::TIME32_MS>(columnar_column& c, unsigned int row, const tds::Field& col) {
+    int32_t v = 0;
+
+    if (!mark_valid(c, row, col)) {
+        auto t = (tds::Time)col;
+
+        v = ((t.h * 3600) + (t.m * 60) + t.s) * 1000;
+    }
+
+    append_le(c.data, (uint32_t)v);
+}
+
+template<>
+void encode_columnar<columnar_type::TIMESTAMP_US>(columnar_column& c, unsigned int row, const tds::Field& col) {
+    int64_t v = 0;
+
+    if (!mark_valid(c, row, col)) {
+        auto dt = (tds::DateTime)col;
+
+        v = ((int64_t)days_from_civil(dt.d.year(), dt.d.month(), dt.d.day()) * 86400) +
+            (dt.t.h * 3600) + (dt.t.m * 60) + dt.t.s;
+        v *= 1000000;
+    }
+
+    append_le(c.data, (uint64_t)v);
+}
+
+template<>
+void encode_columnar<columnar_type::UTF8>(columnar_column& c, unsigned int row, const tds::Field& col) {
+    if (!mark_valid(c, row, col))
+        c.data += (string)col;
+
+    append_le(c.offsets, (uint32_t)c.data.length());
+}
+
+static columnar_type get_columnar_type(tds::server_type type) {
+    switch (classify_type(type)) {
+        case type_class::int32:
+            return columnar_type::INT32;
+
+        case type_class::int64:
+            return columnar_type::INT64;
+
+        case type_class::floating:
+            return columnar_type::FLOAT64;
+
+        case type_class::bit:
+            return columnar_type::BOOL;
+
+        case type_class::date:
+            return columnar_type::DATE32;
+
+        case type_class::time:
+            return columnar_type::TIME32_MS;
+
+        case type_class::datetime:
+            return columnar_type::TIMESTAMP_US;
+
+        default:
+            return columnar_type::UTF8;
+    }
+}
+
+static columnar_encoder get_columnar_encoder(columnar_type type) {
+    switch (type) {
+        case columnar_type::INT32:
+            return encode_columnar<columnar_type::INT32>;
+
+        case columnar_type::INT64:
+            return encode_columnar<columnar_type::INT64>;
+
+        case columnar_type::FLOAT64:
+            return encode_columnar<columnar_type::FLOAT64>;
+
+        case columnar_type::BOOL:
+            return encode_columnar<columnar_type::BOOL>;
+
+        case columnar_type::DATE32:
+            return encode_columnar<columnar_type::DATE32>;
+
+        case columnar_type::TIME32_MS:
+            return encode_columnar<columnar_type::TIME32_MS>;
+
+        case columnar_type::TIMESTAMP_US:
+            return encode_columnar<columnar_type::TIMESTAMP_US>;
+
+        default:
+            return encode_columnar<columnar_type::UTF8>;
+    }
+}
+
+void columnar_batch::reset(const vector<pair<string, tds::server_type>>& columns) {
+    cols.resize(columns.size());
+    plan.resize(columns.size());
+
+    for (size_t i = 0; i < columns.size(); i++) {
+        cols[i].name = get<0>(columns[i]);
+        cols[i].type = get_columnar_type(get<1>(columns[i]));
+        plan[i] = get_columnar_encoder(cols[i].type);
+    }
+
+    clear();
+}
+
+void columnar_batch::clear() {
+    // clear() keeps the buffers' capacity, so they get reused for the next batch
+    for (auto& c : cols) {
+        c.validity.clear();
+        c.data.clear();
+        c.offsets.clear();
+        c.null_count = 0;
+
+        if (c.type == columnar_type::UTF8)
+            append_le(c.offsets, (uint32_t)0);
+    }
+
+    rows = 0;
+}
+
+void columnar_batch::add_row(const vector<tds::Field>& columns) {
+    for (size_t i = 0; i < columns.size(); i++) {
+        plan[i](cols[i], rows, columns[i]);
+    }
+
+    rows++;
+}
+
+size_t columnar_batch::size() const {
+    size_t len = 0;
+
+    for (const auto& c : cols) {
+        len += c.validity.length() + c.data.length() + c.offsets.length();
+    }
+
+    return len;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <tdscpp.h>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// Rows buffered column by column, in the layout Arrow uses, for the Parquet and Arrow
+// exporters. Each column has a validity bitmap (bit set if not NULL, LSB first), then
+// depending on its type:
+//
+//   INT32 / DATE32 / TIME32_MS: int32 per row
+//   INT64 / TIMESTAMP_US: int64 per row
+//   FLOAT64: double per row
+//   BOOL: one bit per row, LSB first
+//   UTF8: int32 offset per row plus one, then the UTF-8 data
+//
+// DATE32 is days since 1970-01-01, TIME32_MS milliseconds since midnight, and
+// TIMESTAMP_US microseconds since 1970-01-01, with no time zone. NULLs take up a slot,
+// with a value of zero.
+
+enum class columnar_type {
+    INT32,
+    INT64,
+    FLOAT64,
+    BOOL,
+    DATE32,
+    TIME32_MS,
+    TIMESTAMP_US,
+    UTF8
+};
+
+struct columnar_column {
+    std::string name;
+    columnar_type type;
+    std::string validity;
+    std::string data;
+    std::string offsets;
+    uint64_t null_count;
+};
+
+typedef void (*columnar_encoder)(columnar_column& c, unsigned int row, const tds::Field& col);
+
+class columnar_batch {
+public:
+    void reset(const std::vector<std::pair<std::string, tds::server_type>>& columns);
+    void add_row(const std::vector<tds::Field>& columns);
+    void clear();
+    size_t size() const;
+
+    std::vector<columnar_column> cols;
+    unsigned int rows = 0;
+
+private:
+    std::vector<columnar_encoder> plan;
+};
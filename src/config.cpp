@@ -0,0 +1,105 @@
+#include <string>
+#include <stdexcept>
+#include <charconv>
+#include "config.h"
+
+using namespace std;
+
+config_t config;
+
+static unsigned int parse_uint(const string_view& name, const string_view& value) {
+    unsigned int v;
+
+    auto r = from_chars(value.data(), value.data() + value.length(), v);
+
+    if (r.ec != errc() || r.ptr != value.data() + value.length())
+        throw runtime_error("Invalid value \"" + string(value) + "\" for option " + string(name) + ".");
+
+    return v;
+}
+
+void parse_option(const string_view& opt) {
+    auto eq = opt.find('=');
+
+    if (eq == string_view::npos)
+        throw runtime_error("Option \"" + string(opt) + "\" not in form name=value.");
+
+    auto name = opt.substr(0, eq);
+    auto value = opt.substr(eq + 1);
+
+    if (name == "pool_max_idle")
+        config.pool_max_idle = parse_uint(name, value);
+    else if (name == "pool_idle_timeout")
+        config.pool_idle_timeout = chrono::seconds(parse_uint(name, value));
+    else if (name == "executor_threads")
+        config.executor_threads = parse_uint(name, value);
+    else if (name == "blocking_threads") {
+        config.blocking_threads = parse_uint(name, value);
+
+        if (config.blocking_threads == 0)
+            throw runtime_error("blocking_threads must be at least 1.");
+    }
+    else if (name == "cancel_timeout")
+        config.cancel_timeout = chrono::seconds(parse_uint(name, value));
+    else if (name == "credit_timeout")
+        config.credit_timeout = chrono::seconds(parse_uint(name, value));
+    else if (name == "resume_grace")
+        config.resume_grace = chrono::seconds(parse_uint(name, value));
+    else if (name == "idle_timeout")
+        config.idle_timeout = chrono::seconds(parse_uint(name, value));
+    else if (name == "db_cache_ttl")
+        config.db_cache_ttl = chrono::seconds(parse_uint(name, value));
+    else if (name == "audit_journal")
+        config.audit_journal = value;
+    else if (name == "audit_username")
+        config.audit_username = value;
+    else if (name == "audit_password")
+        config.audit_password = value;
+    else if (name == "export_dir")
+        config.export_dir = value;
+    else if (name == "export_row_group") {
+        config.export_row_group = parse_uint(name, value);
+
+        if (config.export_row_group == 0)
+            throw runtime_error("export_row_group must be at least 1.");
+    } else if (name == "download_port") {
+        config.download_port = parse_uint(name, value);
+
+        if (config.download_port > 0xffff)
+            throw runtime_error("download_port out of range.");
+    } else if (name == "download_url")
+        config.download_url = value;
+    else if (name == "download_ttl")
+        config.download_ttl = chrono::seconds(parse_uint(name, value));
+    else if (name == "download_max_connections") {
+        config.download_max_connections = parse_uint(name, value);
+
+        if (config.download_max_connections == 0)
+            throw runtime_error("download_max_connections must be at least 1.");
+    }
+    else if (name == "export_jobs_per_user")
+        config.export_jobs_per_user = parse_uint(name, value);
+    else if (name == "export_jobs_max")
+        config.export_jobs_max = parse_uint(name, value);
+    else if (name == "export_job_ttl")
+        config.export_job_ttl = chrono::seconds(parse_uint(name, value));
+    else
+        throw runtime_error("Unrecognized option \"" + string(name) + "\".");
+}
+
+// space-separated list of options
+void parse_options(const string_view& opts) {
+    size_t pos = 0;
+
+    while (pos < opts.length()) {
+        auto end = opts.find(' ', pos);
+
+        if (end == string_view::npos)
+            end = opts.length();
+
+        if (end > pos)
+            parse_option(opts.substr(pos, end - pos));
+
+        pos = end + 1;
+    }
+}
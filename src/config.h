@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <chrono>
+
+// Tunables, which can be overridden on the command line as name=value, or for the
+// Windows service by the "Options" registry value.
+
+struct config_t {
+    unsigned int pool_max_idle = 10; // idle connections kept for each login
+    std::chrono::seconds pool_idle_timeout{300};
+    unsigned int executor_threads = 0; // 0 means one per core
+    unsigned int blocking_threads = 64; // most queries and background exports running at once
+    std::chrono::seconds cancel_timeout{10}; // before KILLing a cancelled query's session, 0 to never
+    std::chrono::seconds credit_timeout{300}; // before cancelling a query the browser's stopped asking for rows from, 0 to never
+    std::chrono::seconds resume_grace{60}; // how long a disconnected session waits to be resumed
+    std::chrono::seconds idle_timeout{900}; // before an idle session gives up its connection, 0 to never
+    std::chrono::seconds db_cache_ttl{30}; // before the cached database list gets checked again
+    std::string audit_journal = "query_log.jsonl"; // where queries are journaled as they start, and the log goes if it can't be written to the server; relative to the executable
+    std::string audit_username; // login for writing the query log, empty to use each user's own
+    std::string audit_password;
+    std::string export_dir; // where exported files are written before being sent, empty for the temp directory
+    unsigned int export_row_group = 65536; // rows per row group or record batch in Parquet and Arrow exports
+    unsigned int download_port = 0; // for serving exports over HTTP, 0 to send them over the WebSocket instead
+    std::string download_url = "/download/"; // what the proxy maps to download_port, with the token appended
+    std::chrono::seconds download_ttl{300}; // before an export nobody's finished downloading is deleted
+    unsigned int download_max_connections = 64; // downloads being served at once
+    unsigned int export_jobs_per_user = 2; // background exports each user can have running at once, 0 to disallow
+    unsigned int export_jobs_max = 16; // background exports running at once across all users
+    std::chrono::seconds export_job_ttl{86400}; // how long a finished background export is kept
+};
+
+extern config_t config;
+
+void parse_option(const std::string_view& opt);
+void parse_options(const std::string_view& opts);
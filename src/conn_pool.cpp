@@ -0,0 +1,282 @@
+#include <iostream>
+#include "conn_pool.h"
+#include "config.h"
+
+using namespace std;
+using json = nlohmann::json;
+
+static const string DB_APP = "tdsweb";
+
+// connections idle for longer than this get checked before being handed out
+static const auto POOL_HEALTH_CHECK_AFTER = chrono::seconds(30);
+
+// Puts a connection back the way a fresh login would have it, as near as we can without
+// sp_reset_connection: roll back anything left open, drop the session's temporary
+// tables, and put the SET options and database back to their defaults.
+static const char RESET_SQL[] = R"(IF @@TRANCOUNT > 0 ROLLBACK;
+DECLARE @tdsweb_drop NVARCHAR(MAX) = N'';
+SELECT @tdsweb_drop += N'DROP TABLE ' + QUOTENAME(n) + N';'
+FROM (SELECT LEFT(name, CHARINDEX(N'___', name + N'___') - 1) AS n, object_id FROM tempdb.sys.tables WHERE name LIKE N'#[^#]%') t
+WHERE OBJECT_ID(N'tempdb..' + QUOTENAME(n)) = object_id;
+EXEC (@tdsweb_drop);
+SET ANSI_NULLS ON; SET ANSI_PADDING ON; SET ANSI_WARNINGS ON; SET ARITHABORT ON;
+SET CONCAT_NULL_YIELDS_NULL ON; SET QUOTED_IDENTIFIER ON; SET NUMERIC_ROUNDABORT OFF;
+SET IMPLICIT_TRANSACTIONS OFF; SET XACT_ABORT OFF; SET NOCOUNT OFF; SET ROWCOUNT 0;
+SET LOCK_TIMEOUT -1; SET TEXTSIZE -1; SET TRANSACTION ISOLATION LEVEL READ COMMITTED;)";
+
+unique_ptr<conn_pool> pool;
+
+shared_ptr<pooled_conn> conn_pool::connect(const string& server, const string& username, const string& password,
+                                           tds_handler* owner, const string& key) {
+    auto pc = make_shared<pooled_conn>();
+    auto p = pc.get();
+
+    pc->owner = owner;
+    pc->key = key;
+
+    // p rather than pc, as the connection mustn't keep its own pooled_conn alive
+    auto mh = [p](const string_view& server, const string_view& message, const string_view& proc_name,
+                  const string_view& sql_state, int32_t msgno, int32_t line_number, int16_t state, uint8_t priv_msg_type,
+                  uint8_t severity, int oserr) {
+        if (auto h = p->owner.load())
+            h->msg_handler(server, message, proc_name, sql_state, msgno, line_number, state, priv_msg_type, severity, oserr);
+    };
+    auto mh2 = [p](const vector<pair<string, tds::server_type>>& columns) {
+        if (auto h = p->owner.load())
+            h->tbl_handler(columns);
+    };
+    auto mh3 = [p](const vector<tds::Field>& columns) {
+        if (auto h = p->owner.load())
+            h->row_handler(columns);
+    };
+    auto mh4 = [p](unsigned int count) {
+        if (auto h = p->owner.load())
+            h->row_count_handler(count);
+    };
+
+    pc->conn.reset(new tds::Conn(server, username, password, DB_APP, mh, nullptr, mh2, mh3, mh4));
+
+    {
+        tds::Query sq(*pc->conn, "SELECT DB_NAME(), @@SPID");
+
+        sq.fetch_row();
+
+        pc->default_db = (string)sq[0];
+        pc->spid = (int)sq[1];
+    }
+
+    return pc;
+}
+
+shared_ptr<pooled_conn> conn_pool::acquire(const string& server, const string& username, const string& password,
+                                           tds_handler* owner, const string& database) {
+    auto key = server + '\0' + username + '\0' + password;
+    shared_ptr<pooled_conn> pc;
+
+    // Never waits for a connection to come free, as a session holds on to its connection
+    // for as long as it's logged in - if there's nothing idle, we make another one.
+    {
+        unique_lock<mutex> ul(lock);
+
+        while (true) {
+            auto& b = buckets[key];
+
+            if (!b.idle.empty()) {
+                // most recently used first, so that the rest can age out
+                pc = move(b.idle.back());
+                b.idle.pop_back();
+
+                if (chrono::steady_clock::now() - pc->last_used < POOL_HEALTH_CHECK_AFTER) {
+                    hits++;
+                    break;
+                }
+
+                ul.unlock();
+
+                bool healthy;
+
+                try {
+                    healthy = !pc->conn->is_dead();
+
+                    if (healthy)
+                        pc->conn->run("SELECT 1");
+                } catch (...) {
+                    healthy = false;
+                }
+
+                ul.lock();
+
+                if (healthy) {
+                    hits++;
+                    break;
+                }
+
+                health_check_failures++;
+                buckets[key].total--;
+
+                ul.unlock();
+                pc.reset();
+                ul.lock();
+
+                continue;
+            }
+
+            b.total++;
+            misses++;
+            break;
+        }
+    }
+
+    if (!pc) {
+        try {
+            pc = connect(server, username, password, owner, key);
+        } catch (...) {
+            removed(key);
+            throw;
+        }
+    } else
+        pc->owner = owner;
+
+    if (!database.empty() && database != pc->default_db) {
+        try {
+            pc->conn->run("USE " + tds::escape(database));
+        } catch (...) {
+            release(pc);
+            throw;
+        }
+    }
+
+    return pc;
+}
+
+bool conn_pool::reset(pooled_conn& pc) {
+    try {
+        if (pc.conn->is_dead())
+            return false;
+
+        pc.conn->run(RESET_SQL);
+        pc.conn->run("USE " + tds::escape(pc.default_db));
+    } catch (...) {
+        return false;
+    }
+
+    return true;
+}
+
+// Gives a connection back to the pool. It mustn't be running anything. If there are
+// already pool_max_idle for its login waiting, it's closed instead.
+void conn_pool::release(shared_ptr<pooled_conn>& pc) {
+    pc->owner = nullptr;
+
+    bool full;
+
+    {
+        lock_guard<mutex> lg(lock);
+
+        full = buckets[pc->key].idle.size() >= config.pool_max_idle;
+
+        if (full) {
+            overflows++;
+            buckets[pc->key].total--;
+        }
+    }
+
+    // closing it involves network I/O, so is done without the lock
+    if (full) {
+        pc.reset();
+        return;
+    }
+
+    if (!reset(*pc)) {
+        {
+            lock_guard<mutex> lg(lock);
+
+            reset_failures++;
+        }
+
+        discard(pc);
+        return;
+    }
+
+    pc->last_used = chrono::steady_clock::now();
+
+    lock_guard<mutex> lg(lock);
+
+    buckets[pc->key].idle.push_back(move(pc));
+}
+
+// Gives up a connection's place in the pool, for when it's broken or still busy. The
+// connection itself goes when the last reference to it does.
+void conn_pool::discard(shared_ptr<pooled_conn>& pc) {
+    removed(pc->key);
+    pc.reset();
+}
+
+void conn_pool::removed(const string& key) {
+    lock_guard<mutex> lg(lock);
+
+    auto it = buckets.find(key);
+
+    if (it != buckets.end())
+        it->second.total--;
+}
+
+// run by the housekeeper
+void conn_pool::evict_idle() {
+    vector<shared_ptr<pooled_conn>> evicted;
+
+    {
+        lock_guard<mutex> lg(lock);
+        auto cutoff = chrono::steady_clock::now() - config.pool_idle_timeout;
+
+        for (auto it = buckets.begin(); it != buckets.end(); ) {
+            auto& b = it->second;
+
+            // idle is in order of last use, so the stale ones are at the front
+            auto stale = b.idle.begin();
+
+            while (stale != b.idle.end() && (*stale)->last_used < cutoff) {
+                stale++;
+            }
+
+            if (stale != b.idle.begin()) {
+                auto n = stale - b.idle.begin();
+
+                move(b.idle.begin(), stale, back_inserter(evicted));
+                b.idle.erase(b.idle.begin(), stale);
+                b.total -= (unsigned int)n;
+                evictions += (uint64_t)n;
+            }
+
+            if (b.total == 0)
+                it = buckets.erase(it);
+            else
+                it++;
+        }
+    }
+
+    // closing connections involves network I/O, so is done without the lock
+    evicted.clear();
+}
+
+json conn_pool::get_stats() {
+    lock_guard<mutex> lg(lock);
+    size_t open = 0, idle = 0;
+
+    for (const auto& b : buckets) {
+        open += b.second.total;
+        idle += b.second.idle.size();
+    }
+
+    return json{
+        {"open", open},
+        {"idle", idle},
+        {"hits", hits},
+        {"misses", misses},
+        {"hit_rate", hits + misses == 0 ? 0.0 : (double)hits / (double)(hits + misses)},
+        {"overflows", overflows},
+        {"evictions", evictions},
+        {"health_check_failures", health_check_failures},
+        {"reset_failures", reset_failures}
+    };
+}
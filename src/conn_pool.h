@@ -0,0 +1,81 @@
+#pragma once
+
+#include <tdscpp.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#include <nlohmann/json.hpp>
+
+#ifdef __MINGW32__
+#include "mingw.mutex.h"
+#else
+#include <mutex>
+#endif
+
+// Pool of TDS connections, shared between sessions which log in to the same server with
+// the same credentials. A session borrows a connection at login and gives it back when
+// it logs out or disconnects, so a browser reloading the page doesn't cost a new TLS
+// handshake and login. The pool doesn't limit how many connections there are, only how
+// many idle ones it keeps, so it never holds up a login.
+//
+// tdscpp fixes a connection's callbacks when it's created, so they go through
+// pooled_conn::owner, which points to whichever session has the connection at the moment.
+
+class tds_handler {
+public:
+    virtual ~tds_handler() = default;
+
+    virtual void msg_handler(const std::string_view& server, const std::string_view& message, const std::string_view& proc_name,
+                             const std::string_view& sql_state, int32_t msgno, int32_t line_number, int16_t state, uint8_t priv_msg_type,
+                             uint8_t severity, int oserr) = 0;
+    virtual void tbl_handler(const std::vector<std::pair<std::string, tds::server_type>>& columns) = 0;
+    virtual void row_handler(const std::vector<tds::Field>& columns) = 0;
+    virtual void row_count_handler(unsigned int count) = 0;
+};
+
+class pooled_conn {
+public:
+    std::unique_ptr<tds::Conn> conn;
+    std::atomic<tds_handler*> owner{nullptr};
+    std::string key;
+    std::string default_db;
+    int spid = 0;
+    std::chrono::steady_clock::time_point last_used;
+};
+
+class conn_pool {
+public:
+    std::shared_ptr<pooled_conn> acquire(const std::string& server, const std::string& username,
+                                         const std::string& password, tds_handler* owner,
+                                         const std::string& database = "");
+    void release(std::shared_ptr<pooled_conn>& pc);
+    void discard(std::shared_ptr<pooled_conn>& pc);
+    void evict_idle();
+    nlohmann::json get_stats();
+
+private:
+    struct bucket {
+        std::vector<std::shared_ptr<pooled_conn>> idle;
+        unsigned int total = 0;
+    };
+
+    std::shared_ptr<pooled_conn> connect(const std::string& server, const std::string& username,
+                                         const std::string& password, tds_handler* owner, const std::string& key);
+    bool reset(pooled_conn& pc);
+    void removed(const std::string& key);
+
+    std::mutex lock;
+    std::unordered_map<std::string, bucket> buckets;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t overflows = 0;
+    uint64_t evictions = 0;
+    uint64_t health_check_failures = 0;
+    uint64_t reset_failures = 0;
+};
+
+extern std::unique_ptr<conn_pool> pool;
@@ -0,0 +1,321 @@
+#include <charconv>
+#include <cmath>
+#include <stdexcept>
+#include <stdio.h>
+#include <zlib.h>
+#include "csv_writer.h"
+#include "tdsweb.h"
+
+using namespace std;
+
+// the buffer gets written out once it's this big
+static const size_t CSV_FLUSH_SIZE = 65536;
+
+// quotes a field if it needs it
+static void append_field(string& s, char delimiter, const string_view& v) {
+    const char special[] = { delimiter, '"', '\r', '\n' };
+
+    if (v.find_first_of(string_view(special, sizeof(special))) == string_view::npos) {
+        s += v;
+        return;
+    }
+
+    s += '"';
+
+    auto start = v.data();
+    auto end = v.data() + v.length();
+
+    for (auto p = start; p < end; p++) {
+        if (*p == '"') {
+            s.append(start, p - start + 1);
+            s += '"';
+            start = p + 1;
+        }
+    }
+
+    s.append(start, end - start);
+    s += '"';
+}
+
+template<col_kind K>
+static void encode_csv(string& s, char delimiter, const tds::Field& col);
+
+template<>
+void encode_csv<col_kind::integer>(string& s, char, const tds::Field& col) {
+    char buf[24];
+
+    if (col.is_null())
+        return;
+
+    auto r = to_chars(buf, buf + sizeof(buf), (int64_t)col);
+
+    s.append(buf, r.ptr - buf);
+}
+
+template<>
+void encode_csv<col_kind::floating>(string& s, char, const tds::Field& col) {
+    char buf[32];
+
+    if (col.is_null())
+        return;
+
+    auto v = (double)col;
+
+    if (!isfinite(v))
+        return;
+
+#ifdef __cpp_lib_to_chars
+    auto r = to_chars(buf, buf + sizeof(buf), v);
+
+    s.append(buf, r.ptr - buf);
+#else
+    auto len = snprintf(buf, sizeof(buf), "%.17g", v);
+
+    s.append(buf, (size_t)len);
+#endif
+}
+
+template<>
+void encode_csv<col_kind::bit>(string& s, char, const tds::Field& col) {
+    if (col.is_null())
+        return;
+
+    s += (int)col != 0 ? '1' : '0';
+}
+
+template<>
+void encode_csv<col_kind::date>(string& s, char, const tds::Field& col) {
+    char buf[16];
+
+    if (col.is_null())
+        return;
+
+    auto d = (tds::Date)col;
+    auto len = snprintf(buf, sizeof(buf), "%04d-%02u-%02u", d.year(), d.month(), d.day());
+
+    s.append(buf, (size_t)len);
+}
+
+template<>
+void encode_csv<col_kind::time>(string& s, char, const tds::Field& col) {
+    char buf[16];
+
+    if (col.is_null())
+        return;
+
+    auto t = (tds::Time)col;
+    auto len = snprintf(buf, sizeof(buf), "%02u:%02u:%02u", t.h, t.m, t.s);
+
+    s.append(buf, (size_t)len);
+}
+
+template<>
+void encode_csv<col_kind::datetime>(string& s, char, const tds::Field& col) {
+    char buf[32];
+
+    if (col.is_null())
+        return;
+
+    auto dt = (tds::DateTime)col;
+    auto len = snprintf(buf, sizeof(buf), "%04d-%02u-%02u %02u:%02u:%02u", dt.d.year(), dt.d.month(), dt.d.day(),
+                        dt.t.h, dt.t.m, dt.t.s);
+
+    s.append(buf, (size_t)len);
+}
+
+template<>
+void encode_csv<col_kind::string>(string& s, char delimiter, const tds::Field& col) {
+    if (col.is_null())
+        return;
+
+    append_field(s, delimiter, (string)col);
+}
+
+static csv_encoder get_csv_encoder(tds::server_type type) {
+    return with_col_kind(get_col_kind(type), [](auto k) -> csv_encoder {
+        return encode_csv<decltype(k)::value>;
+    });
+}
+
+static void append_utf16(string& s, uint16_t c) {
+    s += (char)(c & 0xff);
+    s += (char)(c >> 8);
+}
+
+// Invalid UTF-8 becomes U+FFFD, as tdscpp should never give us any.
+static void utf8_to_utf16le(const string_view& sv, string& out) {
+    auto p = (const uint8_t*)sv.data();
+    auto end = p + sv.length();
+
+    out.clear();
+    out.reserve(sv.length() * 2);
+
+    while (p < end) {
+        uint32_t cp;
+        unsigned int len;
+
+        if (*p < 0x80) {
+            append_utf16(out, *p);
+            p++;
+            continue;
+        } else if ((*p & 0xe0) == 0xc0) {
+            cp = *p & 0x1f;
+            len = 2;
+        } else if ((*p & 0xf0) == 0xe0) {
+            cp = *p & 0x0f;
+            len = 3;
+        } else if ((*p & 0xf8) == 0xf0) {
+            cp = *p & 0x07;
+            len = 4;
+        } else {
+            append_utf16(out, 0xfffd);
+            p++;
+            continue;
+        }
+
+        if ((size_t)(end - p) < len) {
+            append_utf16(out, 0xfffd);
+            break;
+        }
+
+        bool valid = true;
+
+        for (unsigned int i = 1; i < len; i++) {
+            if ((p[i] & 0xc0) != 0x80) {
+                valid = false;
+                break;
+            }
+
+            cp = (cp << 6) | (p[i] & 0x3f);
+        }
+
+        if (!valid || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) {
+            append_utf16(out, 0xfffd);
+            p++;
+            continue;
+        }
+
+        if (cp >= 0x10000) {
+            cp -= 0x10000;
+            append_utf16(out, (uint16_t)(0xd800 | (cp >> 10)));
+            append_utf16(out, (uint16_t)(0xdc00 | (cp & 0x3ff)));
+        } else
+            append_utf16(out, (uint16_t)cp);
+
+        p += len;
+    }
+}
+
+// fastest level, as this is mostly about getting big extracts over the network
+csv_writer::csv_writer(const filesystem::path& fn, const csv_options& opts) : opts(opts), f(fn, ios::binary),
+                                                                             pd(Z_BEST_SPEED, [this](const string_view& s) { write_file(s); }) {
+    if (!f.good())
+        throw runtime_error("Could not create " + fn.string() + ".");
+
+    if (opts.gzip) {
+        // gzip header - no filename or timestamp
+        static const char gzip_header[] = { '\x1f', '\x8b', Z_DEFLATED, 0, 0, 0, 0, 0, 0, '\xff' };
+
+        write_file(string_view(gzip_header, sizeof(gzip_header)));
+    }
+
+    if (opts.encoding == csv_encoding::utf8_bom)
+        buf = "\xef\xbb\xbf";
+    else if (opts.encoding == csv_encoding::utf16le)
+        out("\xff\xfe");
+}
+
+void csv_writer::write_file(const string_view& data) {
+    f.write(data.data(), (streamsize)data.length());
+
+    if (!f.good())
+        throw runtime_error("Error writing export file.");
+}
+
+void csv_writer::out(const string_view& data) {
+    if (opts.gzip)
+        pd.write(data);
+    else
+        write_file(data);
+}
+
+void csv_writer::flush() {
+    if (opts.encoding == csv_encoding::utf16le) {
+        utf8_to_utf16le(buf, conv);
+        out(conv);
+    } else
+        out(buf);
+
+    buf.clear();
+}
+
+void csv_writer::header(const vector<pair<string, tds::server_type>>& columns) {
+    if (!first_table)
+        buf += "\r\n";
+
+    first_table = false;
+
+    plan.clear();
+
+    for (size_t i = 0; i < columns.size(); i++) {
+        if (i > 0)
+            buf += opts.delimiter;
+
+        append_field(buf, opts.delimiter, get<0>(columns[i]));
+        plan.push_back(get_csv_encoder(get<1>(columns[i])));
+    }
+
+    buf += "\r\n";
+}
+
+void csv_writer::row(const vector<tds::Field>& columns) {
+    for (size_t i = 0; i < columns.size(); i++) {
+        if (i > 0)
+            buf += opts.delimiter;
+
+        plan[i](buf, opts.delimiter, columns[i]);
+    }
+
+    buf += "\r\n";
+
+    if (buf.length() >= CSV_FLUSH_SIZE)
+        flush();
+}
+
+void csv_writer::finish() {
+    flush();
+
+    if (opts.gzip) {
+        string trailer;
+
+        pd.finish();
+
+        for (unsigned int i = 0; i < 4; i++) {
+            trailer += (char)((pd.crc >> (i * 8)) & 0xff);
+        }
+
+        for (unsigned int i = 0; i < 4; i++) {
+            trailer += (char)((pd.size >> (i * 8)) & 0xff);
+        }
+
+        write_file(trailer);
+    }
+
+    f.close();
+
+    if (f.fail())
+        throw runtime_error("Error writing export file.");
+}
+
+string csv_writer::mime() const {
+    if (opts.gzip)
+        return "application/gzip";
+    else if (opts.delimiter == '\t')
+        return "text/tab-separated-values";
+    else
+        return "text/csv";
+}
+
+string csv_writer::filename() const {
+    return "results." + opts.ext + (opts.gzip ? ".gz" : "");
+}
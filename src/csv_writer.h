@@ -0,0 +1,57 @@
+#pragma once
+
+#include <tdscpp.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+#include "exporter.h"
+#include "parallel_deflate.h"
+
+// Writes results as delimited text, following RFC 4180: fields containing the delimiter,
+// a quote, or a line break are quoted, quotes are doubled, and lines end with CRLF. NULLs
+// are empty fields. If a query returns more than one result set, each gets its own
+// header, after a blank line.
+//
+// Rows are formatted into a buffer which is written out, converted or gzipped as
+// necessary, every 64 KB or so. Gzipping is done on the worker pool, see
+// parallel_deflate.h.
+
+enum class csv_encoding {
+    utf8,
+    utf8_bom, // what Excel needs to recognize UTF-8
+    utf16le // with BOM
+};
+
+struct csv_options {
+    char delimiter = ',';
+    csv_encoding encoding = csv_encoding::utf8;
+    bool gzip = false;
+    std::string ext = "csv";
+};
+
+typedef void (*csv_encoder)(std::string& s, char delimiter, const tds::Field& col);
+
+class csv_writer : public exporter {
+public:
+    csv_writer(const std::filesystem::path& fn, const csv_options& opts);
+    void header(const std::vector<std::pair<std::string, tds::server_type>>& columns) override;
+    void row(const std::vector<tds::Field>& columns) override;
+    void finish() override;
+    std::string mime() const override;
+    std::string filename() const override;
+
+private:
+    void flush();
+    void out(const std::string_view& data);
+    void write_file(const std::string_view& data);
+
+    csv_options opts;
+    std::ofstream f;
+    parallel_deflate pd;
+    std::string buf;
+    std::string conv;
+    std::vector<csv_encoder> plan;
+    bool first_table = true;
+};
@@ -0,0 +1,87 @@
+#include "db_cache.h"
+#include "config.h"
+
+using namespace std;
+using json = nlohmann::json;
+
+db_cache db_lists;
+
+// changes if a database is created, dropped, renamed, or taken offline - the checksum
+// catches a drop and a rename, which the count and latest create_date don't
+#define DB_STAMP "CONCAT(COUNT(*) OVER (), ' ', CONVERT(VARCHAR(30), MAX(create_date) OVER (), 126), ' ', " \
+                 "CHECKSUM_AGG(CHECKSUM(name, database_id, state)) OVER ())"
+
+vector<string> db_cache::get(tds::Conn& conn, const string& key) {
+    auto now = chrono::steady_clock::now();
+    string stamp;
+
+    {
+        lock_guard<mutex> lg(lock);
+
+        auto it = entries.find(key);
+
+        if (it != entries.end()) {
+            if (now - it->second.checked < config.db_cache_ttl) {
+                hits++;
+                return it->second.names;
+            }
+
+            stamp = it->second.stamp;
+        }
+    }
+
+    if (!stamp.empty()) {
+        string cur;
+
+        {
+            tds::Query sq(conn, "SELECT TOP 1 " DB_STAMP " FROM sys.databases");
+
+            if (sq.fetch_row())
+                cur = (string)sq[0];
+        }
+
+        if (cur == stamp) {
+            lock_guard<mutex> lg(lock);
+
+            auto it = entries.find(key);
+
+            if (it != entries.end() && it->second.stamp == stamp) {
+                it->second.checked = now;
+                revalidations++;
+                return it->second.names;
+            }
+        }
+    }
+
+    // the stamp comes with the list, so this is still only the one round trip
+    entry e;
+
+    {
+        tds::Query sq(conn, "SELECT name, " DB_STAMP " FROM sys.databases ORDER BY name");
+
+        while (sq.fetch_row()) {
+            e.names.push_back((string)sq[0]);
+            e.stamp = (string)sq[1];
+        }
+    }
+
+    e.checked = now;
+
+    lock_guard<mutex> lg(lock);
+
+    loads++;
+    entries[key] = e;
+
+    return e.names;
+}
+
+json db_cache::get_stats() {
+    lock_guard<mutex> lg(lock);
+
+    return json{
+        {"entries", entries.size()},
+        {"hits", hits},
+        {"revalidations", revalidations},
+        {"loads", loads}
+    };
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <tdscpp.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <chrono>
+#include <stdint.h>
+#include <nlohmann/json.hpp>
+
+#ifdef __MINGW32__
+#include "mingw.mutex.h"
+#else
+#include <mutex>
+#endif
+
+// The list of databases sent at login, shared between sessions. It's per user rather
+// than per server, as sys.databases only shows what the login can see.
+//
+// An entry younger than db_cache_ttl is used as it is. After that we check the number of
+// databases and the latest create_date, and only fetch the list again if either has
+// changed.
+
+class db_cache {
+public:
+    std::vector<std::string> get(tds::Conn& conn, const std::string& key);
+    nlohmann::json get_stats();
+
+private:
+    struct entry {
+        std::vector<std::string> names;
+        std::string stamp;
+        std::chrono::steady_clock::time_point checked;
+    };
+
+    std::mutex lock;
+    std::unordered_map<std::string, entry> entries;
+    uint64_t hits = 0;
+    uint64_t revalidations = 0;
+    uint64_t loads = 0;
+};
+
+extern db_cache db_lists;
@@ -0,0 +1,671 @@
+#include <string_view>
+#include <algorithm>
+#include <charconv>
+#include <stdexcept>
+#include "download_server.h"
+#include "config.h"
+#include "tdsweb.h"
+
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#include <mswsock.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#endif
+
+using namespace std;
+using json = nlohmann::json;
+
+#ifndef _WIN32
+#define INVALID_SOCKET -1
+#define closesocket close
+#endif
+
+#ifdef __linux__
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+// the most we'll read of a request before giving up on it
+static const size_t MAX_REQUEST_SIZE = 8192;
+
+// how long a connection can sit idle, whether receiving the request or sending the file
+static const unsigned int SOCKET_TIMEOUT_SECS = 30;
+
+// largest chunk to ask sendfile or TransmitFile for at once
+static const uint64_t SEND_CHUNK = 0x40000000;
+
+// how long a file stays available after every byte of it has been sent
+static const auto DOWNLOAD_DONE_GRACE = chrono::seconds(60);
+
+unique_ptr<download_server> downloads;
+
+download_server::download_server(uint16_t port) {
+#ifdef _WIN32
+    WSADATA wsa;
+
+    if (WSAStartup(MAKEWORD(2, 2), &wsa))
+        throw runtime_error("WSAStartup failed.");
+#else
+    // a browser going away mid-download would otherwise kill us
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    listener = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+
+    if (listener == INVALID_SOCKET)
+        throw runtime_error("Could not create download socket.");
+
+    int off = 0, on = 1;
+
+    // accept IPv4 as well
+    setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, (const char*)&off, sizeof(off));
+#ifndef _WIN32
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+#else
+    (void)on;
+#endif
+
+    struct sockaddr_in6 addr = {};
+
+    addr.sin6_family = AF_INET6;
+    addr.sin6_port = htons(port);
+    addr.sin6_addr = in6addr_any;
+
+    if (::bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, SOMAXCONN) != 0) {
+        closesocket(listener);
+        throw runtime_error("Could not listen on download port " + to_string(port) + ".");
+    }
+
+    t = thread(&download_server::run, this);
+}
+
+download_server::~download_server() {
+    {
+        lock_guard<mutex> lg(lock);
+
+        stop = true;
+        cv.notify_all();
+    }
+
+    // wakes up accept
+#ifdef _WIN32
+    closesocket(listener);
+#else
+    shutdown(listener, SHUT_RDWR);
+    close(listener);
+#endif
+
+    t.join();
+
+    {
+        unique_lock<mutex> ul(lock);
+
+        for (auto s : conns) {
+#ifdef _WIN32
+            shutdown(s, SD_BOTH);
+#else
+            shutdown(s, SHUT_RDWR);
+#endif
+        }
+
+        cv.wait(ul, [&]() { return conns.empty(); });
+
+        for (const auto& f : files) {
+            error_code ec;
+
+            if (f.second.owned)
+                filesystem::remove(f.second.path, ec);
+        }
+
+        files.clear();
+    }
+
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+// If owned, takes ownership of fn, which gets deleted once it's been downloaded or has
+// expired.
+string download_server::add(const filesystem::path& fn, const string& mime, const string& filename,
+                            bool owned) {
+    download_file f;
+
+    f.path = fn;
+    f.mime = mime;
+    f.filename = filename;
+    f.owned = owned;
+    f.size = filesystem::file_size(fn);
+    f.expires = chrono::steady_clock::now() + config.download_ttl;
+
+    auto token = make_token();
+
+    lock_guard<mutex> lg(lock);
+
+    files.emplace(token, move(f));
+
+    return token;
+}
+
+// Called by the housekeeper, and the only place files get deleted. Files still being read
+// are left for the next sweep.
+// Forgets every token for fn, for when it's about to be deleted by whoever owns it.
+// Downloads already under way carry on, as they have the file open.
+void download_server::revoke(const filesystem::path& fn) {
+    lock_guard<mutex> lg(lock);
+
+    for (auto it = files.begin(); it != files.end(); ) {
+        if (it->second.path == fn)
+            it = files.erase(it);
+        else
+            it++;
+    }
+}
+
+void download_server::expire() {
+    auto now = chrono::steady_clock::now();
+
+    lock_guard<mutex> lg(lock);
+
+    for (auto it = files.begin(); it != files.end(); ) {
+        if (it->second.expires <= now && it->second.readers == 0) {
+            error_code ec;
+
+            if (it->second.owned)
+                filesystem::remove(it->second.path, ec);
+
+            it = files.erase(it);
+            expired++;
+        } else
+            it++;
+    }
+}
+
+void download_server::run() {
+    while (true) {
+        {
+            unique_lock<mutex> ul(lock);
+
+            cv.wait(ul, [&]() { return stop || conns.size() < config.download_max_connections; });
+
+            if (stop)
+                break;
+        }
+
+        auto s = accept(listener, nullptr, nullptr);
+
+        {
+            lock_guard<mutex> lg(lock);
+
+            if (stop) {
+                if (s != INVALID_SOCKET)
+                    closesocket(s);
+
+                break;
+            }
+
+            if (s != INVALID_SOCKET)
+                conns.insert(s);
+        }
+
+        // probably out of file descriptors, so don't spin
+        if (s == INVALID_SOCKET) {
+            this_thread::sleep_for(chrono::milliseconds(100));
+            continue;
+        }
+
+        thread([this, s]() {
+            try {
+                serve(s);
+            } catch (...) {
+            }
+
+            // Forgotten before it's closed, as once it is, accept can hand out the same
+            // number for a new connection.
+            lock_guard<mutex> lg(lock);
+
+            conns.erase(s);
+            closesocket(s);
+            cv.notify_all();
+        }).detach();
+    }
+}
+
+static bool send_all(socket_t s, const string_view& data) {
+    size_t pos = 0;
+
+    while (pos < data.length()) {
+        auto r = send(s, data.data() + pos, (int)min(data.length() - pos, (size_t)INT32_MAX), SEND_FLAGS);
+
+        if (r <= 0)
+            return false;
+
+        pos += (size_t)r;
+    }
+
+    return true;
+}
+
+static void send_response(socket_t s, const string_view& status, const string_view& headers = "") {
+    string msg = "HTTP/1.1 ";
+
+    msg += status;
+    msg += "\r\nContent-Length: 0\r\nConnection: close\r\n";
+    msg += headers;
+    msg += "\r\n";
+
+    send_all(s, msg);
+}
+
+// The file's opened before the response starts, so that if it's gone we can still say so.
+class open_file {
+public:
+    open_file(const filesystem::path& fn) {
+#ifdef _WIN32
+        h = CreateFileW(fn.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr,
+                        OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+#else
+        fd = open(fn.c_str(), O_RDONLY | O_CLOEXEC);
+#endif
+    }
+
+    ~open_file() {
+#ifdef _WIN32
+        if (h != INVALID_HANDLE_VALUE)
+            CloseHandle(h);
+#else
+        if (fd != -1)
+            close(fd);
+#endif
+    }
+
+    open_file(const open_file&) = delete;
+    open_file& operator=(const open_file&) = delete;
+
+    bool is_open() const {
+#ifdef _WIN32
+        return h != INVALID_HANDLE_VALUE;
+#else
+        return fd != -1;
+#endif
+    }
+
+#ifdef _WIN32
+    HANDLE h;
+#else
+    int fd;
+#endif
+};
+
+// Returns the number of bytes sent, which is less than len if the browser went away.
+static uint64_t send_file_range(socket_t s, const open_file& f, uint64_t start, uint64_t len) {
+    uint64_t sent = 0;
+
+#ifdef _WIN32
+    while (sent < len) {
+        auto n = (DWORD)min(len - sent, SEND_CHUNK);
+        LARGE_INTEGER li;
+
+        li.QuadPart = (LONGLONG)(start + sent);
+
+        if (!SetFilePointerEx(f.h, li, nullptr, FILE_BEGIN) || !TransmitFile(s, f.h, n, 0, nullptr, nullptr, 0))
+            break;
+
+        sent += n;
+    }
+#elif defined(__linux__)
+    auto off = (off_t)start;
+
+    while (sent < len) {
+        auto r = sendfile(s, f.fd, &off, (size_t)min(len - sent, SEND_CHUNK));
+
+        if (r < 0 && errno == EINTR)
+            continue;
+
+        if (r <= 0)
+            break;
+
+        sent += (uint64_t)r;
+    }
+#else
+    char buf[65536];
+
+    while (sent < len) {
+        auto r = pread(f.fd, buf, (size_t)min(len - sent, (uint64_t)sizeof(buf)), (off_t)(start + sent));
+
+        if (r < 0 && errno == EINTR)
+            continue;
+
+        if (r <= 0 || !send_all(s, string_view(buf, (size_t)r)))
+            break;
+
+        sent += (uint64_t)r;
+    }
+#endif
+
+    return sent;
+}
+
+static bool parse_uint64(const string_view& sv, uint64_t& v) {
+    if (sv.empty())
+        return false;
+
+    auto r = from_chars(sv.data(), sv.data() + sv.length(), v);
+
+    return r.ec == errc() && r.ptr == sv.data() + sv.length();
+}
+
+enum class range_result {
+    whole,
+    partial,
+    unsatisfiable
+};
+
+// Only a single range is supported - anything else we don't understand gets ignored,
+// and the whole file sent, as RFC 9110 allows.
+static range_result parse_range(string_view hdr, uint64_t size, uint64_t& start, uint64_t& end) {
+    if (hdr.substr(0, 6) != "bytes=" || size == 0)
+        return range_result::whole;
+
+    hdr = hdr.substr(6);
+
+    if (hdr.find(',') != string_view::npos)
+        return range_result::whole;
+
+    auto dash = hdr.find('-');
+
+    if (dash == string_view::npos)
+        return range_result::whole;
+
+    auto first = hdr.substr(0, dash);
+    auto last = hdr.substr(dash + 1);
+
+    if (first.empty()) {
+        uint64_t suffix;
+
+        if (!parse_uint64(last, suffix))
+            return range_result::whole;
+
+        if (suffix == 0)
+            return range_result::unsatisfiable;
+
+        start = suffix >= size ? 0 : size - suffix;
+        end = size - 1;
+    } else {
+        if (!parse_uint64(first, start))
+            return range_result::whole;
+
+        if (last.empty())
+            end = size - 1;
+        else {
+            if (!parse_uint64(last, end) || end < start)
+                return range_result::whole;
+
+            end = min(end, size - 1);
+        }
+
+        if (start >= size)
+            return range_result::unsatisfiable;
+    }
+
+    return range_result::partial;
+}
+
+// quotes are the only thing which would break the header, but be conservative
+static string safe_filename(const string_view& fn) {
+    string s;
+
+    for (auto c : fn) {
+        if (c < 0x20 || c > 0x7e || c == '"' || c == '\\')
+            s += '_';
+        else
+            s += c;
+    }
+
+    return s;
+}
+
+void download_server::serve(socket_t s) {
+#ifdef _WIN32
+    DWORD timeout = SOCKET_TIMEOUT_SECS * 1000;
+#else
+    struct timeval timeout = {SOCKET_TIMEOUT_SECS, 0};
+#endif
+
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
+
+    string req;
+    size_t hdr_end;
+
+    while (true) {
+        char buf[1024];
+
+        auto r = recv(s, buf, sizeof(buf), 0);
+
+        if (r <= 0)
+            return;
+
+        req.append(buf, (size_t)r);
+
+        hdr_end = req.find("\r\n\r\n");
+
+        if (hdr_end != string::npos)
+            break;
+
+        if (req.length() > MAX_REQUEST_SIZE) {
+            send_response(s, "431 Request Header Fields Too Large");
+            return;
+        }
+    }
+
+    string_view sv(req.data(), hdr_end + 2);
+    auto eol = sv.find("\r\n");
+    auto line = sv.substr(0, eol);
+    auto sp1 = line.find(' ');
+    auto sp2 = line.rfind(' ');
+
+    if (sp1 == string_view::npos || sp2 == sp1) {
+        send_response(s, "400 Bad Request");
+        return;
+    }
+
+    auto method = line.substr(0, sp1);
+    auto target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+
+    if (method != "GET" && method != "HEAD") {
+        send_response(s, "405 Method Not Allowed", "Allow: GET, HEAD\r\n");
+        return;
+    }
+
+    string_view range;
+
+    sv = sv.substr(eol + 2);
+
+    while (!sv.empty()) {
+        eol = sv.find("\r\n");
+        auto h = sv.substr(0, eol);
+        auto colon = h.find(':');
+
+        sv = sv.substr(eol + 2);
+
+        if (colon != 5)
+            continue;
+
+        auto name = h.substr(0, colon);
+
+        if (equal(name.begin(), name.end(), "range", [](char a, char b) { return tolower((unsigned char)a) == b; })) {
+            range = h.substr(colon + 1);
+
+            while (!range.empty() && (range.front() == ' ' || range.front() == '\t')) {
+                range.remove_prefix(1);
+            }
+
+            while (!range.empty() && (range.back() == ' ' || range.back() == '\t')) {
+                range.remove_suffix(1);
+            }
+        }
+    }
+
+    // the token is whatever follows the last slash, so it doesn't matter how the proxy
+    // rewrites the path
+    auto token = string(target.substr(target.rfind('/') + 1));
+    auto query = token.find('?');
+
+    if (query != string::npos)
+        token.erase(query);
+
+    filesystem::path path;
+    string mime, filename;
+    uint64_t size;
+
+    {
+        lock_guard<mutex> lg(lock);
+
+        requests++;
+
+        auto it = files.find(token);
+
+        if (it == files.end() || it->second.expires <= chrono::steady_clock::now()) {
+            not_found++;
+            send_response(s, "404 Not Found");
+            return;
+        }
+
+        it->second.readers++;
+        path = it->second.path;
+        mime = it->second.mime;
+        filename = it->second.filename;
+        size = it->second.size;
+    }
+
+    uint64_t start = 0, sent = 0;
+    bool served = false;
+
+    try {
+        open_file f(path);
+
+        // deleted from under its token, such as a background export that's been removed
+        if (!f.is_open()) {
+            {
+                lock_guard<mutex> lg(lock);
+
+                not_found++;
+            }
+
+            send_response(s, "404 Not Found");
+            finished(token, 0, 0, false);
+            return;
+        }
+
+        uint64_t end = size == 0 ? 0 : size - 1;
+        auto rr = parse_range(range, size, start, end);
+
+        if (rr == range_result::unsatisfiable)
+            send_response(s, "416 Range Not Satisfiable", "Content-Range: bytes */" + to_string(size) + "\r\n");
+        else {
+            auto len = size == 0 ? 0 : end - start + 1;
+            string hdrs = rr == range_result::partial ? "HTTP/1.1 206 Partial Content\r\n" : "HTTP/1.1 200 OK\r\n";
+
+            hdrs += "Content-Type: " + mime + "\r\n";
+            hdrs += "Content-Length: " + to_string(len) + "\r\n";
+            hdrs += "Content-Disposition: attachment; filename=\"" + safe_filename(filename) + "\"\r\n";
+            hdrs += "Accept-Ranges: bytes\r\n";
+            hdrs += "Cache-Control: no-store\r\n";
+            hdrs += "Connection: close\r\n";
+
+            if (rr == range_result::partial)
+                hdrs += "Content-Range: bytes " + to_string(start) + "-" + to_string(end) + "/" + to_string(size) + "\r\n";
+
+            hdrs += "\r\n";
+
+            if (send_all(s, hdrs) && method == "GET") {
+                sent = len == 0 ? 0 : send_file_range(s, f, start, len);
+                served = sent == len;
+
+                lock_guard<mutex> lg(lock);
+
+                bytes_sent += sent;
+
+                if (rr == range_result::partial)
+                    partial++;
+            }
+        }
+    } catch (...) {
+        finished(token, start, sent, false);
+        throw;
+    }
+
+    finished(token, start, sent, served);
+}
+
+// Records which bytes the client has had. Once it's had all of them, the file only hangs
+// around for DOWNLOAD_DONE_GRACE, in case of a retry or a segmented download's last
+// pieces, and expire deletes it after that.
+void download_server::finished(const string& token, uint64_t start, uint64_t sent, bool served) {
+    lock_guard<mutex> lg(lock);
+
+    auto it = files.find(token);
+
+    if (it == files.end())
+        return;
+
+    auto& f = it->second;
+
+    f.readers--;
+
+    if (f.done)
+        return;
+
+    if (sent > 0) {
+        auto end = start + sent;
+
+        // merge with any range which overlaps or touches this one
+        auto r = f.sent.upper_bound(start);
+
+        if (r != f.sent.begin() && prev(r)->second >= start)
+            r--;
+
+        while (r != f.sent.end() && r->first <= end) {
+            start = min(start, r->first);
+            end = max(end, r->second);
+            r = f.sent.erase(r);
+        }
+
+        f.sent.emplace(start, end);
+    }
+
+    bool all = f.size == 0 ? served : (f.sent.size() == 1 && f.sent.begin()->first == 0 && f.sent.begin()->second == f.size);
+
+    if (all) {
+        f.done = true;
+        f.sent.clear();
+        f.expires = min(f.expires, chrono::steady_clock::now() + DOWNLOAD_DONE_GRACE);
+        completed++;
+    }
+}
+
+json download_server::get_stats() {
+    lock_guard<mutex> lg(lock);
+
+    return json{
+        {"waiting", files.size()},
+        {"connections", conns.size()},
+        {"requests", requests},
+        {"partial", partial},
+        {"completed", completed},
+        {"expired", expired},
+        {"not_found", not_found},
+        {"bytes_sent", bytes_sent}
+    };
+}
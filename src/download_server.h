@@ -0,0 +1,93 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <chrono>
+#include <filesystem>
+#include <stdint.h>
+#include <nlohmann/json.hpp>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#endif
+
+#ifdef __MINGW32__
+#include "mingw.thread.h"
+#include "mingw.mutex.h"
+#include "mingw.condition_variable.h"
+#else
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#endif
+
+// Serves finished exports over plain HTTP, so they don't have to go through the
+// WebSocket. wscpp owns the WebSocket listener, so this has a port of its own, which the
+// reverse proxy in front of us should map to download_url.
+//
+// Each file gets a random token, and GET /download/<token> returns it using sendfile
+// or TransmitFile, with single byte ranges supported so that an interrupted download
+// can carry on where it left off. Clients which fetch a file in pieces, or out of order,
+// are why we keep track of which bytes have gone out rather than stopping at the last
+// one: once every byte has been sent, the token only lasts for DOWNLOAD_DONE_GRACE more,
+// for any stragglers. Otherwise it goes after download_ttl. Either way the file is then
+// deleted, unless it was added with owned false, such as background exports, in which
+// case only the token goes - and whoever does own the file has to revoke its tokens
+// before deleting it.
+//
+// Each connection has a thread, and there are at most download_max_connections of them;
+// beyond that, new connections wait in the listen backlog.
+
+#ifdef _WIN32
+typedef SOCKET socket_t;
+#else
+typedef int socket_t;
+#endif
+
+struct download_file {
+    std::filesystem::path path;
+    std::string mime;
+    std::string filename;
+    uint64_t size;
+    std::chrono::steady_clock::time_point expires;
+    unsigned int readers = 0;
+    std::map<uint64_t, uint64_t> sent; // ranges of bytes sent, start to end exclusive, not overlapping
+    bool done = false; // every byte has been sent
+    bool owned = true;
+};
+
+class download_server {
+public:
+    download_server(uint16_t port);
+    ~download_server();
+    std::string add(const std::filesystem::path& fn, const std::string& mime, const std::string& filename,
+                    bool owned = true);
+    void revoke(const std::filesystem::path& fn);
+    void expire();
+    nlohmann::json get_stats();
+
+private:
+    void run();
+    void serve(socket_t s);
+    void finished(const std::string& token, uint64_t start, uint64_t sent, bool served);
+
+    socket_t listener;
+    std::thread t;
+    std::mutex lock;
+    std::condition_variable cv;
+    bool stop = false;
+    std::unordered_map<std::string, download_file> files;
+    std::unordered_set<socket_t> conns;
+
+    uint64_t requests = 0;
+    uint64_t partial = 0;
+    uint64_t completed = 0;
+    uint64_t expired = 0;
+    uint64_t not_found = 0;
+    uint64_t bytes_sent = 0;
+};
+
+extern std::unique_ptr<download_server> downloads;
@@ -0,0 +1,176 @@
+#include <iostream>
+#include "executor.h"
+
+using namespace std;
+using json = nlohmann::json;
+
+unique_ptr<executor> workers;
+unique_ptr<executor> blocking_workers;
+
+// which of the executor's workers this thread is, if any
+static thread_local const executor* current_executor = nullptr;
+static thread_local unsigned int current_worker;
+
+bool task_handle::done() const {
+    lock_guard<mutex> lg(s->lock);
+
+    return s->done;
+}
+
+void task_handle::wait() const {
+    unique_lock<mutex> ul(s->lock);
+
+    s->cv.wait(ul, [&]() {
+        return s->done;
+    });
+}
+
+executor::executor(unsigned int num_threads) {
+    if (num_threads == 0)
+        num_threads = max(thread::hardware_concurrency(), 1u);
+
+    for (unsigned int i = 0; i < num_threads; i++) {
+        workers.emplace_back(new worker);
+    }
+
+    for (unsigned int i = 0; i < num_threads; i++) {
+        threads.emplace_back(&executor::run, this, i);
+    }
+}
+
+executor::~executor() {
+    {
+        lock_guard<mutex> lg(sleep_lock);
+
+        stop = true;
+        sleep_cv.notify_all();
+    }
+
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+task_handle executor::submit(function<void()> func) {
+    auto t = make_shared<task_state>();
+
+    t->func = move(func);
+    t->queued = chrono::steady_clock::now();
+
+    auto index = current_executor == this ? current_worker : next_worker++ % (unsigned int)workers.size();
+
+    pending++;
+
+    {
+        lock_guard<mutex> lg(workers[index]->lock);
+
+        workers[index]->tasks.push_back(t);
+    }
+
+    {
+        lock_guard<mutex> lg(sleep_lock);
+
+        sleep_cv.notify_one();
+    }
+
+    return task_handle(t);
+}
+
+// own queue newest first, as it's probably still in cache, then other queues oldest first
+shared_ptr<task_state> executor::next_task(unsigned int index) {
+    {
+        auto& w = *workers[index];
+        lock_guard<mutex> lg(w.lock);
+
+        if (!w.tasks.empty()) {
+            auto t = move(w.tasks.back());
+
+            w.tasks.pop_back();
+
+            return t;
+        }
+    }
+
+    for (unsigned int i = 1; i < workers.size(); i++) {
+        auto& w = *workers[(index + i) % workers.size()];
+        lock_guard<mutex> lg(w.lock);
+
+        if (!w.tasks.empty()) {
+            auto t = move(w.tasks.front());
+
+            w.tasks.pop_front();
+            steals++;
+
+            return t;
+        }
+    }
+
+    return nullptr;
+}
+
+void executor::execute(task_state& t) {
+    auto wait = (uint64_t)chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - t.queued).count();
+
+    queue_wait_us += wait;
+
+    auto max_wait = queue_wait_max_us.load();
+
+    while (wait > max_wait && !queue_wait_max_us.compare_exchange_weak(max_wait, wait)) {
+    }
+
+    try {
+        t.func();
+    } catch (const exception& e) {
+        cerr << "Task failed: " << e.what() << endl;
+    }
+
+    // let go of anything the task captured before anyone waiting on it carries on
+    t.func = nullptr;
+
+    tasks_run++;
+
+    lock_guard<mutex> lg(t.lock);
+
+    t.done = true;
+    t.cv.notify_all();
+}
+
+void executor::run(unsigned int index) {
+    current_executor = this;
+    current_worker = index;
+
+    while (true) {
+        auto t = next_task(index);
+
+        if (t) {
+            running++;
+            pending--;
+            execute(*t);
+            running--;
+            continue;
+        }
+
+        unique_lock<mutex> ul(sleep_lock);
+
+        // finish off anything queued before stopping, as it might be cleaning up
+        if (stop && pending == 0)
+            break;
+
+        if (pending == 0)
+            sleep_cv.wait(ul);
+    }
+}
+
+json executor::get_stats() {
+    auto run = tasks_run.load();
+
+    return json{
+        {"threads", threads.size()},
+        {"running", running.load()},
+        {"queued", pending.load()},
+        {"tasks_run", run},
+        {"steals", steals.load()},
+        {"queue_wait_avg_ms", run == 0 ? 0.0 : (double)queue_wait_us.load() / (double)run / 1000.0},
+        {"queue_wait_max_ms", (double)queue_wait_max_us.load() / 1000.0}
+    };
+}
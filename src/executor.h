@@ -0,0 +1,97 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#include <nlohmann/json.hpp>
+
+#ifdef __MINGW32__
+#include "mingw.thread.h"
+#include "mingw.mutex.h"
+#include "mingw.condition_variable.h"
+#else
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#endif
+
+// Fixed-size pool of worker threads. Each worker has its own queue: tasks submitted from
+// a worker go on that worker's queue, others are spread round-robin, and a worker which
+// runs out of tasks steals from the others.
+//
+// There are two of these. workers is sized to the cores, and is for tasks which keep
+// the CPU busy or are over quickly. blocking_workers is for queries and background
+// exports, which can wait on SQL Server or the browser for as long as they like, so that
+// they can't starve the former. Its size caps how many of them run at once.
+
+struct task_state {
+    std::function<void()> func;
+    std::chrono::steady_clock::time_point queued;
+    std::mutex lock;
+    std::condition_variable cv;
+    bool done = false;
+};
+
+class task_handle {
+public:
+    task_handle() = default;
+    task_handle(std::shared_ptr<task_state> s) : s(std::move(s)) { }
+
+    bool done() const;
+    void wait() const;
+
+    explicit operator bool() const {
+        return (bool)s;
+    }
+
+private:
+    std::shared_ptr<task_state> s;
+};
+
+class executor {
+public:
+    executor(unsigned int num_threads);
+    ~executor();
+    task_handle submit(std::function<void()> func);
+    nlohmann::json get_stats();
+
+    unsigned int size() const {
+        return (unsigned int)threads.size();
+    }
+
+    // whether something submitted now would have to wait for a thread
+    bool saturated() const {
+        return running + pending >= threads.size();
+    }
+
+private:
+    struct worker {
+        std::mutex lock;
+        std::deque<std::shared_ptr<task_state>> tasks;
+    };
+
+    void run(unsigned int index);
+    std::shared_ptr<task_state> next_task(unsigned int index);
+    void execute(task_state& t);
+
+    std::vector<std::unique_ptr<worker>> workers;
+    std::vector<std::thread> threads;
+    std::mutex sleep_lock;
+    std::condition_variable sleep_cv;
+    std::atomic<size_t> pending{0};
+    std::atomic<size_t> running{0};
+    std::atomic<unsigned int> next_worker{0};
+    bool stop = false;
+
+    std::atomic<uint64_t> tasks_run{0};
+    std::atomic<uint64_t> steals{0};
+    std::atomic<uint64_t> queue_wait_us{0};
+    std::atomic<uint64_t> queue_wait_max_us{0};
+};
+
+extern std::unique_ptr<executor> workers;
+extern std::unique_ptr<executor> blocking_workers;
@@ -0,0 +1,483 @@
+#include <stdexcept>
+#include <algorithm>
+#include "export_jobs.h"
+#include "audit_log.h"
+#include "config.h"
+#include "download_server.h"
+#include "tdsweb.h"
+
+using namespace std;
+using json = nlohmann::json;
+
+unique_ptr<export_jobs> background_exports;
+
+static const char* state_name(job_state state) {
+    switch (state) {
+        case job_state::running:
+            return "running";
+        case job_state::finished:
+            return "finished";
+        case job_state::failed:
+            return "failed";
+        case job_state::cancelled:
+            return "cancelled";
+    }
+
+    return "";
+}
+
+// Progress so far, or how it ended. bytes is however much has reached the file, which
+// lags a little behind while the job's running.
+json export_job::describe() {
+    lock_guard<mutex> lg(lock);
+
+    auto end = state == job_state::running ? chrono::steady_clock::now() : ended;
+    error_code ec;
+    auto bytes = filesystem::file_size(path, ec);
+
+    json j{
+        {"id", id},
+        {"state", state == job_state::running && cancelling ? "cancelling" : state_name(state)},
+        {"query", query},
+        {"database", database},
+        {"filename", filename},
+        {"submitted", chrono::duration_cast<chrono::milliseconds>(submitted.time_since_epoch()).count()},
+        {"elapsed_ms", chrono::duration_cast<chrono::milliseconds>(end - started).count()},
+        {"rows", rows.load()},
+        {"bytes", ec ? 0 : (uint64_t)bytes}
+    };
+
+    if (truncated)
+        j["truncated"] = true;
+
+    if (!error.empty())
+        j["error"] = error;
+
+    return j;
+}
+
+// only errors are kept, as there's nobody to show anything else to
+void export_job::msg_handler(const string_view&, const string_view& message, const string_view&,
+                             const string_view&, int32_t, int32_t, int16_t, uint8_t,
+                             uint8_t severity, int) {
+    if (severity <= 10)
+        return;
+
+    lock_guard<mutex> lg(lock);
+
+    error = message;
+}
+
+void export_job::tbl_handler(const vector<pair<string, tds::server_type>>& columns) {
+    exp->header(columns);
+}
+
+void export_job::row_handler(const vector<tds::Field>& columns) {
+    exp->row(columns);
+    rows++;
+}
+
+void export_job::row_count_handler(unsigned int) {
+}
+
+export_jobs::export_jobs(function<void(const string& key, const json& job)> notify) : notify(notify) {
+}
+
+// At shutdown, running jobs are cancelled, and every file goes.
+export_jobs::~export_jobs() {
+    vector<shared_ptr<export_job>> js;
+
+    {
+        lock_guard<mutex> lg(lock);
+
+        for (const auto& j : jobs) {
+            js.push_back(j.second);
+        }
+    }
+
+    for (const auto& job : js) {
+        lock_guard<mutex> lg(job->lock);
+
+        job->cancelling = true;
+
+        if (job->conn)
+            job->conn->conn->cancel();
+    }
+
+    for (const auto& job : js) {
+        if (job->task)
+            job->task.wait();
+
+        error_code ec;
+
+        filesystem::remove(job->path, ec);
+    }
+}
+
+// j is a query message with an "export", as for a foreground export. Throws if the
+// user already has export_jobs_per_user running, if there are export_jobs_max running
+// altogether, or if the query can't be journaled.
+json export_jobs::submit(const string& server, const string& username, const string& password,
+                         const string& database, const json& j) {
+    if (config.export_jobs_per_user == 0)
+        throw runtime_error("Background exports are disabled.");
+
+    if (j.count("export") == 0)
+        throw runtime_error("No export format given.");
+
+    auto job = make_shared<export_job>();
+
+    job->id = make_token();
+    job->key = server + '\0' + username;
+    job->server = server;
+    job->username = username;
+    job->password = password;
+    job->database = database;
+    job->query = j.at("query");
+    job->exp = make_exporter(j, job->path);
+    job->mime = job->exp->mime();
+    job->filename = job->exp->filename();
+    job->submitted = chrono::system_clock::now();
+    job->started = chrono::steady_clock::now();
+
+    {
+        lock_guard<mutex> lg(lock);
+        unsigned int running = 0, running_user = 0;
+
+        for (const auto& p : jobs) {
+            lock_guard<mutex> lg2(p.second->lock);
+
+            if (p.second->state != job_state::running)
+                continue;
+
+            running++;
+
+            if (p.second->key == job->key)
+                running_user++;
+        }
+
+        string err;
+
+        if (running_user >= config.export_jobs_per_user)
+            err = "Too many background exports running (limit " + to_string(config.export_jobs_per_user) + ").";
+        else if (running >= config.export_jobs_max)
+            err = "Too many background exports running on the server (limit " + to_string(config.export_jobs_max) + ").";
+
+        if (!err.empty()) {
+            rejected++;
+
+            job->exp.reset();
+
+            error_code ec;
+
+            filesystem::remove(job->path, ec);
+
+            throw runtime_error(err);
+        }
+
+        jobs.emplace(job->id, job);
+    }
+
+    // journaled before it runs, as with any other query
+    try {
+        audit_entry ae{server, username, password, job->query, chrono::system_clock::now(), 0, 0};
+
+        audit->start(ae);
+
+        job->audit_start = ae.start;
+        job->audit_id = ae.id;
+    } catch (...) {
+        {
+            lock_guard<mutex> lg(lock);
+
+            jobs.erase(job->id);
+            rejected++;
+        }
+
+        job->exp.reset();
+
+        error_code ec;
+
+        filesystem::remove(job->path, ec);
+
+        throw;
+    }
+
+    {
+        lock_guard<mutex> lg(lock);
+
+        submitted++;
+    }
+
+    // this runs for as long as the query does, so isn't for workers
+    job->task = blocking_workers->submit([this, job]() {
+        run(job);
+    });
+
+    return job->describe();
+}
+
+void export_jobs::run(const shared_ptr<export_job>& job) {
+    audit_entry ae{job->server, job->username, job->password, job->query, job->audit_start, 0, 0, job->audit_id};
+    auto st = job_state::finished;
+    string err;
+
+    try {
+        auto pc = pool->acquire(job->server, job->username, job->password, job.get(), job->database);
+        bool skip, ok = true;
+
+        {
+            lock_guard<mutex> lg(job->lock);
+
+            job->conn = pc;
+            skip = job->cancelling;
+        }
+
+        if (!skip) {
+            try {
+                pc->conn->run(job->query);
+            } catch (const exception& e) {
+                ok = false;
+                err = e.what();
+            }
+        }
+
+        {
+            lock_guard<mutex> lg(job->lock);
+
+            job->conn.reset();
+
+            if (job->cancelling)
+                st = job_state::cancelled;
+            else if (!ok) {
+                st = job_state::failed;
+
+                // the server's message says more than tdscpp's exception
+                if (!job->error.empty())
+                    err = job->error;
+            }
+        }
+
+        pool->release(pc);
+
+        if (st == job_state::finished) {
+            job->exp->finish();
+
+            lock_guard<mutex> lg(job->lock);
+
+            job->truncated = job->exp->truncated;
+        }
+    } catch (const exception& e) {
+        lock_guard<mutex> lg(job->lock);
+
+        st = job->cancelling ? job_state::cancelled : job_state::failed;
+        err = e.what();
+    }
+
+    // closed first, so that on Windows it can be deleted
+    job->exp.reset();
+
+    {
+        lock_guard<mutex> lg(job->lock);
+
+        job->state = st;
+        job->ended = chrono::steady_clock::now();
+        job->error = st == job_state::failed ? err : "";
+        job->password.clear();
+    }
+
+    bool kept;
+
+    {
+        lock_guard<mutex> lg(lock);
+
+        // removed while it was running
+        kept = jobs.count(job->id) > 0;
+
+        if (st == job_state::finished)
+            finished++;
+        else if (st == job_state::failed)
+            failed++;
+        else
+            cancelled++;
+    }
+
+    if (st != job_state::finished || !kept) {
+        error_code ec;
+
+        filesystem::remove(job->path, ec);
+    }
+
+    ae.duration_ms = (uint64_t)chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now() - ae.start).count();
+    ae.row_count = job->rows;
+
+    audit->add(move(ae));
+
+    if (kept)
+        notify(job->key, job->describe());
+}
+
+// newest first
+json export_jobs::list(const string& key) {
+    vector<shared_ptr<export_job>> js;
+
+    {
+        lock_guard<mutex> lg(lock);
+
+        for (const auto& j : jobs) {
+            if (j.second->key == key)
+                js.push_back(j.second);
+        }
+    }
+
+    sort(js.begin(), js.end(), [](const auto& a, const auto& b) {
+        return a->submitted > b->submitted;
+    });
+
+    auto ret = json::array();
+
+    for (const auto& job : js) {
+        ret.push_back(job->describe());
+    }
+
+    return ret;
+}
+
+// Returns a finished job, for downloading. The file stays put while the caller holds on to
+// it.
+shared_ptr<export_job> export_jobs::get(const string& key, const string& id) {
+    lock_guard<mutex> lg(lock);
+
+    auto it = jobs.find(id);
+
+    if (it == jobs.end() || it->second->key != key)
+        throw runtime_error("Background export not found.");
+
+    lock_guard<mutex> lg2(it->second->lock);
+
+    if (it->second->state != job_state::finished)
+        throw runtime_error("Background export hasn't finished.");
+
+    return it->second;
+}
+
+void export_jobs::cancel(const string& key, const string& id) {
+    shared_ptr<export_job> job;
+
+    {
+        lock_guard<mutex> lg(lock);
+
+        auto it = jobs.find(id);
+
+        if (it == jobs.end() || it->second->key != key)
+            throw runtime_error("Background export not found.");
+
+        job = it->second;
+    }
+
+    lock_guard<mutex> lg(job->lock);
+
+    if (job->state != job_state::running || job->cancelling)
+        return;
+
+    job->cancelling = true;
+
+    // if it hasn't got a connection yet, it'll see cancelling once it has
+    if (job->conn)
+        job->conn->conn->cancel();
+}
+
+// If the job's still running, it gets cancelled, and deletes its own file once it's done.
+void export_jobs::remove(const string& key, const string& id) {
+    shared_ptr<export_job> job;
+
+    {
+        lock_guard<mutex> lg(lock);
+
+        auto it = jobs.find(id);
+
+        if (it == jobs.end() || it->second->key != key)
+            throw runtime_error("Background export not found.");
+
+        job = move(it->second);
+        jobs.erase(it);
+    }
+
+    {
+        lock_guard<mutex> lg(job->lock);
+
+        if (job->state == job_state::running) {
+            job->cancelling = true;
+
+            if (job->conn)
+                job->conn->conn->cancel();
+
+            return;
+        }
+    }
+
+    if (downloads)
+        downloads->revoke(job->path);
+
+    error_code ec;
+
+    filesystem::remove(job->path, ec);
+}
+
+// Called by the housekeeper. Jobs being downloaded over the WebSocket are left for the next
+// sweep, as are files which can't be deleted yet, such as ones still open for the
+// download server on Windows.
+void export_jobs::expire() {
+    auto cutoff = chrono::steady_clock::now() - config.export_job_ttl;
+
+    lock_guard<mutex> lg(lock);
+
+    for (auto it = jobs.begin(); it != jobs.end(); ) {
+        bool old;
+
+        {
+            lock_guard<mutex> lg2(it->second->lock);
+
+            old = it->second->state != job_state::running && it->second->ended <= cutoff;
+        }
+
+        if (old && it->second.use_count() == 1) {
+            error_code ec;
+
+            if (downloads)
+                downloads->revoke(it->second->path);
+
+            if (!filesystem::remove(it->second->path, ec) && filesystem::exists(it->second->path, ec)) {
+                it++;
+                continue;
+            }
+
+            it = jobs.erase(it);
+            expired++;
+        } else
+            it++;
+    }
+}
+
+json export_jobs::get_stats() {
+    lock_guard<mutex> lg(lock);
+    unsigned int running = 0;
+
+    for (const auto& j : jobs) {
+        lock_guard<mutex> lg2(j.second->lock);
+
+        if (j.second->state == job_state::running)
+            running++;
+    }
+
+    return json{
+        {"running", running},
+        {"kept", jobs.size()},
+        {"submitted", submitted},
+        {"rejected", rejected},
+        {"finished", finished},
+        {"failed", failed},
+        {"cancelled", cancelled},
+        {"expired", expired}
+    };
+}
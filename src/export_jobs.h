@@ -0,0 +1,106 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <filesystem>
+#include <stdint.h>
+#include <nlohmann/json.hpp>
+#include "conn_pool.h"
+#include "executor.h"
+#include "exporter.h"
+
+#ifdef __MINGW32__
+#include "mingw.mutex.h"
+#else
+#include <mutex>
+#endif
+
+// Exports which run in the background, independently of the session which asked for
+// them, so that they carry on if the browser goes away. Each job has its own connection
+// from the pool, and runs on blocking_workers, as it can take as long as the query does.
+// There are at most export_jobs_per_user of them running for each user, and
+// export_jobs_max in all. A job's file is kept for export_job_ttl once it's finished, so
+// it can be downloaded from any later session of the same user - which means the same
+// server and username, as with db_cache.
+//
+// Jobs only last as long as the process does.
+
+enum class job_state {
+    running,
+    finished,
+    failed,
+    cancelled
+};
+
+class export_job : public tds_handler {
+public:
+    nlohmann::json describe();
+
+    void msg_handler(const std::string_view& server, const std::string_view& message, const std::string_view& proc_name,
+                     const std::string_view& sql_state, int32_t msgno, int32_t line_number, int16_t state, uint8_t priv_msg_type,
+                     uint8_t severity, int oserr) override;
+    void tbl_handler(const std::vector<std::pair<std::string, tds::server_type>>& columns) override;
+    void row_handler(const std::vector<tds::Field>& columns) override;
+    void row_count_handler(unsigned int count) override;
+
+    std::string id;
+    std::string key;
+    std::string server;
+    std::string username;
+    std::string password;
+    std::string database;
+    std::string query;
+    std::unique_ptr<exporter> exp;
+    std::filesystem::path path;
+    std::string mime;
+    std::string filename;
+    std::chrono::system_clock::time_point submitted;
+    std::chrono::steady_clock::time_point started;
+    std::chrono::system_clock::time_point audit_start;
+    std::string audit_id;
+    std::atomic<uint64_t> rows{0};
+    task_handle task;
+
+    // everything below is protected by lock
+    std::mutex lock;
+    job_state state = job_state::running;
+    std::chrono::steady_clock::time_point ended;
+    bool cancelling = false;
+    bool truncated = false;
+    std::string error;
+    std::shared_ptr<pooled_conn> conn;
+};
+
+class export_jobs {
+public:
+    export_jobs(std::function<void(const std::string& key, const nlohmann::json& job)> notify);
+    ~export_jobs();
+    nlohmann::json submit(const std::string& server, const std::string& username, const std::string& password,
+                          const std::string& database, const nlohmann::json& j);
+    nlohmann::json list(const std::string& key);
+    std::shared_ptr<export_job> get(const std::string& key, const std::string& id);
+    void cancel(const std::string& key, const std::string& id);
+    void remove(const std::string& key, const std::string& id);
+    void expire();
+    nlohmann::json get_stats();
+
+private:
+    void run(const std::shared_ptr<export_job>& job);
+
+    std::function<void(const std::string& key, const nlohmann::json& job)> notify;
+    std::mutex lock;
+    std::unordered_map<std::string, std::shared_ptr<export_job>> jobs;
+
+    uint64_t submitted = 0;
+    uint64_t rejected = 0;
+    uint64_t finished = 0;
+    uint64_t failed = 0;
+    uint64_t cancelled = 0;
+    uint64_t expired = 0;
+};
+
+extern std::unique_ptr<export_jobs> background_exports;
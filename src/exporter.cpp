@@ -0,0 +1,93 @@
+#include <stdexcept>
+#include "exporter.h"
+#include "xlsx_writer.h"
+#include "csv_writer.h"
+#include "parquet_writer.h"
+#include "arrow_writer.h"
+#include "config.h"
+#include "tdsweb.h"
+
+using namespace std;
+using json = nlohmann::json;
+
+// "export" is either a string giving the format, or an object with "format" and any
+// options for it
+unique_ptr<exporter> make_exporter(const json& j, filesystem::path& fn) {
+    const auto& ex = j.at("export");
+    string format = ex.is_object() ? ex.at("format") : ex;
+    auto dir = config.export_dir.empty() ? filesystem::temp_directory_path() : filesystem::path(config.export_dir);
+    auto base = "tdsweb-" + make_token();
+
+    if (format == "excel") {
+        fn = dir / (base + ".xlsx");
+
+        return make_unique<xlsx_writer>(fn);
+    } else if (format == "csv" || format == "tsv") {
+        csv_options opts;
+
+        opts.delimiter = format == "tsv" ? '\t' : ',';
+
+        if (ex.is_object()) {
+            if (ex.count("delimiter") > 0) {
+                string d = ex.at("delimiter");
+
+                if (d.length() != 1 || d[0] == '"' || d[0] == '\r' || d[0] == '\n')
+                    throw runtime_error("Invalid delimiter \"" + d + "\".");
+
+                opts.delimiter = d[0];
+            }
+
+            if (ex.count("encoding") > 0) {
+                string enc = ex.at("encoding");
+
+                if (enc == "utf-8")
+                    opts.encoding = csv_encoding::utf8;
+                else if (enc == "utf-8-bom")
+                    opts.encoding = csv_encoding::utf8_bom;
+                else if (enc == "utf-16le")
+                    opts.encoding = csv_encoding::utf16le;
+                else
+                    throw runtime_error("Unsupported encoding \"" + enc + "\".");
+            }
+
+            if (ex.count("gzip") > 0)
+                opts.gzip = ex.at("gzip");
+        }
+
+        opts.ext = format;
+        fn = dir / (base + "." + format + (opts.gzip ? ".gz" : ""));
+
+        return make_unique<csv_writer>(fn, opts);
+    } else if (format == "parquet" || format == "arrow") {
+        auto row_group = config.export_row_group;
+
+        if (ex.is_object() && ex.count("row_group") > 0) {
+            row_group = ex.at("row_group");
+
+            if (row_group == 0)
+                throw runtime_error("row_group must be at least 1.");
+        }
+
+        if (format == "arrow") {
+            fn = dir / (base + ".arrow");
+
+            return make_unique<arrow_writer>(fn, row_group);
+        }
+
+        bool gzip = true;
+
+        if (ex.is_object() && ex.count("compression") > 0) {
+            string comp = ex.at("compression");
+
+            if (comp == "none")
+                gzip = false;
+            else if (comp != "gzip")
+                throw runtime_error("Unsupported compression \"" + comp + "\".");
+        }
+
+        fn = dir / (base + ".parquet");
+
+        return make_unique<parquet_writer>(fn, row_group, gzip);
+    } else
+        throw runtime_error("Unsupported export format \"" + format + "\".");
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <tdscpp.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <filesystem>
+#include <nlohmann/json.hpp>
+
+// A file being written from a query's results, one row at a time, for the browser to
+// download once it's finished. Each format derives from this.
+
+class exporter {
+public:
+    virtual ~exporter() = default;
+    virtual void header(const std::vector<std::pair<std::string, tds::server_type>>& columns) = 0;
+    virtual void row(const std::vector<tds::Field>& columns) = 0;
+    virtual void finish() = 0;
+    virtual std::string mime() const = 0;
+    virtual std::string filename() const = 0;
+
+    bool truncated = false; // if the format couldn't hold every row
+};
+
+// Creates the exporter asked for by the "export" part of a query message, writing to a
+// new file in export_dir, whose name goes in fn.
+std::unique_ptr<exporter> make_exporter(const nlohmann::json& j, std::filesystem::path& fn);
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+// Just enough of a flatbuffers builder to write Arrow's metadata. Like the real thing,
+// it builds the buffer back to front, so children have to be created before their
+// parents, and objects are referred to by their distance from the end of the buffer.
+// The tables here are small, so prepending is good enough.
+
+class flatbuf_builder {
+public:
+    uint32_t create_string(const std::string_view& s) {
+        align(4, s.length() + 1);
+        buf.insert(0, 1, '\0');
+        buf.insert(0, s);
+        push((uint32_t)s.length());
+
+        return (uint32_t)buf.length();
+    }
+
+    uint32_t create_offset_vector(const std::vector<uint32_t>& refs) {
+        align(4, refs.size() * sizeof(uint32_t));
+
+        for (auto it = refs.rbegin(); it != refs.rend(); it++) {
+            push((uint32_t)(buf.length() + sizeof(uint32_t) - *it));
+        }
+
+        push((uint32_t)refs.size());
+
+        return (uint32_t)buf.length();
+    }
+
+    // data is count structs, already laid out
+    uint32_t create_struct_vector(const std::string_view& data, size_t count, size_t alignment) {
+        align(std::max(alignment, sizeof(uint32_t)), data.length());
+        buf.insert(0, data);
+        push((uint32_t)count);
+
+        return (uint32_t)buf.length();
+    }
+
+    void start_table() {
+        fields.clear();
+        table_start = buf.length();
+    }
+
+    template<typename T>
+    void add_scalar(uint16_t id, T v) {
+        push(v);
+        fields.emplace_back(id, (uint32_t)buf.length());
+    }
+
+    void add_offset(uint16_t id, uint32_t ref) {
+        align(4);
+        push((uint32_t)(buf.length() + sizeof(uint32_t) - ref));
+        fields.emplace_back(id, (uint32_t)buf.length());
+    }
+
+    uint32_t end_table() {
+        push((int32_t)0); // offset to vtable, filled in below
+
+        auto table_end = (uint32_t)buf.length();
+        uint16_t num = 0;
+
+        for (const auto& f : fields) {
+            num = std::max(num, (uint16_t)(f.first + 1));
+        }
+
+        std::vector<uint16_t> vt(num, 0);
+
+        for (const auto& f : fields) {
+            vt[f.first] = (uint16_t)(table_end - f.second);
+        }
+
+        for (auto it = vt.rbegin(); it != vt.rend(); it++) {
+            push(*it);
+        }
+
+        push((uint16_t)(table_end - table_start));
+        push((uint16_t)(sizeof(uint16_t) * (2 + num)));
+
+        auto soff = (int32_t)(buf.length() - table_end);
+        auto pos = buf.length() - table_end;
+
+        for (unsigned int i = 0; i < sizeof(int32_t); i++) {
+            buf[pos + i] = (char)((soff >> (i * 8)) & 0xff);
+        }
+
+        return table_end;
+    }
+
+    std::string finish(uint32_t root) {
+        align(std::max(max_align, sizeof(uint32_t)), sizeof(uint32_t));
+        push((uint32_t)(buf.length() + sizeof(uint32_t) - root));
+
+        return std::move(buf);
+    }
+
+private:
+    // pads so that, once extra more bytes have been prepended, we're aligned to n
+    void align(size_t n, size_t extra = 0) {
+        buf.insert(0, (n - ((buf.length() + extra) % n)) % n, '\0');
+        max_align = std::max(max_align, n);
+    }
+
+    template<typename T>
+    void push(T v) {
+        char b[sizeof(T)];
+        auto u = (uint64_t)v;
+
+        align(sizeof(T));
+
+        for (size_t i = 0; i < sizeof(T); i++) {
+            b[i] = (char)(u & 0xff);
+            u >>= 8;
+        }
+
+        buf.insert(0, b, sizeof(T));
+    }
+
+    std::string buf;
+    size_t max_align = 1;
+    size_t table_start;
+    std::vector<std::pair<uint16_t, uint32_t>> fields;
+};
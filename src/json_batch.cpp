@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include "tdsweb.h"
+#include "json_batch.h"
+#include "json_writer.h"
+
+using namespace std;
+
+// largest integer a Javascript number can hold exactly
+static const int64_t JS_MAX_SAFE_INTEGER = 9007199254740991;
+
+// chosen once per column in reset(), so add_row doesn't have to switch on the type of every cell
+template<col_kind K>
+static void encode_json(string& s, json_column&, const tds::Field& col);
+
+template<>
+void encode_json<col_kind::integer>(string& s, json_column&, const tds::Field& col) {
+    if (col.is_null())
+        return json_append_null(s);
+
+    auto v = (int64_t)col;
+
+    // send BIGINTs as strings if the browser would lose precision
+    if (v > JS_MAX_SAFE_INTEGER || v < -JS_MAX_SAFE_INTEGER) {
+        s += '"';
+        json_append_int(s, v);
+        s += '"';
+    } else
+        json_append_int(s, v);
+}
+
+template<>
+void encode_json<col_kind::floating>(string& s, json_column&, const tds::Field& col) {
+    if (col.is_null())
+        return json_append_null(s);
+
+    json_append_double(s, (double)col);
+}
+
+template<>
+void encode_json<col_kind::bit>(string& s, json_column&, const tds::Field& col) {
+    if (col.is_null())
+        return json_append_null(s);
+
+    json_append_bool(s, (int)col != 0);
+}
+
+template<>
+void encode_json<col_kind::date>(string& s, json_column&, const tds::Field& col) {
+    char buf[32];
+
+    if (col.is_null())
+        return json_append_null(s);
+
+    auto d = (tds::Date)col;
+    auto len = snprintf(buf, sizeof(buf), "\"%04d-%02u-%02u\"", d.year(), d.month(), d.day());
+
+    s.append(buf, (size_t)len);
+}
+
+template<>
+void encode_json<col_kind::time>(string& s, json_column&, const tds::Field& col) {
+    char buf[32];
+
+    if (col.is_null())
+        return json_append_null(s);
+
+    auto t = (tds::Time)col;
+    auto len = snprintf(buf, sizeof(buf), "\"%02u:%02u:%02u\"", t.h, t.m, t.s);
+
+    s.append(buf, (size_t)len);
+}
+
+template<>
+void encode_json<col_kind::datetime>(string& s, json_column&, const tds::Field& col) {
+    char buf[32];
+
+    if (col.is_null())
+        return json_append_null(s);
+
+    auto dt = (tds::DateTime)col;
+    auto len = snprintf(buf, sizeof(buf), "\"%04d-%02u-%02uT%02u:%02u:%02u\"", dt.d.year(), dt.d.month(), dt.d.day(),
+                        dt.t.h, dt.t.m, dt.t.s);
+
+    s.append(buf, (size_t)len);
+}
+
+template<>
+void encode_json<col_kind::string>(string& s, json_column& c, const tds::Field& col) {
+    const string* added;
+
+    if (col.is_null())
+        return json_append_null(s);
+
+    if (!c.dict.enabled)
+        return json_append_string(s, (string)col);
+
+    auto id = c.dict.lookup((string)col, added);
+
+    if (added) {
+        c.dict_new += ',';
+        json_append_string(c.dict_new, *added);
+    }
+
+    json_append_int(s, id);
+}
+
+static json_encoder get_json_encoder(tds::server_type type) {
+    return with_col_kind(get_col_kind(type), [](auto k) -> json_encoder {
+        return encode_json<decltype(k)::value>;
+    });
+}
+
+void json_batch::reset(const vector<pair<string, tds::server_type>>& columns) {
+    cols.resize(columns.size());
+
+    for (size_t i = 0; i < columns.size(); i++) {
+        cols[i].enc = get_json_encoder(get<1>(columns[i]));
+        cols[i].dict.reset();
+    }
+
+    clear();
+}
+
+void json_batch::clear() {
+    // clear() keeps the buffers' capacity, so they get reused for the next batch
+    buf.clear();
+
+    for (auto& c : cols) {
+        c.dict_new.clear();
+        c.dict.end_batch();
+    }
+
+    rows = 0;
+}
+
+void json_batch::add_row(const vector<tds::Field>& columns) {
+    if (rows != 0)
+        buf += ',';
+
+    buf += '[';
+
+    for (size_t i = 0; i < columns.size(); i++) {
+        if (i != 0)
+            buf += ',';
+
+        cols[i].enc(buf, cols[i], columns[i]);
+    }
+
+    buf += ']';
+    rows++;
+}
+
+size_t json_batch::size() const {
+    size_t len = buf.length();
+
+    for (const auto& c : cols) {
+        len += c.dict_new.length();
+    }
+
+    return len;
+}
+
+void json_batch::write(string& msg) const {
+    bool first = true;
+
+    msg.assign(R"({"type":"rows","rows":[)");
+    msg += buf;
+    msg += ']';
+
+    for (size_t i = 0; i < cols.size(); i++) {
+        if (cols[i].dict_new.empty())
+            continue;
+
+        msg += first ? R"(,"dict":[)" : ",";
+        first = false;
+
+        msg += '[';
+        json_append_int(msg, (int64_t)i);
+        msg += cols[i].dict_new;
+        msg += ']';
+    }
+
+    if (!first)
+        msg += ']';
+
+    msg += '}';
+}
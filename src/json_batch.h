@@ -0,0 +1,39 @@
+#pragma once
+
+#include <tdscpp.h>
+#include <string>
+#include <vector>
+#include "string_dict.h"
+
+// JSON encoding of a batch of rows, sent as
+//
+//   {"type":"rows","rows":[[...],...],"dict":[[col,"value",...],...]}
+//
+// Values in string columns which are being dictionary-encoded are sent as the number
+// of the entry in that column's dictionary. "dict" is only present if the batch added
+// any entries, and lists them in id order after the index of the column they belong to.
+
+struct json_column;
+
+typedef void (*json_encoder)(std::string& s, json_column& c, const tds::Field& col);
+
+struct json_column {
+    json_encoder enc;
+    string_dict dict;
+    std::string dict_new;
+};
+
+class json_batch {
+public:
+    void reset(const std::vector<std::pair<std::string, tds::server_type>>& columns);
+    void add_row(const std::vector<tds::Field>& columns);
+    void write(std::string& msg) const;
+    void clear();
+    size_t size() const;
+
+    unsigned int rows = 0;
+
+private:
+    std::vector<json_column> cols;
+    std::string buf;
+};
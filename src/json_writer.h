@@ -0,0 +1,106 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <charconv>
+#include <cmath>
+#include <stdio.h>
+#include <stdint.h>
+
+// Minimal JSON output helpers, appending straight onto a caller-owned buffer rather
+// than building an nlohmann::json tree and dumping it.
+
+static inline void json_append_string(std::string& s, const std::string_view& v) {
+    static const char hex[] = "0123456789abcdef";
+
+    s += '"';
+
+    auto start = v.data();
+    auto end = v.data() + v.length();
+
+    for (auto p = start; p < end; p++) {
+        auto c = (unsigned char)*p;
+
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+        s.append(start, p - start);
+        start = p + 1;
+
+        switch (c) {
+            case '"':
+                s += "\\\"";
+                break;
+
+            case '\\':
+                s += "\\\\";
+                break;
+
+            case '\b':
+                s += "\\b";
+                break;
+
+            case '\f':
+                s += "\\f";
+                break;
+
+            case '\n':
+                s += "\\n";
+                break;
+
+            case '\r':
+                s += "\\r";
+                break;
+
+            case '\t':
+                s += "\\t";
+                break;
+
+            default: {
+                char buf[] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+
+                s.append(buf, sizeof(buf));
+                break;
+            }
+        }
+    }
+
+    s.append(start, end - start);
+    s += '"';
+}
+
+static inline void json_append_int(std::string& s, int64_t v) {
+    char buf[24];
+
+    auto r = std::to_chars(buf, buf + sizeof(buf), v);
+
+    s.append(buf, r.ptr - buf);
+}
+
+static inline void json_append_double(std::string& s, double v) {
+    char buf[32];
+
+    // JSON has no representation of NaN or infinity
+    if (!std::isfinite(v)) {
+        s += "null";
+        return;
+    }
+
+#ifdef __cpp_lib_to_chars
+    auto r = std::to_chars(buf, buf + sizeof(buf), v);
+
+    s.append(buf, r.ptr - buf);
+#else
+    auto len = snprintf(buf, sizeof(buf), "%.17g", v);
+
+    s.append(buf, (size_t)len);
+#endif
+}
+
+static inline void json_append_bool(std::string& s, bool v) {
+    s += v ? "true" : "false";
+}
+
+static inline void json_append_null(std::string& s) {
+    s += "null";
+}
@@ -0,0 +1,162 @@
+/**
+* @file mingw.condition_variable.h
+* @brief std::condition_variable implementation for MinGW
+*
+* @copyright Simplified (2-clause) BSD License.
+* You should have received a copy of the license along with this
+* program.
+*
+* This code is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* @note
+* Companion to mingw.mutex.h and mingw.thread.h. Only the subset of the
+* standard interface used by this project is provided.
+*/
+
+#ifndef MINGW_CONDITIONAL_VARIABLE_H
+#define MINGW_CONDITIONAL_VARIABLE_H
+
+#if !defined(__cplusplus) || (__cplusplus < 201103L)
+#error A C++11 compiler is required!
+#endif
+
+#include <chrono>
+#include <system_error>
+
+#include "mingw.mutex.h"
+
+#include <sdkddkver.h>  //  Detect Windows version.
+#include <windows.h>
+#include <synchapi.h>
+
+namespace mingw_stdthread
+{
+#if defined(__MINGW32__ ) && !defined(_GLIBCXX_HAS_GTHREADS)
+enum class cv_status { no_timeout, timeout };
+#else
+using std::cv_status;
+#endif
+
+//    Works with any BasicLockable. The user's lock is released while we hold
+//  an internal SRW lock, so a notify can't slip in between the unlock and the
+//  sleep.
+class condition_variable_any
+{
+    CONDITION_VARIABLE mHandle;
+    SRWLOCK mInternal;
+
+    template<class L>
+    bool wait_impl(L& lock, DWORD timeout)
+    {
+        AcquireSRWLockExclusive(&mInternal);
+        lock.unlock();
+        BOOL ret = SleepConditionVariableSRW(&mHandle, &mInternal, timeout, 0);
+        DWORD err = ret ? 0 : GetLastError();
+        ReleaseSRWLockExclusive(&mInternal);
+        lock.lock();
+
+        if (!ret && err != ERROR_TIMEOUT)
+            throw std::system_error(err, std::generic_category());
+
+        return ret != 0;
+    }
+public:
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wzero-as-null-pointer-constant"
+    condition_variable_any() noexcept : mHandle(CONDITION_VARIABLE_INIT), mInternal(SRWLOCK_INIT) { }
+#pragma GCC diagnostic pop
+    condition_variable_any(const condition_variable_any&) = delete;
+    condition_variable_any& operator=(const condition_variable_any&) = delete;
+
+    void notify_one() noexcept
+    {
+        AcquireSRWLockExclusive(&mInternal);
+        WakeConditionVariable(&mHandle);
+        ReleaseSRWLockExclusive(&mInternal);
+    }
+
+    void notify_all() noexcept
+    {
+        AcquireSRWLockExclusive(&mInternal);
+        WakeAllConditionVariable(&mHandle);
+        ReleaseSRWLockExclusive(&mInternal);
+    }
+
+    template<class L>
+    void wait(L& lock)
+    {
+        wait_impl(lock, INFINITE);
+    }
+
+    template<class L, class Predicate>
+    void wait(L& lock, Predicate pred)
+    {
+        while (!pred())
+            wait(lock);
+    }
+
+    template<class L, class Rep, class Period>
+    cv_status wait_for(L& lock, const std::chrono::duration<Rep, Period>& rel_time)
+    {
+        using namespace std::chrono;
+
+        auto ms = duration_cast<milliseconds>(rel_time);
+
+        if (ms < rel_time)
+            ms += milliseconds(1);
+
+        if (ms.count() <= 0)
+            ms = milliseconds(0);
+        else if (ms.count() >= (long long)INFINITE)
+            ms = milliseconds(INFINITE - 1);
+
+        return wait_impl(lock, (DWORD)ms.count()) ? cv_status::no_timeout : cv_status::timeout;
+    }
+
+    template<class L, class Rep, class Period, class Predicate>
+    bool wait_for(L& lock, const std::chrono::duration<Rep, Period>& rel_time, Predicate pred)
+    {
+        return wait_until(lock, std::chrono::steady_clock::now() + rel_time, pred);
+    }
+
+    template<class L, class Clock, class Duration>
+    cv_status wait_until(L& lock, const std::chrono::time_point<Clock, Duration>& abs_time)
+    {
+        auto now = Clock::now();
+
+        if (abs_time <= now)
+            return cv_status::timeout;
+
+        wait_for(lock, abs_time - now);
+
+        return Clock::now() >= abs_time ? cv_status::timeout : cv_status::no_timeout;
+    }
+
+    template<class L, class Clock, class Duration, class Predicate>
+    bool wait_until(L& lock, const std::chrono::time_point<Clock, Duration>& abs_time, Predicate pred)
+    {
+        while (!pred()) {
+            if (wait_until(lock, abs_time) == cv_status::timeout)
+                return pred();
+        }
+
+        return true;
+    }
+};
+
+class condition_variable : public condition_variable_any
+{
+};
+} //  Namespace mingw_stdthread
+
+//  Push objects into std, but only if they are not already there.
+namespace std
+{
+#if defined(__MINGW32__ ) && !defined(_GLIBCXX_HAS_GTHREADS)
+using mingw_stdthread::cv_status;
+using mingw_stdthread::condition_variable;
+using mingw_stdthread::condition_variable_any;
+#endif
+}
+#endif // MINGW_CONDITIONAL_VARIABLE_H
@@ -0,0 +1,163 @@
+#include <stdexcept>
+#include <zlib.h>
+#include "parallel_deflate.h"
+#include "executor.h"
+
+using namespace std;
+
+// pigz's default
+static const size_t PDEFLATE_BLOCK_SIZE = 131072;
+
+// the most deflate can look back
+static const size_t PDEFLATE_DICT_SIZE = 32768;
+
+parallel_deflate::parallel_deflate(int level, function<void(const string_view&)> sink) : level(level), sink(move(sink)) {
+    reset();
+}
+
+// ready for a new stream
+void parallel_deflate::reset() {
+    crc = (uint32_t)crc32(0, Z_NULL, 0);
+    size = 0;
+    pending.clear();
+    tail.clear();
+    inflight.clear();
+}
+
+void parallel_deflate::compress(block& b) {
+    z_stream strm;
+
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+
+    auto err = deflateInit2(&strm, b.level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+
+    if (err != Z_OK)
+        throw runtime_error("deflateInit2 returned " + to_string(err) + ".");
+
+    try {
+        if (!b.dict.empty())
+            deflateSetDictionary(&strm, (const Bytef*)b.dict.data(), (uInt)b.dict.length());
+
+        // room for the sync flush's empty stored block as well
+        b.out.resize(deflateBound(&strm, (uLong)b.in.length()) + 16);
+
+        strm.next_in = (Bytef*)b.in.data();
+        strm.avail_in = (uInt)b.in.length();
+        strm.next_out = (Bytef*)b.out.data();
+        strm.avail_out = (uInt)b.out.length();
+
+        err = deflate(&strm, b.last ? Z_FINISH : Z_SYNC_FLUSH);
+
+        if (b.last ? err != Z_STREAM_END : (err != Z_OK || strm.avail_in != 0))
+            throw runtime_error("deflate returned " + to_string(err) + ".");
+
+        b.out.resize(b.out.length() - strm.avail_out);
+    } catch (...) {
+        deflateEnd(&strm);
+        throw;
+    }
+
+    deflateEnd(&strm);
+
+    b.crc = (uint32_t)crc32(0, (const Bytef*)b.in.data(), (uInt)b.in.length());
+
+    // not needed any more
+    string().swap(b.in);
+    string().swap(b.dict);
+}
+
+// Does nothing if someone else has already started on the block.
+void parallel_deflate::run(block& b) {
+    if (b.claimed.exchange(true))
+        return;
+
+    try {
+        compress(b);
+    } catch (...) {
+        b.err = current_exception();
+    }
+
+    lock_guard<mutex> lg(b.lock);
+
+    b.done = true;
+    b.cv.notify_all();
+}
+
+void parallel_deflate::submit(bool last) {
+    auto b = make_shared<block>();
+
+    b->in.swap(pending);
+    b->dict = tail;
+    b->length = b->in.length();
+    b->last = last;
+    b->level = level;
+
+    if (b->in.length() >= PDEFLATE_DICT_SIZE)
+        tail.assign(b->in, b->in.length() - PDEFLATE_DICT_SIZE, PDEFLATE_DICT_SIZE);
+    else {
+        tail += b->in;
+
+        if (tail.length() > PDEFLATE_DICT_SIZE)
+            tail.erase(0, tail.length() - PDEFLATE_DICT_SIZE);
+    }
+
+    size += b->length;
+    inflight.push_back(b);
+
+    if (workers) {
+        workers->submit([b]() {
+            run(*b);
+        });
+    }
+
+    size_t max_inflight = workers ? (size_t)workers->size() * 2 : 0;
+
+    while (inflight.size() > max_inflight) {
+        retire();
+    }
+}
+
+// writes out the oldest block, waiting for it if need be
+void parallel_deflate::retire() {
+    auto b = move(inflight.front());
+
+    inflight.pop_front();
+
+    run(*b);
+
+    {
+        unique_lock<mutex> ul(b->lock);
+
+        b->cv.wait(ul, [&]() { return b->done; });
+    }
+
+    if (b->err)
+        rethrow_exception(b->err);
+
+    crc = (uint32_t)crc32_combine(crc, b->crc, (z_off_t)b->length);
+    sink(b->out);
+}
+
+void parallel_deflate::write(const string_view& data) {
+    auto sv = data;
+
+    while (!sv.empty()) {
+        auto len = min(sv.length(), PDEFLATE_BLOCK_SIZE - pending.length());
+
+        pending.append(sv.data(), len);
+        sv.remove_prefix(len);
+
+        if (pending.length() == PDEFLATE_BLOCK_SIZE)
+            submit(false);
+    }
+}
+
+void parallel_deflate::finish() {
+    submit(true);
+
+    while (!inflight.empty()) {
+        retire();
+    }
+}
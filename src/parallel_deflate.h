@@ -0,0 +1,67 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <exception>
+#include <stdint.h>
+
+#ifdef __MINGW32__
+#include "mingw.mutex.h"
+#include "mingw.condition_variable.h"
+#else
+#include <mutex>
+#include <condition_variable>
+#endif
+
+// Raw deflate of a stream, in the manner of pigz: the input is cut into blocks which are
+// compressed independently on the worker pool, each primed with the last 32 KB of the
+// block before so that the ratio barely suffers. Each block but the last ends with a
+// sync flush, so that the outputs can just be concatenated into a single, standard
+// deflate stream. CRC32s are done per block too, and combined.
+//
+// Output goes to sink in order. At most a couple of blocks per worker are outstanding at
+// once, so memory use doesn't depend on the size of the stream. Whoever's waiting for a
+// block which hasn't started yet compresses it themselves, so it's safe to use from a
+// task on the pool - even if every worker is doing the same thing.
+
+class parallel_deflate {
+public:
+    parallel_deflate(int level, std::function<void(const std::string_view&)> sink);
+    void write(const std::string_view& data);
+    void finish();
+    void reset();
+
+    uint32_t crc;
+    uint64_t size;
+
+private:
+    struct block {
+        std::string in;
+        std::string dict;
+        std::string out;
+        uint32_t crc;
+        size_t length;
+        bool last;
+        int level;
+        std::atomic<bool> claimed{false};
+        std::mutex lock;
+        std::condition_variable cv;
+        bool done = false;
+        std::exception_ptr err;
+    };
+
+    static void run(block& b);
+    static void compress(block& b);
+    void submit(bool last);
+    void retire();
+
+    int level;
+    std::function<void(const std::string_view&)> sink;
+    std::string pending;
+    std::string tail;
+    std::deque<std::shared_ptr<block>> inflight;
+};
@@ -0,0 +1,455 @@
+#include <stdexcept>
+#include "parquet_writer.h"
+#include "byte_writer.h"
+
+using namespace std;
+
+// row groups get written early if they get this big, whatever row_group says
+static const size_t PARQUET_ROW_GROUP_BYTES = 67108864;
+
+// from parquet.thrift
+enum class parquet_type : int32_t {
+    BOOLEAN = 0,
+    INT32 = 1,
+    INT64 = 2,
+    DOUBLE = 5,
+    BYTE_ARRAY = 6
+};
+
+static const int32_t PARQUET_OPTIONAL = 1;
+static const int32_t PARQUET_CONVERTED_UTF8 = 0;
+static const int32_t PARQUET_CONVERTED_DATE = 6;
+static const int32_t PARQUET_ENCODING_PLAIN = 0;
+static const int32_t PARQUET_ENCODING_RLE = 3;
+static const int32_t PARQUET_CODEC_UNCOMPRESSED = 0;
+static const int32_t PARQUET_CODEC_GZIP = 2;
+static const int32_t PARQUET_DATA_PAGE = 0;
+
+// Thrift compact protocol types
+static const uint8_t THRIFT_BOOL_TRUE = 1;
+static const uint8_t THRIFT_BOOL_FALSE = 2;
+static const uint8_t THRIFT_I32 = 5;
+static const uint8_t THRIFT_I64 = 6;
+static const uint8_t THRIFT_BINARY = 8;
+static const uint8_t THRIFT_LIST = 9;
+static const uint8_t THRIFT_STRUCT = 12;
+
+// Just enough of Thrift's compact protocol to write Parquet's metadata. Fields have to
+// be written in order of their IDs.
+class thrift_writer {
+public:
+    void i32(int16_t id, int32_t v) {
+        field(id, THRIFT_I32);
+        varint(((uint32_t)v << 1) ^ (uint32_t)(v >> 31));
+    }
+
+    void i64(int16_t id, int64_t v) {
+        field(id, THRIFT_I64);
+        varint(((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+    }
+
+    void binary(int16_t id, const string_view& s) {
+        field(id, THRIFT_BINARY);
+        list_binary(s);
+    }
+
+    void boolean(int16_t id, bool v) {
+        field(id, v ? THRIFT_BOOL_TRUE : THRIFT_BOOL_FALSE);
+    }
+
+    void begin_struct(int16_t id) {
+        field(id, THRIFT_STRUCT);
+        begin_list_struct();
+    }
+
+    void end_struct() {
+        buf += (char)0; // stop
+        last = ids.back();
+        ids.pop_back();
+    }
+
+    void begin_list(int16_t id, uint8_t type, size_t count) {
+        field(id, THRIFT_LIST);
+
+        if (count < 15)
+            buf += (char)((count << 4) | type);
+        else {
+            buf += (char)(0xf0 | type);
+            varint(count);
+        }
+    }
+
+    void list_i32(int32_t v) {
+        varint(((uint32_t)v << 1) ^ (uint32_t)(v >> 31));
+    }
+
+    void list_binary(const string_view& s) {
+        varint(s.length());
+        buf += s;
+    }
+
+    void begin_list_struct() {
+        ids.push_back(last);
+        last = 0;
+    }
+
+    string buf;
+
+private:
+    void field(int16_t id, uint8_t type) {
+        if (id > last && id - last <= 15)
+            buf += (char)(((id - last) << 4) | type);
+        else {
+            buf += (char)type;
+            varint(((uint32_t)id << 1) ^ (uint32_t)(id >> 15));
+        }
+
+        last = id;
+    }
+
+    void varint(uint64_t v) {
+        while (v >= 0x80) {
+            buf += (char)((v & 0x7f) | 0x80);
+            v >>= 7;
+        }
+
+        buf += (char)v;
+    }
+
+    int16_t last = 0;
+    vector<int16_t> ids;
+};
+
+static parquet_type get_parquet_type(columnar_type type) {
+    switch (type) {
+        case columnar_type::INT32:
+        case columnar_type::DATE32:
+        case columnar_type::TIME32_MS:
+            return parquet_type::INT32;
+
+        case columnar_type::INT64:
+        case columnar_type::TIMESTAMP_US:
+            return parquet_type::INT64;
+
+        case columnar_type::FLOAT64:
+            return parquet_type::DOUBLE;
+
+        case columnar_type::BOOL:
+            return parquet_type::BOOLEAN;
+
+        default:
+            return parquet_type::BYTE_ARRAY;
+    }
+}
+
+parquet_writer::parquet_writer(const filesystem::path& fn, unsigned int row_group, bool gzip) :
+                               f(fn, ios::binary), row_group(row_group), gzip(gzip) {
+    if (!f.good())
+        throw runtime_error("Could not create " + fn.string() + ".");
+
+    if (gzip) {
+        strm.zalloc = Z_NULL;
+        strm.zfree = Z_NULL;
+        strm.opaque = Z_NULL;
+
+        if (deflateInit2(&strm, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw runtime_error("deflateInit2 failed.");
+    }
+
+    out("PAR1");
+}
+
+parquet_writer::~parquet_writer() {
+    if (gzip)
+        deflateEnd(&strm);
+}
+
+void parquet_writer::out(const string_view& s) {
+    f.write(s.data(), (streamsize)s.length());
+
+    if (!f.good())
+        throw runtime_error("Error writing export file.");
+
+    offset += s.length();
+}
+
+void parquet_writer::header(const vector<pair<string, tds::server_type>>& columns) {
+    if (have_schema) {
+        truncated = true;
+        skipping = true;
+        return;
+    }
+
+    batch.reset(columns);
+    have_schema = true;
+}
+
+void parquet_writer::row(const vector<tds::Field>& columns) {
+    if (skipping)
+        return;
+
+    batch.add_row(columns);
+
+    if (batch.rows >= row_group || batch.size() >= PARQUET_ROW_GROUP_BYTES)
+        write_row_group();
+}
+
+void parquet_writer::write_chunk(const columnar_column& c, row_group_meta& rg) {
+    auto rows = batch.rows;
+    auto bitmap_len = (rows + 7) / 8;
+
+    page.clear();
+
+    // definition levels, as a single bit-packed run of bit width 1 - which is exactly the
+    // validity bitmap
+    {
+        string levels;
+        auto header = (uint64_t)(bitmap_len << 1) | 1;
+
+        while (header >= 0x80) {
+            levels += (char)((header & 0x7f) | 0x80);
+            header >>= 7;
+        }
+
+        levels += (char)header;
+        levels.append(c.validity, 0, bitmap_len);
+
+        append_le(page, (uint32_t)levels.length());
+        page += levels;
+    }
+
+    // PLAIN values, skipping NULLs
+    auto valid = [&](unsigned int i) {
+        return c.validity[i / 8] & (1 << (i % 8));
+    };
+
+    switch (c.type) {
+        case columnar_type::BOOL: {
+            unsigned int n = 0;
+
+            for (unsigned int i = 0; i < rows; i++) {
+                if (!valid(i))
+                    continue;
+
+                if ((n & 7) == 0)
+                    page += (char)0;
+
+                if (c.data[i / 8] & (1 << (i % 8)))
+                    page.back() |= (char)(1 << (n & 7));
+
+                n++;
+            }
+
+            break;
+        }
+
+        case columnar_type::UTF8: {
+            auto off = (const uint8_t*)c.offsets.data();
+
+            for (unsigned int i = 0; i < rows; i++) {
+                if (!valid(i))
+                    continue;
+
+                auto start = (uint32_t)off[i * 4] | ((uint32_t)off[(i * 4) + 1] << 8) |
+                             ((uint32_t)off[(i * 4) + 2] << 16) | ((uint32_t)off[(i * 4) + 3] << 24);
+                auto end = (uint32_t)off[(i + 1) * 4] | ((uint32_t)off[((i + 1) * 4) + 1] << 8) |
+                           ((uint32_t)off[((i + 1) * 4) + 2] << 16) | ((uint32_t)off[((i + 1) * 4) + 3] << 24);
+
+                append_le(page, end - start);
+                page.append(c.data, start, end - start);
+            }
+
+            break;
+        }
+
+        default: {
+            auto width = c.data.length() / rows;
+
+            if (c.null_count == 0)
+                page += c.data;
+            else {
+                for (unsigned int i = 0; i < rows; i++) {
+                    if (valid(i))
+                        page.append(c.data, i * width, width);
+                }
+            }
+        }
+    }
+
+    const string* data = &page;
+
+    if (gzip) {
+        deflateReset(&strm);
+
+        zpage.resize(deflateBound(&strm, (uLong)page.length()) + 32); // plus gzip header
+
+        strm.next_in = (Bytef*)page.data();
+        strm.avail_in = (uInt)page.length();
+        strm.next_out = (Bytef*)zpage.data();
+        strm.avail_out = (uInt)zpage.length();
+
+        if (deflate(&strm, Z_FINISH) != Z_STREAM_END)
+            throw runtime_error("deflate failed.");
+
+        zpage.resize(zpage.length() - strm.avail_out);
+        data = &zpage;
+    }
+
+    thrift_writer t;
+
+    t.i32(1, PARQUET_DATA_PAGE);
+    t.i32(2, (int32_t)page.length());
+    t.i32(3, (int32_t)data->length());
+    t.begin_struct(5);
+    t.i32(1, (int32_t)rows);
+    t.i32(2, PARQUET_ENCODING_PLAIN);
+    t.i32(3, PARQUET_ENCODING_RLE);
+    t.i32(4, PARQUET_ENCODING_RLE);
+    t.end_struct();
+    t.buf += (char)0;
+
+    rg.chunks.push_back({offset, t.buf.length() + page.length(), t.buf.length() + data->length()});
+    rg.size += t.buf.length() + page.length();
+
+    out(t.buf);
+    out(*data);
+}
+
+void parquet_writer::write_row_group() {
+    row_group_meta rg;
+
+    rg.rows = batch.rows;
+    rg.size = 0;
+
+    for (const auto& c : batch.cols) {
+        write_chunk(c, rg);
+    }
+
+    total_rows += batch.rows;
+    row_groups.push_back(move(rg));
+
+    batch.clear();
+}
+
+void parquet_writer::finish() {
+    if (batch.rows > 0)
+        write_row_group();
+
+    const auto& cols = batch.cols;
+    thrift_writer t;
+
+    t.i32(1, 1); // version
+
+    t.begin_list(2, THRIFT_STRUCT, cols.size() + 1);
+
+    t.begin_list_struct();
+    t.binary(4, "schema");
+    t.i32(5, (int32_t)cols.size());
+    t.end_struct();
+
+    for (const auto& c : cols) {
+        t.begin_list_struct();
+        t.i32(1, (int32_t)get_parquet_type(c.type));
+        t.i32(3, PARQUET_OPTIONAL);
+        t.binary(4, c.name);
+
+        if (c.type == columnar_type::UTF8)
+            t.i32(6, PARQUET_CONVERTED_UTF8);
+        else if (c.type == columnar_type::DATE32)
+            t.i32(6, PARQUET_CONVERTED_DATE);
+
+        // logicalType - times are local, so isAdjustedToUTC is false, which the old
+        // converted types can't express
+        switch (c.type) {
+            case columnar_type::UTF8:
+                t.begin_struct(10);
+                t.begin_struct(1); // STRING
+                t.end_struct();
+                t.end_struct();
+                break;
+
+            case columnar_type::DATE32:
+                t.begin_struct(10);
+                t.begin_struct(6); // DATE
+                t.end_struct();
+                t.end_struct();
+                break;
+
+            case columnar_type::TIME32_MS:
+            case columnar_type::TIMESTAMP_US:
+                t.begin_struct(10);
+                t.begin_struct(c.type == columnar_type::TIME32_MS ? 7 : 8); // TIME or TIMESTAMP
+                t.boolean(1, false); // isAdjustedToUTC
+                t.begin_struct(2); // unit
+                t.begin_struct(c.type == columnar_type::TIME32_MS ? 1 : 2); // MILLIS or MICROS
+                t.end_struct();
+                t.end_struct();
+                t.end_struct();
+                t.end_struct();
+                break;
+
+            default:
+                break;
+        }
+
+        t.end_struct();
+    }
+
+    t.i64(3, (int64_t)total_rows);
+
+    t.begin_list(4, THRIFT_STRUCT, row_groups.size());
+
+    for (const auto& rg : row_groups) {
+        t.begin_list_struct();
+
+        t.begin_list(1, THRIFT_STRUCT, rg.chunks.size());
+
+        for (size_t i = 0; i < rg.chunks.size(); i++) {
+            const auto& ch = rg.chunks[i];
+
+            t.begin_list_struct();
+            t.i64(2, (int64_t)ch.offset); // file_offset
+
+            t.begin_struct(3);
+            t.i32(1, (int32_t)get_parquet_type(cols[i].type));
+            t.begin_list(2, THRIFT_I32, 2);
+            t.list_i32(PARQUET_ENCODING_PLAIN);
+            t.list_i32(PARQUET_ENCODING_RLE);
+            t.begin_list(3, THRIFT_BINARY, 1);
+            t.list_binary(cols[i].name);
+            t.i32(4, gzip ? PARQUET_CODEC_GZIP : PARQUET_CODEC_UNCOMPRESSED);
+            t.i64(5, (int64_t)rg.rows);
+            t.i64(6, (int64_t)ch.uncompressed);
+            t.i64(7, (int64_t)ch.compressed);
+            t.i64(9, (int64_t)ch.offset); // data_page_offset
+            t.end_struct();
+
+            t.end_struct();
+        }
+
+        t.i64(2, (int64_t)rg.size);
+        t.i64(3, (int64_t)rg.rows);
+        t.end_struct();
+    }
+
+    t.binary(6, "tdsweb");
+    t.buf += (char)0;
+
+    append_le(t.buf, (uint32_t)t.buf.length());
+    t.buf += "PAR1";
+
+    out(t.buf);
+
+    f.close();
+
+    if (f.fail())
+        throw runtime_error("Error writing export file.");
+}
+
+string parquet_writer::mime() const {
+    return "application/vnd.apache.parquet";
+}
+
+string parquet_writer::filename() const {
+    return "results.parquet";
+}
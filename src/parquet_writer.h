@@ -0,0 +1,60 @@
+#pragma once
+
+#include <tdscpp.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+#include <stdint.h>
+#include <zlib.h>
+#include "exporter.h"
+#include "columnar.h"
+
+// Writes results as a Parquet file, one row group per row_group rows, so that only one
+// row group is ever held in memory. Only the first result set is exported, as the file
+// can only have one schema.
+//
+// Each column chunk is a single v1 data page, PLAIN encoded, with the definition levels
+// bit-packed straight from the validity bitmap, and optionally gzipped. The Thrift
+// metadata is written by hand, so there's no dependency on the Parquet libraries.
+
+class parquet_writer : public exporter {
+public:
+    parquet_writer(const std::filesystem::path& fn, unsigned int row_group, bool gzip);
+    ~parquet_writer();
+    void header(const std::vector<std::pair<std::string, tds::server_type>>& columns) override;
+    void row(const std::vector<tds::Field>& columns) override;
+    void finish() override;
+    std::string mime() const override;
+    std::string filename() const override;
+
+private:
+    struct chunk_meta {
+        uint64_t offset;
+        uint64_t uncompressed;
+        uint64_t compressed;
+    };
+
+    struct row_group_meta {
+        uint64_t rows;
+        uint64_t size;
+        std::vector<chunk_meta> chunks;
+    };
+
+    void write_row_group();
+    void write_chunk(const columnar_column& c, row_group_meta& rg);
+    void out(const std::string_view& s);
+
+    std::ofstream f;
+    unsigned int row_group;
+    bool gzip;
+    z_stream strm;
+    columnar_batch batch;
+    bool have_schema = false;
+    bool skipping = false;
+    std::vector<row_group_meta> row_groups;
+    uint64_t total_rows = 0;
+    uint64_t offset = 0;
+    std::string page;
+    std::string zpage;
+};
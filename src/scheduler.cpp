@@ -0,0 +1,87 @@
+#include <iostream>
+#include "scheduler.h"
+
+using namespace std;
+
+unique_ptr<scheduler> housekeeper;
+
+scheduler::scheduler() {
+    t = thread(&scheduler::run, this);
+}
+
+scheduler::~scheduler() {
+    {
+        lock_guard<mutex> lg(lock);
+
+        stop = true;
+        cv.notify_one();
+    }
+
+    t.join();
+}
+
+uint64_t scheduler::add(chrono::steady_clock::time_point when, chrono::steady_clock::duration interval,
+                        function<void()> func) {
+    lock_guard<mutex> lg(lock);
+
+    auto id = next_id++;
+
+    tasks.emplace(when, task{id, interval, move(func)});
+    cv.notify_one();
+
+    return id;
+}
+
+uint64_t scheduler::after(chrono::steady_clock::duration delay, function<void()> func) {
+    return add(chrono::steady_clock::now() + delay, chrono::steady_clock::duration::zero(), move(func));
+}
+
+uint64_t scheduler::every(chrono::steady_clock::duration interval, function<void()> func) {
+    return add(chrono::steady_clock::now() + interval, interval, move(func));
+}
+
+void scheduler::cancel(uint64_t id) {
+    lock_guard<mutex> lg(lock);
+
+    for (auto it = tasks.begin(); it != tasks.end(); it++) {
+        if (it->second.id == id) {
+            tasks.erase(it);
+            return;
+        }
+    }
+}
+
+void scheduler::run() {
+    unique_lock<mutex> ul(lock);
+
+    while (!stop) {
+        if (tasks.empty()) {
+            cv.wait(ul);
+            continue;
+        }
+
+        auto when = tasks.begin()->first;
+
+        if (chrono::steady_clock::now() < when) {
+            cv.wait_until(ul, when);
+            continue;
+        }
+
+        auto tsk = move(tasks.begin()->second);
+
+        tasks.erase(tasks.begin());
+
+        if (tsk.interval != chrono::steady_clock::duration::zero())
+            tasks.emplace(when + tsk.interval, task{tsk.id, tsk.interval, tsk.func});
+
+        ul.unlock();
+
+        try {
+            tsk.func();
+        } catch (const exception& e) {
+            cerr << "Scheduled task failed: " << e.what() << endl;
+        }
+
+        ul.lock();
+    }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <map>
+#include <chrono>
+#include <stdint.h>
+
+#ifdef __MINGW32__
+#include "mingw.thread.h"
+#include "mingw.mutex.h"
+#include "mingw.condition_variable.h"
+#else
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#endif
+
+// Background thread for housekeeping which needs to happen at a certain time, such as
+// evicting idle connections. Callbacks run one at a time on the scheduler's thread,
+// so shouldn't block for long.
+
+class scheduler {
+public:
+    scheduler();
+    ~scheduler();
+    uint64_t after(std::chrono::steady_clock::duration delay, std::function<void()> func);
+    uint64_t every(std::chrono::steady_clock::duration interval, std::function<void()> func);
+    void cancel(uint64_t id);
+
+private:
+    struct task {
+        uint64_t id;
+        std::chrono::steady_clock::duration interval;
+        std::function<void()> func;
+    };
+
+    void run();
+    uint64_t add(std::chrono::steady_clock::time_point when, std::chrono::steady_clock::duration interval,
+                 std::function<void()> func);
+
+    std::mutex lock;
+    std::condition_variable cv;
+    std::multimap<std::chrono::steady_clock::time_point, task> tasks;
+    uint64_t next_id = 1;
+    bool stop = false;
+    std::thread t;
+};
+
+extern std::unique_ptr<scheduler> housekeeper;
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <utility>
+#include <stddef.h>
+
+// Bounded lock-free ring buffer, for one producer and one consumer at a time.
+//
+// Items are swapped in and out rather than moved, so whatever the caller passes to
+// try_push or try_pop comes back holding a previously-used item. With std::string this
+// means buffers get recycled between producer and consumer, and once the queue has
+// warmed up nothing needs allocating. front and pop do the same for a consumer which
+// only wants to let go of an item once it's done with it.
+
+template<typename T>
+class spsc_queue {
+public:
+    spsc_queue(size_t capacity) : slots(capacity + 1) {
+    }
+
+    bool try_push(T& v) {
+        auto t = tail.load(std::memory_order_relaxed);
+        auto next = (t + 1) % slots.size();
+
+        if (next == head.load(std::memory_order_acquire))
+            return false;
+
+        std::swap(slots[t], v);
+        tail.store(next, std::memory_order_release);
+
+        return true;
+    }
+
+    bool try_pop(T& v) {
+        auto h = head.load(std::memory_order_relaxed);
+
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+
+        std::swap(slots[h], v);
+        head.store((h + 1) % slots.size(), std::memory_order_release);
+
+        return true;
+    }
+
+    // The oldest item, left in the queue, or nullptr if it's empty. Only the consumer may
+    // call this, and the item stays put until it calls pop.
+    T* front() {
+        auto h = head.load(std::memory_order_relaxed);
+
+        if (h == tail.load(std::memory_order_acquire))
+            return nullptr;
+
+        return &slots[h];
+    }
+
+    // Drops the item returned by front, which is kept to be swapped out by a later try_push.
+    void pop() {
+        auto h = head.load(std::memory_order_relaxed);
+
+        head.store((h + 1) % slots.size(), std::memory_order_release);
+    }
+
+    size_t size() const {
+        auto h = head.load(std::memory_order_acquire);
+        auto t = tail.load(std::memory_order_acquire);
+
+        return (t + slots.size() - h) % slots.size();
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    bool full() const {
+        return size() == capacity();
+    }
+
+    size_t capacity() const {
+        return slots.size() - 1;
+    }
+
+private:
+    std::vector<T> slots;
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+};
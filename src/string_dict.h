@@ -0,0 +1,65 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <stdint.h>
+
+// Per-column dictionary for string values that keep repeating, such as status or
+// currency codes. Each distinct value is sent to the browser once, and from then on
+// only its id. Columns which turn out not to repeat much give up on the dictionary,
+// but only between batches, so that a batch never mixes the two encodings.
+
+static const unsigned int DICT_PROBE_VALUES = 1000; // values to see before judging a column
+static const unsigned int DICT_MIN_REPEATS = 4; // average uses of each entry needed to keep going
+static const size_t DICT_MAX_ENTRIES = 65536;
+static const size_t DICT_MAX_BYTES = 4194304;
+
+class string_dict {
+public:
+    // Returns the value's id. If the value is new, returns the stored copy in added.
+    uint32_t lookup(std::string&& s, const std::string*& added) {
+        seen++;
+
+        auto it = ids.find(s);
+
+        if (it != ids.end()) {
+            added = nullptr;
+            return it->second;
+        }
+
+        auto id = (uint32_t)ids.size();
+
+        bytes += s.length();
+
+        added = &ids.emplace(std::move(s), id).first->first;
+
+        return id;
+    }
+
+    // called at the end of each batch
+    void end_batch() {
+        if (!enabled)
+            return;
+
+        if (ids.size() > DICT_MAX_ENTRIES || bytes > DICT_MAX_BYTES ||
+            (seen >= DICT_PROBE_VALUES && ids.size() * DICT_MIN_REPEATS > seen)) {
+            enabled = false;
+            ids.clear();
+            ids.rehash(0);
+        }
+    }
+
+    void reset() {
+        enabled = true;
+        ids.clear();
+        seen = 0;
+        bytes = 0;
+    }
+
+    bool enabled = true;
+
+private:
+    std::unordered_map<std::string, uint32_t> ids;
+    unsigned int seen = 0;
+    size_t bytes = 0;
+};
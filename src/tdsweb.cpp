@@ -3,26 +3,141 @@
 #include <string>
 #include <iostream>
 #include <stdint.h>
+#include <chrono>
+#include <algorithm>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
+#include <fstream>
+#include <filesystem>
 #include <nlohmann/json.hpp>
-#include <xlcpp.h>
-#include "base64.h"
+#include "tdsweb.h"
+#include "json_batch.h"
+#include "binary_batch.h"
+#include "ws_deflate.h"
+#include "spsc_queue.h"
+#include "conn_pool.h"
+#include "scheduler.h"
+#include "config.h"
+#include "executor.h"
+#include "db_cache.h"
+#include "audit_log.h"
+#include "exporter.h"
+#include "download_server.h"
+#include "export_jobs.h"
 
 #ifdef __MINGW32__
 #include "mingw.thread.h"
 #include "mingw.shared_mutex.h"
+#include "mingw.condition_variable.h"
 #else
 #include <thread>
 #include <shared_mutex>
+#include <condition_variable>
 #endif
 
 using namespace std;
 using json = nlohmann::json;
 
-static const string DB_APP = "tdsweb";
 static const unsigned int BACKLOG = 10;
 
+// rows are sent to the browser in batches, flushed when any of these is reached
+static const unsigned int ROWS_BATCH_COUNT = 1000;
+static const size_t ROWS_BATCH_BYTES = 262144;
+static const auto ROWS_BATCH_DELAY = chrono::milliseconds(100);
+
+// messages smaller than this aren't worth compressing
+static const size_t DEFLATE_THRESHOLD = 256;
+
+// messages waiting to be written to each browser - the query thread blocks if this fills up
+static const size_t SEND_QUEUE_LENGTH = 16;
+
+// the most rows or bytes of credit the browser can have at once, so that adding to it
+// can't overflow
+static const int64_t CREDIT_MAX = INT64_MAX / 2;
+
+// how often the housekeeper looks for pooled connections which have been idle too long
+static const auto POOL_SWEEP_INTERVAL = chrono::seconds(30);
+
+// how often the housekeeper looks for sessions which have been idle for idle_timeout
+static const auto IDLE_SWEEP_INTERVAL = chrono::seconds(30);
+
+// Run after a query which might have left anything behind on the connection that the
+// idle sweep would lose: an open transaction, or local temporary tables of the session's
+// own. Global temp tables are left out, as they don't belong to the session. The tempdb
+// scan is only done once the session has used a temp table.
+static const char TRANCOUNT_SQL[] = "SELECT @@TRANCOUNT, 0";
+static const char SESSION_STATE_SQL[] = R"(SELECT @@TRANCOUNT, (SELECT COUNT(*)
+FROM (SELECT LEFT(name, CHARINDEX(N'___', name + N'___') - 1) AS n, object_id FROM tempdb.sys.tables WHERE name LIKE N'#[^#]%') t
+WHERE OBJECT_ID(N'tempdb..' + QUOTENAME(n)) = object_id))";
+
+static bool contains_nocase(const string_view& s, const string_view& word) {
+    return search(s.begin(), s.end(), word.begin(), word.end(), [](char a, char b) {
+        return toupper((unsigned char)a) == b;
+    }) != s.end();
+}
+
+// Temp tables which outlive a batch have to be created by the batch itself, as ones made
+// by procedures or dynamic SQL are dropped when they finish, so need a # in its text. A
+// transaction needs BEGIN TRAN or IMPLICIT_TRANSACTIONS, or else a procedure or dynamic
+// SQL which leaves one open - SQL Server warns about that, but it still happens.
+static bool may_leave_temp_tables(const string_view& q) {
+    return q.find('#') != string_view::npos;
+}
+
+static bool may_leave_transaction(const string_view& q) {
+    return contains_nocase(q, "TRAN") || contains_nocase(q, "EXEC");
+}
+
+// how often the housekeeper deletes downloads which have gone unclaimed for download_ttl
+static const auto DOWNLOAD_SWEEP_INTERVAL = chrono::seconds(30);
+
+// how often the housekeeper deletes background exports older than export_job_ttl
+static const auto EXPORT_JOB_SWEEP_INTERVAL = chrono::seconds(60);
+
+// Exported files are sent to the browser in binary frames of up to this much data, each
+// with an 8-byte header:
+//
+//   u8  frame type (BINARY_FRAME_FILE)
+//   u8  reserved (0)
+//   u16 reserved (0)
+//   u32 sequence number of the chunk, little-endian
+//
+// after a "file" message giving the MIME type, filename, and size. The query_finished
+// message follows the last chunk.
+static const uint8_t BINARY_FRAME_FILE = 3;
+static const size_t FILE_CHUNK_SIZE = 262144;
+
 unique_ptr<ws::server> wsserv;
 
+static struct {
+    atomic<uint64_t> messages_queued{0};
+    atomic<uint64_t> queue_stalls{0};
+    atomic<uint64_t> queue_stall_us{0};
+    atomic<size_t> queue_max_depth{0};
+    atomic<uint64_t> credit_waits{0};
+    atomic<uint64_t> credit_wait_us{0};
+    atomic<uint64_t> credit_timeouts{0};
+    atomic<uint64_t> queries_queued{0};
+    atomic<uint64_t> orphaned_queries{0};
+    atomic<uint64_t> orphaned_query_us{0};
+    atomic<uint64_t> cancels{0};
+    atomic<uint64_t> cancel_us{0};
+    atomic<uint64_t> cancel_kills{0};
+    atomic<uint64_t> cancel_kill_failures{0};
+    atomic<uint64_t> kill_reconnects{0};
+    atomic<uint64_t> sessions_parked{0};
+    atomic<uint64_t> sessions_resumed{0};
+    atomic<uint64_t> sessions_expired{0};
+    atomic<uint64_t> idle_releases{0};
+    atomic<uint64_t> idle_reconnects{0};
+    atomic<uint64_t> idle_kept{0};
+    atomic<uint64_t> state_checks{0};
+    atomic<uint64_t> logins{0};
+    atomic<uint64_t> login_connect_us{0};
+    atomic<uint64_t> login_metadata_us{0};
+} stats;
+
 #ifdef _WIN32
 // in win.cpp
 void service_install();
@@ -33,6 +148,21 @@ void set_status(unsigned long state);
 #define SERVICE_RUNNING 0x00000004
 #endif
 
+static int64_t parse_credit(const json& j) {
+    if (!j.is_number_integer())
+        throw runtime_error("Credit must be an integer.");
+
+    if (j.is_number_unsigned())
+        return (int64_t)min(j.get<uint64_t>(), (uint64_t)CREDIT_MAX);
+
+    auto v = j.get<int64_t>();
+
+    if (v < 0)
+        throw runtime_error("Credit can't be negative.");
+
+    return min(v, CREDIT_MAX);
+}
+
 static void send_error(ws::client_thread& ct, const string& msg) {
     json j;
 
@@ -42,15 +172,167 @@ static void send_error(ws::client_thread& ct, const string& msg) {
     ct.send(j.dump());
 }
 
-class client {
+type_class classify_type(tds::server_type type) {
+    switch (type) {
+        case tds::server_type::SYBINT1:
+        case tds::server_type::SYBINT2:
+        case tds::server_type::SYBINT4:
+            return type_class::int32;
+
+        case tds::server_type::SYBINTN:
+        case tds::server_type::SYBINT8:
+            return type_class::int64;
+
+        case tds::server_type::SYBFLT8:
+        case tds::server_type::SYBFLTN:
+        case tds::server_type::SYBREAL:
+            return type_class::floating;
+
+        case tds::server_type::SYBDECIMAL:
+        case tds::server_type::SYBNUMERIC:
+        case tds::server_type::SYBMONEY:
+        case tds::server_type::SYBMONEYN:
+        case tds::server_type::SYBMONEY4:
+            return type_class::decimal;
+
+        case tds::server_type::SYBBIT:
+        case tds::server_type::SYBBITN:
+            return type_class::bit;
+
+        case tds::server_type::SYBMSDATE:
+            return type_class::date;
+
+        case tds::server_type::SYBMSTIME:
+            return type_class::time;
+
+        case tds::server_type::SYBDATETIME:
+        case tds::server_type::SYBDATETIMN:
+            return type_class::datetime;
+
+        case tds::server_type::SYBDATETIME4:
+        case tds::server_type::SYBMSDATETIME2:
+        case tds::server_type::SYBMSDATETIMEOFFSET:
+            return type_class::other_datetime;
+
+        default:
+            return type_class::string;
+    }
+}
+
+// Decimals and the other date types go as text, which keeps their precision and time zone.
+col_kind get_col_kind(tds::server_type type) {
+    switch (classify_type(type)) {
+        case type_class::int32:
+        case type_class::int64:
+            return col_kind::integer;
+
+        case type_class::floating:
+            return col_kind::floating;
+
+        case type_class::bit:
+            return col_kind::bit;
+
+        case type_class::date:
+            return col_kind::date;
+
+        case type_class::time:
+            return col_kind::time;
+
+        case type_class::datetime:
+            return col_kind::datetime;
+
+        default:
+            return col_kind::string;
+    }
+}
+
+string make_token() {
+    random_device rd;
+    static const char hex[] = "0123456789abcdef";
+    string s;
+
+    for (unsigned int i = 0; i < 8; i++) {
+        auto v = rd();
+
+        for (unsigned int j = 0; j < 8; j++) {
+            s += hex[v & 0xf];
+            v >>= 4;
+        }
+    }
+
+    return s;
+}
+
+struct out_msg {
+    string data;
+    enum ws::opcode opcode = ws::opcode::text;
+    uint64_t rows_gen = 0; // if a batch of rows, the query it's from
+};
+
+// A query goes idle -> running -> idle, or if the browser cancels it, idle -> running ->
+// cancelling -> idle. Only the query task moves it back to idle.
+enum class query_state : uint8_t {
+    idle,
+    running,
+    cancelling
+};
+
+// Shared between a cancelled query and the timer which KILLs its session if the cancel
+// doesn't take effect in time, as either could outlive the other.
+struct cancel_watch {
+    mutex lock;
+    bool finished = false;
+    bool killed = false;
+};
+
+class client;
+
+// sessions waiting for the browser to reconnect, by token
+static mutex parked_lock;
+static unordered_map<string, client*> parked_sessions;
+
+static void expire_session(const string& token);
+
+// every client, for the idle sweep
+static mutex clients_lock;
+static unordered_set<client*> clients;
+
+class client : public tds_handler {
 public:
-    client(ws::client_thread& ct, const string& server) : ct(ct), server(server) { }
+    client(ws::client_thread& ct, const string& server) : ct(&ct), server(server), send_queue(SEND_QUEUE_LENGTH) {
+        writer = thread(&client::write_loop, this);
+
+        lock_guard<mutex> lg(clients_lock);
+
+        clients.insert(this);
+    }
 
     ~client() {
-        if (query_thread) {
-            query_thread->join();
-            delete query_thread;
+        {
+            lock_guard<mutex> lg(clients_lock);
+
+            clients.erase(this);
+        }
+
+        if (query_running()) {
+            // nobody's going to read the results, and it might be waiting for credit
+            cancel();
         }
+
+        if (query_task)
+            query_task.wait();
+
+        {
+            lock_guard<mutex> lg(writer_lock);
+
+            writer_stop = true;
+            writer_cv.notify_one();
+        }
+
+        writer.join();
+
+        if (tds)
+            pool->release(tds);
     }
 
     void login(const json& j);
@@ -59,21 +341,110 @@ public:
     void cancel();
     void change_database(const json& j);
     void ping();
+    void compression(const json& j);
+    void get_stats();
+    void credit(const json& j);
+    void wait_for_credit();
+    void release_conn();
+    void ensure_conn();
+    shared_ptr<pooled_conn> take_idle_conn(chrono::steady_clock::time_point cutoff);
+    void orphan();
+    void reap();
+    client* resume(const json& j);
+    void attach(ws::client_thread& new_ct, unique_ptr<ws_deflate> new_deflater);
+    void list_jobs();
+    void cancel_job(const json& j);
+    void delete_job(const json& j);
+    void download_job(const json& j);
+    void job_changed(const string& key, const json& job);
+    void kill_failed(const shared_ptr<cancel_watch>& w, const string& msg);
+
+    bool query_running() const {
+        return query_task && !query_task.done();
+    }
+
+    bool post(string& msg, enum ws::opcode opcode = ws::opcode::text, bool block = true, uint64_t rows_gen = 0);
+
+    void post(string&& msg, enum ws::opcode opcode = ws::opcode::text) {
+        post(msg, opcode);
+    }
+
+    bool send(const string_view& msg, enum ws::opcode opcode);
+    void wake_writer();
+    void set_timer(chrono::steady_clock::time_point when);
+    void write_loop();
+    void write_queued();
+    void timer();
 
     void msg_handler(const string_view& server, const string_view& message, const string_view& proc_name,
          const string_view& sql_state, int32_t msgno, int32_t line_number, int16_t state, uint8_t priv_msg_type,
-         uint8_t severity, int oserr);
-    void tbl_handler(const vector<pair<string, tds::server_type>>& columns);
-    void row_handler(const vector<tds::Field>& columns);
-    void row_count_handler(unsigned int count);
-
-    ws::client_thread& ct;
+         uint8_t severity, int oserr) override;
+    void tbl_handler(const vector<pair<string, tds::server_type>>& columns) override;
+    void row_handler(const vector<tds::Field>& columns) override;
+    void row_count_handler(unsigned int count) override;
+    void flush_rows();
+    bool send_rows(bool block = true);
+    void send_file(const filesystem::path& fn, const string& mime, const string& filename);
+    void remove_export();
+
+    ws::client_thread* ct;
     string server;
-    shared_ptr<tds::Conn> tds;
-    thread* query_thread = nullptr;
-    bool cancelled = false;
-    unique_ptr<xlcpp::workbook> excel;
-    xlcpp::sheet* sheet;
+    shared_ptr<pooled_conn> tds;
+    task_handle query_task;
+    mutex life_lock;
+    bool query_active = false;
+    bool orphaned = false;
+    chrono::steady_clock::time_point orphaned_at;
+    atomic<query_state> qstate{query_state::idle};
+    uint64_t query_gen = 0;
+    uint64_t rows_total;
+    atomic<uint64_t> discard_gen{0};
+    atomic<chrono::steady_clock::rep> cancel_start{0}; // 0 until the query's first cancel
+    shared_ptr<cancel_watch> watch; // protected by life_lock when written
+    string username;
+    string password;
+    string cur_db;
+    vector<string> databases;
+    string token;
+    string job_key; // server and username, for finding background exports - protected by life_lock
+    bool logged_in = false;
+    chrono::steady_clock::time_point last_activity;
+    bool holds_state = false; // transaction or temp tables open on tds - protected by life_lock
+    bool used_temp_tables = false; // since tds was acquired - only used by the query task and login
+    bool parked = false;
+    uint64_t park_timer;
+    unique_ptr<exporter> exp;
+    filesystem::path export_path;
+    bool binary_rows = false;
+    json_batch json_rows;
+    binary_batch bin_rows;
+    mutex rows_lock;
+    mutex flush_lock;
+    string rows_buf; // protected by flush_lock
+    bool rows_pending = false; // rows_buf holds a batch the timer couldn't queue - protected by flush_lock
+    mutex send_lock;
+    unique_ptr<ws_deflate> deflater;
+    string deflate_buf;
+    unsigned int rows_count = 0;
+    chrono::steady_clock::time_point rows_deadline;
+    spsc_queue<out_msg> send_queue;
+    mutex writer_lock;
+    condition_variable writer_cv;
+    thread writer;
+    bool writer_wanted = false; // protected by writer_lock
+    bool writer_stop = false; // protected by writer_lock
+    bool timer_set = false; // protected by writer_lock
+    chrono::steady_clock::time_point timer_at; // protected by writer_lock
+    mutex queue_lock;
+    condition_variable space_cv;
+    atomic<bool> producer_waiting{false};
+    size_t queue_max_depth = 0;
+    uint64_t queue_stalls = 0;
+    mutex credit_lock;
+    condition_variable credit_cv;
+    bool credits_enabled = false;
+    int64_t credit_rows;
+    int64_t credit_bytes;
 };
 
 void client::login(const json& j) {
@@ -83,53 +454,68 @@ void client::login(const json& j) {
     if (j.count("password") == 0)
         throw runtime_error("Password not provided.");
 
-    auto mh = bind(&client::msg_handler, this, placeholders::_1, placeholders::_2, placeholders::_3, placeholders::_4,
-                   placeholders::_5, placeholders::_6, placeholders::_7, placeholders::_8, placeholders::_9, placeholders::_10);
-    auto mh2 = bind(&client::tbl_handler, this, placeholders::_1);
-    auto mh3 = bind(&client::row_handler, this, placeholders::_1);
-    auto mh4 = bind(&client::row_count_handler, this, placeholders::_1);
-
-    tds.reset(new tds::Conn(server, j["username"], j["password"], DB_APP, mh, nullptr, mh2, mh3, mh4));
+    string new_username = j["username"];
+    string new_password = j["password"];
 
-    string cur_db;
+    auto start = chrono::steady_clock::now();
 
-    {
-        tds::Query sq(*tds, "SELECT DB_NAME()");
+    // If this fails, the session carries on as it was. Otherwise the old connection goes
+    // back to the pool, which doesn't care whose it was.
+    auto pc = pool->acquire(server, new_username, new_password, this);
 
-        sq.fetch_row();
+    release_conn();
 
-        cur_db = sq[0];
+    {
+        lock_guard<mutex> lg(life_lock);
+
+        username = move(new_username);
+        password = move(new_password);
+        tds = move(pc);
+        holds_state = false;
+        used_temp_tables = false;
+        last_activity = chrono::steady_clock::now();
+        job_key = server + '\0' + username;
     }
 
-    vector<json> dbs;
+    auto connected = chrono::steady_clock::now();
 
-    {
-        tds::Query sq(*tds, "SELECT name FROM sys.databases ORDER BY name");
+    // the pool has already found out the default database when it connected
+    logged_in = true;
+    cur_db = tds->default_db;
+    databases = db_lists.get(*tds->conn, server + '\0' + username);
 
-        while (sq.fetch_row()) {
-            dbs.push_back(sq[0]);
-        }
-    }
+    stats.logins++;
+    stats.login_connect_us += (uint64_t)chrono::duration_cast<chrono::microseconds>(connected - start).count();
+    stats.login_metadata_us += (uint64_t)chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - connected).count();
 
-    ct.send(json{
+    token = make_token();
+
+    post(json{
         {"type", "login"},
         {"success", true},
         {"server", server},
-        {"username", j["username"]},
+        {"username", username},
         {"database", cur_db},
-        {"databases", dbs}
+        {"databases", databases},
+        {"token", token}
     }.dump());
 }
 
 void client::logout() {
-    if (!tds)
+    if (!logged_in)
         throw runtime_error("Can't logout as not logged in.");
 
-    tds->cancel();
+    release_conn();
+    logged_in = false;
+    token.clear();
+
+    {
+        lock_guard<mutex> lg(life_lock);
 
-    tds.reset();
+        job_key.clear();
+    }
 
-    ct.send(json{
+    post(json{
         {"type", "logout"},
         {"success", true}
     }.dump());
@@ -139,70 +525,250 @@ void client::query(const json& j) {
     if (j.count("query") == 0)
         throw runtime_error("No query given.");
 
-    if (!tds)
+    if (!logged_in)
         throw runtime_error("Not logged in.");
 
-    if (query_thread)
+    // runs on a connection of its own, so doesn't care what this session's doing
+    if (j.count("background") > 0 && (bool)j.at("background")) {
+        post(json{
+            {"type", "export_job"},
+            {"job", background_exports->submit(server, username, password, cur_db, j)}
+        }.dump());
+
+        return;
+    }
+
+    if (query_running())
         throw runtime_error("Query already running.");
 
-    if (j.count("export") > 0 && j.at("export") == "excel") {
-        excel.reset(new xlcpp::workbook());
-        sheet = &excel->add_sheet("Sheet1");
+    // journaled now, so there's a record even if it never finishes, and logged to the
+    // server once it's finished, so we know how long it took
+    audit_entry ae{server, username, password, j.at("query"), chrono::system_clock::now(), 0, 0};
+
+    audit->start(ae);
+
+    // anything from here up to the query starting mustn't leave the start dangling
+    try {
+        ensure_conn();
+
+        if (j.count("export") > 0)
+            exp = make_exporter(j, export_path);
+
+        binary_rows = j.count("format") > 0 && j.at("format") == "binary";
+
+        // If the browser gives us credits, we only send that many rows or bytes until it
+        // gives us more. Otherwise we send everything as fast as it can take it.
+        {
+            bool enabled = !exp && j.count("credits") > 0;
+            int64_t rows = CREDIT_MAX, bytes = CREDIT_MAX;
+
+            if (enabled) {
+                const auto& cr = j.at("credits");
+
+                if (cr.count("rows") > 0)
+                    rows = parse_credit(cr.at("rows"));
+
+                if (cr.count("bytes") > 0)
+                    bytes = parse_credit(cr.at("bytes"));
+            }
+
+            lock_guard<mutex> lg(credit_lock);
+
+            credits_enabled = enabled;
+            credit_rows = rows;
+            credit_bytes = bytes;
+        }
+    } catch (...) {
+        audit->abandon(ae);
+        throw;
+    }
+
+    rows_total = 0;
+
+    {
+        lock_guard<mutex> lg(life_lock);
+
+        query_active = true;
+        watch = make_shared<cancel_watch>(); // read by kill_failed
     }
 
-    // log query
-    tds->run("SET NOCOUNT ON; INSERT INTO master.dbo.query_log(query) VALUES(?);", (string)j.at("query"));
+    query_gen++;
+    cancel_start = 0;
+    qstate = query_state::running;
 
-    query_thread = new thread([&](string q) {
-        bool failed = false;
+    // If every thread's taken, tell the browser, so it doesn't look like we've hung.
+    if (blocking_workers->saturated()) {
+        stats.queries_queued++;
+        post(json{{"type", "query_queued"}}.dump());
+    }
 
-        shared_ptr<tds::Conn> tds2 = tds;
+    // this can wait on the browser for credit or queue space, so isn't for workers
+    query_task = blocking_workers->submit([this, ae]() mutable {
+        bool failed = false, state = true;
 
-        cancelled = false;
+        shared_ptr<pooled_conn> tds2 = tds;
 
         // FIXME - what about question marks?
 
         try {
             try {
-                tds2->run(q);
+                tds2->conn->run(ae.query);
             } catch (...) {
                 // swallow exception, so we don't return "tds_submit_execute failed" to client
                 failed = true;
             }
 
-            if (failed && tds2->is_dead())
+            flush_rows();
+
+            bool was_cancelled = qstate == query_state::cancelling;
+            bool killed = false;
+
+            {
+                lock_guard<mutex> lg(watch->lock);
+
+                watch->finished = true;
+                killed = watch->killed;
+            }
+
+            // Done before query_finished, so the browser can't send another query while
+            // this is using the connection. If we can't tell, assume the worst, and keep
+            // the connection.
+            if (tds == tds2 && !tds2->conn->is_dead()) {
+                if (may_leave_temp_tables(ae.query))
+                    used_temp_tables = true;
+
+                bool was_holding;
+
+                {
+                    lock_guard<mutex> lg(life_lock);
+
+                    was_holding = holds_state;
+                }
+
+                if (used_temp_tables || was_holding || may_leave_transaction(ae.query)) {
+                    try {
+                        tds::Query sq(*tds2->conn, used_temp_tables ? SESSION_STATE_SQL : TRANCOUNT_SQL);
+
+                        if (sq.fetch_row())
+                            state = (int)sq[0] > 0 || (int)sq[1] > 0;
+                    } catch (...) {
+                    }
+
+                    stats.state_checks++;
+                } else
+                    state = false;
+            }
+
+            bool replaced = false;
+
+            // We KILLed the session ourselves, which is a cancel rather than the server going
+            // away, so we get another connection rather than logging out.
+            if (failed && killed && tds == tds2 && tds2->conn->is_dead()) {
+                try {
+                    auto pc = pool->acquire(server, username, password, this, cur_db);
+                    shared_ptr<pooled_conn> old;
+
+                    {
+                        lock_guard<mutex> lg(life_lock);
+
+                        old = move(tds);
+                        tds = move(pc);
+                        holds_state = false;
+                        used_temp_tables = false;
+                    }
+
+                    pool->discard(old);
+                    replaced = true;
+                    stats.kill_reconnects++;
+                } catch (...) {
+                    // falls through to logging out
+                }
+            }
+
+            if (failed && !replaced && tds2->conn->is_dead())
                 logout();
-            else if (!failed || tds == tds2) { // don't send if stopping because logged out
-                if (excel) {
-                    ct.send(json{
-                        {"type", "query_finished"},
-                        {"mime", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet"},
-                        {"filename", "results.xlsx"},
-                        {"data", base64_encode(excel->data())}
-                    }.dump());
-
-                    excel.reset(nullptr);
-                } else {
-                    ct.send(json{
-                        {"type", "query_finished"}
-                    }.dump());
+            else if (!failed || tds == tds2 || replaced) { // don't send if stopping because logged out
+                json fin{{"type", "query_finished"}};
+
+                if (was_cancelled) {
+                    auto start = chrono::steady_clock::time_point(chrono::steady_clock::duration(cancel_start.load()));
+                    auto us = (uint64_t)chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+
+                    stats.cancel_us += us;
+
+                    fin["cancelled"] = true;
+                    fin["cancel_ms"] = (double)us / 1000.0;
+                    fin["killed"] = killed;
+                }
+
+                if (exp) {
+                    exp->finish();
+
+                    if (exp->truncated)
+                        fin["truncated"] = true;
+
+                    auto mime = exp->mime();
+                    auto filename = exp->filename();
+
+                    exp.reset();
+
+                    if (was_cancelled) {
+                        // nothing to send
+                    } else if (downloads) {
+                        fin["download"] = config.download_url + downloads->add(export_path, mime, filename);
+                        export_path.clear(); // belongs to the download server now
+                    } else
+                        send_file(export_path, mime, filename);
                 }
+
+                post(fin.dump());
             }
         } catch (const exception& e) {
-            send_error(ct, e.what());
+            post(json{
+                {"type", "error"},
+                {"message", e.what()}
+            }.dump());
+        }
+
+        remove_export();
+
+        ae.duration_ms = (uint64_t)chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now() - ae.start).count();
+        ae.row_count = rows_total;
+
+        audit->add(move(ae));
+
+        bool reap;
+
+        qstate = query_state::idle;
+
+        {
+            lock_guard<mutex> lg(life_lock);
+
+            query_active = false;
+
+            if (tds == tds2)
+                holds_state = state;
+            last_activity = chrono::steady_clock::now();
+            reap = orphaned;
         }
 
-        query_thread->detach();
+        // the browser's gone, and we were the last thing using the client
+        if (reap) {
+            stats.orphaned_query_us += (uint64_t)chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - orphaned_at).count();
 
-        delete query_thread;
-        query_thread = nullptr;
-    }, j.at("query"));
+            workers->submit([this]() {
+                delete this;
+            });
+        }
+    });
 }
 
 void client::msg_handler(const string_view& server, const string_view& message, const string_view& proc_name,
                          const string_view& sql_state, int32_t msgno, int32_t line_number, int16_t state, uint8_t priv_msg_type,
                          uint8_t severity, int oserr) {
-    ct.send(json{
+    flush_rows();
+
+    post(json{
         {"type", "message"},
         {"server", server},
         {"message", message},
@@ -220,19 +786,23 @@ void client::msg_handler(const string_view& server, const string_view& message,
 void client::tbl_handler(const vector<pair<string, tds::server_type>>& columns) {
     vector<json> ls;
 
-    if (cancelled)
+    if (qstate != query_state::running)
         return;
 
-    if (excel) {
-        // FIXME - add blank row if not first table
+    flush_rows();
 
-        auto& row = sheet->add_row();
+    if (exp)
+        exp->header(columns);
+    else {
+        {
+            lock_guard<mutex> lg(rows_lock);
 
-        for (const auto& col : columns) {
-            auto& c = row.add_cell(get<0>(col));
-            c.set_font("Arial", 10, true);
+            if (binary_rows)
+                bin_rows.reset(columns);
+            else
+                json_rows.reset(columns);
         }
-    } else {
+
         for (const auto& col : columns) {
             ls.emplace_back(json{
                 {"name", get<0>(col)},
@@ -240,7 +810,7 @@ void client::tbl_handler(const vector<pair<string, tds::server_type>>& columns)
             });
         }
 
-        ct.send(json{
+        post(json{
             {"type", "table"},
             {"columns", ls}
         }.dump());
@@ -248,160 +818,1117 @@ void client::tbl_handler(const vector<pair<string, tds::server_type>>& columns)
 }
 
 void client::row_handler(const vector<tds::Field>& columns) {
-    vector<json> ls;
-
-    if (cancelled)
+    if (qstate != query_state::running)
         return;
 
-    if (excel) {
-        auto& row = sheet->add_row();
+    rows_total++;
 
-        for (const auto& col : columns) {
-            if (col.is_null())
-                row.add_cell("NULL"); // FIXME - make italic?
-            else {
-                switch (col.type) {
-                    case tds::server_type::SYBINTN:
-                    case tds::server_type::SYBINT1:
-                    case tds::server_type::SYBINT2:
-                    case tds::server_type::SYBINT4:
-                        row.add_cell((int64_t)col);
-                    break;
-
-                    case tds::server_type::SYBDATETIME:
-                    case tds::server_type::SYBDATETIMN:
-                    {
-                        auto dt = (tds::DateTime)col;
+    if (exp)
+        exp->row(columns);
+    else {
+        if (credits_enabled) {
+            wait_for_credit();
 
-                        row.add_cell(xlcpp::datetime{dt.d.year(), dt.d.month(), dt.d.day(), dt.t.h, dt.t.m, dt.t.s});
-                        break;
-                    }
+            if (qstate != query_state::running)
+                return;
+        }
 
-                    case tds::server_type::SYBMSDATE:
-                    {
-                        auto d = (tds::Date)col;
+        bool full;
 
-                        row.add_cell(xlcpp::date{d.year(), d.month(), d.day()});
-                        break;
-                    }
+        {
+            lock_guard<mutex> lg(rows_lock);
+            size_t len;
 
-                    case tds::server_type::SYBMSTIME:
-                    {
-                        auto t = (tds::Time)col;
+            if (rows_count == 0) {
+                rows_deadline = chrono::steady_clock::now() + ROWS_BATCH_DELAY;
+                set_timer(rows_deadline);
+            }
 
-                        row.add_cell(xlcpp::time{t.h, t.m, t.s});
-                        break;
-                    }
+            if (binary_rows) {
+                bin_rows.add_row(columns);
+                len = bin_rows.size();
+            } else {
+                json_rows.add_row(columns);
+                len = json_rows.size();
+            }
 
-                    case tds::server_type::SYBFLT8:
-                    case tds::server_type::SYBFLTN:
-                    case tds::server_type::SYBREAL:
-                        row.add_cell((double)col);
-                    break;
+            rows_count++;
 
-                    case tds::server_type::SYBBIT:
-                    case tds::server_type::SYBBITN:
-                        row.add_cell((int)col != 0);
-                    break;
+            full = rows_count >= ROWS_BATCH_COUNT || len >= ROWS_BATCH_BYTES;
+        }
 
-                    default:
-                        row.add_cell((string)col);
-                }
+        if (full)
+            flush_rows();
+    }
+}
+
+// flush_lock must be held, which keeps batches in order, but rows_lock mustn't be, as
+// this can wait for space in the send queue. If block is false and the queue is full,
+// returns false, and the batch waits in rows_buf to go first next time.
+bool client::send_rows(bool block) {
+    while (true) {
+        if (!rows_pending) {
+            lock_guard<mutex> lg(rows_lock);
+
+            if (rows_count == 0)
+                return true;
+
+            // rows_buf is cleared rather than freed between batches, and keeps its capacity
+            if (qstate != query_state::cancelling) {
+                if (binary_rows)
+                    bin_rows.write(rows_buf);
+                else
+                    json_rows.write(rows_buf);
+
+                rows_pending = true;
             }
-        }
-    } else {
-        for (const auto& col : columns) {
-            if (col.is_null())
-                ls.emplace_back(nullptr);
+
+            rows_count = 0;
+
+            if (binary_rows)
+                bin_rows.clear();
             else
-                ls.emplace_back((string)col);
+                json_rows.clear();
         }
 
-        ct.send(json{
-            {"type", "row"},
-            {"columns", ls}
-        }.dump());
+        if (!rows_pending || qstate == query_state::cancelling) {
+            rows_pending = false;
+            continue;
+        }
+
+        auto len = rows_buf.length();
+
+        if (!post(rows_buf, binary_rows ? ws::opcode::binary : ws::opcode::text, block, query_gen))
+            return false;
+
+        rows_pending = false;
+
+        if (credits_enabled) {
+            lock_guard<mutex> lg(credit_lock);
+
+            credit_bytes -= (int64_t)len;
+        }
     }
 }
 
-void client::row_count_handler(unsigned int count) {
-    ct.send(json{
-        {"type", "row_count"},
-        {"count", count}
-    }.dump());
-}
+// Takes one row's worth of credit, waiting for the browser to send more if we've run out.
+// Blocking here stops us reading from the TDS connection, so SQL Server gets held up
+// rather than us having to buffer the rows. It also holds one of the blocking_workers,
+// so if the browser doesn't ask for more within credit_timeout, the query gets cancelled.
+void client::wait_for_credit() {
+    unique_lock<mutex> lock(credit_lock);
 
-void client::cancel() {
-    if (tds) {
-        cancelled = true;
-        tds->cancel();
+    if (credit_rows <= 0 || credit_bytes <= 0) {
+        auto start = chrono::steady_clock::now();
+
+        // make sure the browser has everything we've got, otherwise it won't know to ask for more
+        lock.unlock();
+        flush_rows();
+        lock.lock();
+
+        auto ready = [&]() {
+            return qstate != query_state::running || (credit_rows > 0 && credit_bytes > 0);
+        };
+
+        bool timed_out = false;
+
+        if (config.credit_timeout.count() == 0)
+            credit_cv.wait(lock, ready);
+        else
+            timed_out = !credit_cv.wait_for(lock, config.credit_timeout, ready);
+
+        stats.credit_waits++;
+        stats.credit_wait_us += (uint64_t)chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+
+        if (timed_out) {
+            lock.unlock();
+
+            stats.credit_timeouts++;
+
+            post(json{
+                {"type", "error"},
+                {"message", "No more rows asked for within " + to_string(config.credit_timeout.count()) + " seconds, so cancelling query."}
+            }.dump());
+
+            cancel(); // row_handler sees we're no longer running, and stops
+            return;
+        }
     }
+
+    credit_rows--;
 }
 
-void client::change_database(const json& j) {
-    if (!tds)
-        throw runtime_error("Not logged in.");
+void client::credit(const json& j) {
+    auto rows = j.count("rows") > 0 ? parse_credit(j.at("rows")) : 0;
+    auto bytes = j.count("bytes") > 0 ? parse_credit(j.at("bytes")) : 0;
 
-    if (j.count("database") == 0)
-        throw runtime_error("No database given.");
+    lock_guard<mutex> lg(credit_lock);
 
-    string db = j["database"];
+    if (!credits_enabled)
+        return;
+
+    // both are at most CREDIT_MAX, so the sums fit
+    credit_rows = min(credit_rows + rows, CREDIT_MAX);
+    credit_bytes = min(credit_bytes + bytes, CREDIT_MAX);
 
-    tds->run("USE " + tds::escape(db));
+    credit_cv.notify_one();
 }
 
-void client::ping() {
-    ct.send(json{
-        {"type", "pong"}
-    }.dump());
+void client::flush_rows() {
+    lock_guard<mutex> lg(flush_lock);
+
+    send_rows();
 }
 
-static void ws_recv(ws::client_thread& ct, const string_view& msg) {
-    try {
-        json j = json::parse(msg);
+// Sends rows that have been waiting longer than ROWS_BATCH_DELAY, so slow queries still
+// show results. This runs on the writer thread, so mustn't block: if the query thread is busy
+// sending a batch itself, or the send queue's full and the browser has plenty to be
+// getting on with, we try again later.
+void client::timer() {
+    auto now = chrono::steady_clock::now();
+    unique_lock<mutex> fl(flush_lock, try_to_lock);
 
-        if (j.count("type") == 0)
-            throw runtime_error("No message type given.");
+    if (!fl.owns_lock()) {
+        set_timer(now + ROWS_BATCH_DELAY);
+        return;
+    }
 
-        auto& c = *(client*)ct.context;
+    if (!rows_pending) {
+        lock_guard<mutex> lg(rows_lock);
 
-        string type = j["type"];
+        if (rows_count == 0)
+            return;
 
-        if (type == "login")
-            c.login(j);
-        else if (type == "logout")
-            c.logout();
-        else if (type == "query")
-            c.query(j);
-        else if (type == "cancel")
-            c.cancel();
-        else if (type == "change_database")
-            c.change_database(j);
-        else if (type == "ping")
-            c.ping();
-        else
-            throw runtime_error("Unrecognized message type \"" + type + "\".");
-    } catch (const exception& e) {
-        send_error(ct, e.what());
+        if (now < rows_deadline) {
+            set_timer(rows_deadline);
+            return;
+        }
     }
+
+    if (!send_rows(false))
+        set_timer(now + ROWS_BATCH_DELAY);
 }
 
-static void disconn_handler(ws::client_thread& ct, const std::exception_ptr&) {
-    if (ct.context) {
-        auto c = (client*)ct.context;
+void client::row_count_handler(unsigned int count) {
+    flush_rows();
 
-        delete c;
-    }
+    post(json{
+        {"type", "row_count"},
+        {"count", count}
+    }.dump());
 }
 
-#ifdef _WIN32
-void init(const string& server, uint16_t port, bool service = false) {
-#else
-void init(const string& server, uint16_t port) {
-#endif
-    wsserv.reset(new ws::server(port, BACKLOG, ws_recv, [&](ws::client_thread& ct) {
-        ct.context = new client(ct, server);
-    }, disconn_handler));
+// Stops the running query. Rows which haven't gone to the browser yet get thrown away
+// straight off, rather than waiting for SQL Server to acknowledge the attention. If it
+// hasn't done so within cancel_timeout, we KILL the session from another connection.
+void client::cancel() {
+    auto expected = query_state::running;
+    chrono::steady_clock::rep none = 0;
+
+    // Set before the state changes, so the query can't see cancelling without it. A cancel
+    // which then finds no query running leaves it set, but query resets it before starting.
+    cancel_start.compare_exchange_strong(none, chrono::steady_clock::now().time_since_epoch().count());
+
+    // tds can't go anywhere while a query's running, so there's no need to lock it
+    if (!qstate.compare_exchange_strong(expected, query_state::cancelling))
+        return;
+
+    stats.cancels++;
+    discard_gen = query_gen;
+
+    {
+        lock_guard<mutex> lg(credit_lock);
+
+        credit_cv.notify_one();
+    }
+
+    tds->conn->cancel();
+
+    if (config.cancel_timeout.count() == 0)
+        return;
+
+    // The housekeeper only hands this on, as connecting to the server can take a while.
+    // KILL needs ALTER ANY CONNECTION, which plenty of users won't have, so if it fails
+    // the browser gets told the query's still running.
+    housekeeper->after(config.cancel_timeout, [watch = watch, server = server, username = username,
+                                               password = password, spid = tds->spid]() {
+        {
+            lock_guard<mutex> lg(watch->lock);
+
+            if (watch->finished)
+                return;
+        }
+
+        workers->submit([watch, server, username, password, spid]() {
+            try {
+                // can't use the query's own connection, as it's busy
+                auto pc = pool->acquire(server, username, password, nullptr);
+
+                try {
+                    lock_guard<mutex> lg(watch->lock);
+
+                    // checked again under the lock, so we can't KILL a session that's moved on
+                    if (!watch->finished) {
+                        pc->conn->run("KILL " + to_string(spid));
+                        watch->killed = true;
+                        stats.cancel_kills++;
+                    }
+                } catch (...) {
+                    pool->release(pc);
+                    throw;
+                }
+
+                pool->release(pc);
+            } catch (const exception& e) {
+                stats.cancel_kill_failures++;
+
+                lock_guard<mutex> lg(clients_lock);
+
+                for (auto c : clients) {
+                    c->kill_failed(watch, e.what());
+                }
+            }
+        });
+    });
+}
+
+// Called with clients_lock held, so mustn't wait for queue space.
+void client::kill_failed(const shared_ptr<cancel_watch>& w, const string& msg) {
+    {
+        lock_guard<mutex> lg(life_lock);
+
+        if (watch != w)
+            return;
+    }
+
+    {
+        lock_guard<mutex> lg(w->lock);
+
+        if (w->finished)
+            return;
+    }
+
+    auto j = json{
+        {"type", "error"},
+        {"message", "Query didn't stop after " + to_string(config.cancel_timeout.count()) + " seconds, and couldn't be killed: " + msg}
+    }.dump();
+
+    post(j, ws::opcode::text, false);
+}
+
+void client::change_database(const json& j) {
+    if (!logged_in)
+        throw runtime_error("Not logged in.");
+
+    if (j.count("database") == 0)
+        throw runtime_error("No database given.");
+
+    // the query would be using the connection
+    if (query_running())
+        throw runtime_error("Query running.");
+
+    ensure_conn();
+
+    string db = j["database"];
+
+    tds->conn->run("USE " + tds::escape(db));
+
+    cur_db = db;
+}
+
+// Called when the browser disconnects. If it's logged in, we hang on to everything for
+// resume_grace in case it comes back, otherwise the client gets reaped.
+void client::orphan() {
+    if (!token.empty() && config.resume_grace.count() > 0) {
+        {
+            lock_guard<mutex> lg(send_lock);
+
+            ct = nullptr;
+            parked = true;
+        }
+
+        lock_guard<mutex> lg(parked_lock);
+
+        parked_sessions[token] = this;
+        stats.sessions_parked++;
+
+        park_timer = housekeeper->after(config.resume_grace, [t = token]() {
+            expire_session(t);
+        });
+
+        return;
+    }
+
+    reap();
+}
+
+// The client can't be freed until any query's done with it, but we don't want to keep
+// wscpp waiting for that, so the query gets cancelled and whichever finishes last out of
+// it and us hands the client to the executor to delete. That way resetting the
+// connection for the pool doesn't hold anything up either.
+void client::reap() {
+    {
+        lock_guard<mutex> lg(send_lock);
+
+        ct = nullptr;
+        parked = false;
+    }
+
+    // throw away anything still queued, so the query isn't left waiting for space
+    wake_writer();
+
+    {
+        lock_guard<mutex> lg(life_lock);
+
+        orphaned = true;
+
+        if (query_active) {
+            orphaned_at = chrono::steady_clock::now();
+            stats.orphaned_queries++;
+
+            // under life_lock, so the query can't finish and delete us in the meantime
+            cancel();
+
+            return;
+        }
+    }
+
+    workers->submit([this]() {
+        delete this;
+    });
+}
+
+// Called on the new client when the browser reconnects and asks for its old session back.
+// Returns the old client, now attached to our WebSocket, or nullptr if it's gone.
+client* client::resume(const json& j) {
+    if (logged_in)
+        throw runtime_error("Already logged in.");
+
+    if (j.count("token") == 0)
+        throw runtime_error("No token given.");
+
+    client* c;
+
+    {
+        lock_guard<mutex> lg(parked_lock);
+
+        auto it = parked_sessions.find((string)j.at("token"));
+
+        if (it == parked_sessions.end()) {
+            post(json{
+                {"type", "resumed"},
+                {"success", false}
+            }.dump());
+
+            return nullptr;
+        }
+
+        c = it->second;
+        parked_sessions.erase(it);
+
+        housekeeper->cancel(c->park_timer);
+    }
+
+    // the browser will have negotiated compression with us rather than the old client
+    unique_ptr<ws_deflate> d;
+
+    {
+        lock_guard<mutex> lg(send_lock);
+
+        d = move(deflater);
+    }
+
+    c->attach(*ct, move(d));
+
+    stats.sessions_resumed++;
+
+    return c;
+}
+
+void client::attach(ws::client_thread& new_ct, unique_ptr<ws_deflate> new_deflater) {
+    {
+        lock_guard<mutex> lg(send_lock);
+
+        ct = &new_ct;
+        deflater = move(new_deflater);
+
+        // sent before anything that queued up while we were away, so the browser knows
+        // where it stands first
+        try {
+            ct->send(json{
+                {"type", "resumed"},
+                {"success", true},
+                {"server", server},
+                {"username", username},
+                {"database", cur_db},
+                {"databases", databases},
+                {"token", token},
+                {"query_running", query_running()}
+            }.dump());
+        } catch (...) {
+            // gone again - disconn_handler will clean up
+        }
+
+        parked = false;
+    }
+
+    wake_writer();
+}
+
+// Gives the connection back to the pool, or if a query's still using it, cancels the query
+// and lets the connection go once it's finished with.
+void client::release_conn() {
+    shared_ptr<pooled_conn> pc;
+    bool busy;
+
+    {
+        lock_guard<mutex> lg(life_lock);
+
+        if (!tds)
+            return;
+
+        busy = query_running();
+
+        if (busy)
+            cancel();
+
+        pc = move(tds);
+    }
+
+    if (busy)
+        pool->discard(pc);
+    else
+        pool->release(pc);
+}
+
+// Gets a connection again if the idle sweep has taken ours away, back in the same
+// database. Anything else about the old session, such as temporary tables, is gone.
+void client::ensure_conn() {
+    {
+        lock_guard<mutex> lg(life_lock);
+
+        last_activity = chrono::steady_clock::now();
+
+        if (tds)
+            return;
+    }
+
+    auto pc = pool->acquire(server, username, password, this, cur_db);
+
+    lock_guard<mutex> lg(life_lock);
+
+    tds = move(pc);
+    holds_state = false;
+    used_temp_tables = false;
+    stats.idle_reconnects++;
+}
+
+// Run by the idle sweep: if the session hasn't done anything since cutoff, takes its
+// connection away so it can go back to the pool. The session stays logged in.
+shared_ptr<pooled_conn> client::take_idle_conn(chrono::steady_clock::time_point cutoff) {
+    lock_guard<mutex> lg(life_lock);
+
+    if (!tds || query_active || last_activity > cutoff)
+        return nullptr;
+
+    // resetting the connection would roll back the transaction or drop the temp tables
+    // from under the user, so it stays until they're done with it
+    if (holds_state) {
+        stats.idle_kept++;
+        return nullptr;
+    }
+
+    tds->owner = nullptr;
+
+    return move(tds);
+}
+
+void client::ping() {
+    post(json{
+        {"type", "pong"}
+    }.dump());
+}
+
+void client::compression(const json& j) {
+    lock_guard<mutex> lg(send_lock);
+
+    if (j.count("enabled") > 0 && !(bool)j.at("enabled")) {
+        deflater.reset();
+
+        ct->send(json{
+            {"type", "compression"},
+            {"enabled", false}
+        }.dump());
+
+        return;
+    }
+
+    int window_bits = j.count("window_bits") > 0 ? (int)j.at("window_bits") : 15;
+    bool context_takeover = j.count("context_takeover") > 0 ? (bool)j.at("context_takeover") : true;
+
+    deflater.reset(new ws_deflate(window_bits, context_takeover));
+
+    // sent uncompressed, as the browser doesn't know the settings yet
+    ct->send(json{
+        {"type", "compression"},
+        {"enabled", true},
+        {"window_bits", deflater->window_bits},
+        {"context_takeover", deflater->context_takeover},
+        {"threshold", DEFLATE_THRESHOLD}
+    }.dump());
+}
+
+// Queues a message for the writer thread to send. The queue only allows one producer at a time,
+// which queue_lock takes care of. msg gets swapped with a previously-sent buffer. If the
+// queue's full, we wait for space unless block is false, in which case msg is left alone
+// and we return false.
+bool client::post(string& msg, enum ws::opcode opcode, bool block, uint64_t rows_gen) {
+    unique_lock<mutex> lock(queue_lock);
+    out_msg m;
+
+    m.data.swap(msg);
+    m.opcode = opcode;
+    m.rows_gen = rows_gen;
+
+    if (!send_queue.try_push(m)) {
+        if (!block) {
+            msg.swap(m.data);
+            return false;
+        }
+
+        auto start = chrono::steady_clock::now();
+
+        producer_waiting = true;
+        atomic_thread_fence(memory_order_seq_cst);
+
+        space_cv.wait(lock, [&]() {
+            return send_queue.try_push(m);
+        });
+
+        producer_waiting = false;
+
+        queue_stalls++;
+        stats.queue_stalls++;
+        stats.queue_stall_us += (uint64_t)chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+    }
+
+    stats.messages_queued++;
+
+    auto depth = send_queue.size();
+
+    if (depth > queue_max_depth) {
+        queue_max_depth = depth;
+
+        auto max_depth = stats.queue_max_depth.load();
+
+        while (depth > max_depth && !stats.queue_max_depth.compare_exchange_weak(max_depth, depth)) {
+        }
+    }
+
+    lock.unlock();
+
+    wake_writer();
+
+    msg.swap(m.data);
+
+    return true;
+}
+
+void client::wake_writer() {
+    lock_guard<mutex> lg(writer_lock);
+
+    writer_wanted = true;
+    writer_cv.notify_one();
+}
+
+// Replaces any timer already set.
+void client::set_timer(chrono::steady_clock::time_point when) {
+    lock_guard<mutex> lg(writer_lock);
+
+    timer_set = true;
+    timer_at = when;
+    writer_cv.notify_one();
+}
+
+// Each session has a writer thread, which sends whatever's queued and fires the row
+// batch timer, so that a slow browser only holds up itself.
+void client::write_loop() {
+    unique_lock<mutex> ul(writer_lock);
+
+    while (true) {
+        auto woken = [&]() {
+            return writer_wanted || writer_stop || (timer_set && chrono::steady_clock::now() >= timer_at);
+        };
+
+        if (timer_set)
+            writer_cv.wait_until(ul, timer_at, woken);
+        else
+            writer_cv.wait(ul, woken);
+
+        if (writer_stop)
+            return;
+
+        bool want = writer_wanted;
+        bool fire = timer_set && chrono::steady_clock::now() >= timer_at;
+
+        writer_wanted = false;
+
+        if (fire)
+            timer_set = false;
+
+        ul.unlock();
+
+        try {
+            if (want)
+                write_queued();
+
+            if (fire)
+                timer();
+        } catch (const exception& e) {
+            cerr << "Writer failed: " << e.what() << endl;
+        }
+
+        ul.lock();
+    }
+}
+
+// Runs on the writer thread, which is the send queue's only consumer. A message only
+// leaves the queue once it's been sent, so if the browser goes away mid-send it's still
+// there for when it comes back.
+void client::write_queued() {
+    while (true) {
+        auto m = send_queue.front();
+
+        if (!m)
+            return;
+
+        // rows from a query that's since been cancelled
+        if (m->rows_gen == 0 || m->rows_gen > discard_gen) {
+            if (!send(m->data, m->opcode))
+                return; // attach will wake us up again
+        }
+
+        send_queue.pop();
+
+        atomic_thread_fence(memory_order_seq_cst);
+
+        if (producer_waiting) {
+            lock_guard<mutex> lg(queue_lock);
+
+            space_cv.notify_one();
+        }
+    }
+}
+
+void client::get_stats() {
+    size_t depth, max_depth;
+    uint64_t stalls;
+
+    {
+        lock_guard<mutex> lg(queue_lock);
+
+        depth = send_queue.size();
+        max_depth = queue_max_depth;
+        stalls = queue_stalls;
+    }
+
+    post(json{
+        {"type", "stats"},
+        {"send_queue", {
+            {"depth", depth},
+            {"max_depth", max_depth},
+            {"capacity", send_queue.capacity()},
+            {"stalls", stalls}
+        }},
+        {"global", {
+            {"messages_queued", stats.messages_queued.load()},
+            {"send_queue_max_depth", stats.queue_max_depth.load()},
+            {"send_queue_stalls", stats.queue_stalls.load()},
+            {"send_queue_stall_ms", stats.queue_stall_us.load() / 1000},
+            {"credit_waits", stats.credit_waits.load()},
+            {"credit_wait_ms", stats.credit_wait_us.load() / 1000},
+            {"credit_timeouts", stats.credit_timeouts.load()},
+            {"queries_queued", stats.queries_queued.load()},
+            {"orphaned_queries", stats.orphaned_queries.load()},
+            {"orphaned_query_ms", stats.orphaned_query_us.load() / 1000},
+            {"cancels", stats.cancels.load()},
+            {"cancel_ms", stats.cancel_us.load() / 1000},
+            {"cancel_kills", stats.cancel_kills.load()},
+            {"cancel_kill_failures", stats.cancel_kill_failures.load()},
+            {"kill_reconnects", stats.kill_reconnects.load()},
+            {"sessions_parked", stats.sessions_parked.load()},
+            {"sessions_resumed", stats.sessions_resumed.load()},
+            {"sessions_expired", stats.sessions_expired.load()},
+            {"idle_releases", stats.idle_releases.load()},
+            {"idle_reconnects", stats.idle_reconnects.load()},
+            {"idle_kept", stats.idle_kept.load()},
+            {"state_checks", stats.state_checks.load()},
+            {"logins", stats.logins.load()},
+            {"login_connect_ms", stats.login_connect_us.load() / 1000},
+            {"login_metadata_ms", stats.login_metadata_us.load() / 1000}
+        }},
+        {"pool", pool->get_stats()},
+        {"executor", workers->get_stats()},
+        {"blocking_executor", blocking_workers->get_stats()},
+        {"db_cache", db_lists.get_stats()},
+        {"audit", audit->get_stats()},
+        {"downloads", downloads ? downloads->get_stats() : json(nullptr)},
+        {"export_jobs", background_exports->get_stats()}
+    }.dump());
+}
+
+// Sends a file in chunks through the send queue, so that it's no more of a burden on
+// memory than a batch of rows.
+void client::send_file(const filesystem::path& fn, const string& mime, const string& filename) {
+    ifstream f(fn, ios::binary);
+
+    if (!f.good())
+        throw runtime_error("Could not open " + fn.string() + ".");
+
+    auto size = filesystem::file_size(fn);
+
+    post(json{
+        {"type", "file"},
+        {"mime", mime},
+        {"filename", filename},
+        {"size", size}
+    }.dump());
+
+    string chunk;
+    uint32_t seq = 0;
+
+    while (size > 0) {
+        auto len = (size_t)min(size, (uintmax_t)FILE_CHUNK_SIZE);
+
+        chunk.resize(8 + len);
+        chunk[0] = (char)BINARY_FRAME_FILE;
+        chunk[1] = 0;
+        chunk[2] = 0;
+        chunk[3] = 0;
+
+        for (unsigned int i = 0; i < 4; i++) {
+            chunk[4 + i] = (char)((seq >> (i * 8)) & 0xff);
+        }
+
+        f.read(chunk.data() + 8, (streamsize)len);
+
+        if (!f.good())
+            throw runtime_error("Error reading " + fn.string() + ".");
+
+        post(chunk, ws::opcode::binary);
+
+        size -= len;
+        seq++;
+    }
+}
+
+void client::list_jobs() {
+    if (!logged_in)
+        throw runtime_error("Not logged in.");
+
+    post(json{
+        {"type", "export_jobs"},
+        {"jobs", background_exports->list(job_key)}
+    }.dump());
+}
+
+void client::cancel_job(const json& j) {
+    if (!logged_in)
+        throw runtime_error("Not logged in.");
+
+    if (j.count("id") == 0)
+        throw runtime_error("No job ID given.");
+
+    background_exports->cancel(job_key, j.at("id"));
+}
+
+void client::delete_job(const json& j) {
+    if (!logged_in)
+        throw runtime_error("Not logged in.");
+
+    if (j.count("id") == 0)
+        throw runtime_error("No job ID given.");
+
+    background_exports->remove(job_key, j.at("id"));
+
+    post(json{
+        {"type", "export_deleted"},
+        {"id", j.at("id")}
+    }.dump());
+}
+
+// The file stays with the job, so can be downloaded again until it expires.
+void client::download_job(const json& j) {
+    if (!logged_in)
+        throw runtime_error("Not logged in.");
+
+    if (j.count("id") == 0)
+        throw runtime_error("No job ID given.");
+
+    auto job = background_exports->get(job_key, j.at("id"));
+
+    json msg{
+        {"type", "export_download"},
+        {"id", job->id}
+    };
+
+    if (downloads)
+        msg["download"] = config.download_url + downloads->add(job->path, job->mime, job->filename, false);
+    else {
+        // the chunks would get mixed up with those of a foreground export
+        if (query_running() && exp)
+            throw runtime_error("Export already running.");
+
+        send_file(job->path, job->mime, job->filename);
+    }
+
+    post(msg.dump());
+}
+
+// Called when one of this user's background exports finishes, whichever session started
+// it. Only a hint, as the browser can always ask for the list, so it's dropped rather than
+// waiting if the send queue is full.
+void client::job_changed(const string& key, const json& job) {
+    {
+        lock_guard<mutex> lg(life_lock);
+
+        if (job_key != key)
+            return;
+    }
+
+    auto msg = json{
+        {"type", "export_job"},
+        {"job", job}
+    }.dump();
+
+    post(msg, ws::opcode::text, false);
+}
+
+// The writer has to be closed before the file can be deleted on Windows.
+void client::remove_export() {
+    if (export_path.empty())
+        return;
+
+    exp.reset();
+
+    error_code ec;
+
+    filesystem::remove(export_path, ec);
+    export_path.clear();
+}
+
+// Called only from the writer. Returns false if the message should be kept to send again
+// once the browser's back: because it's parked, or the connection failed underneath us,
+// in which case disconn_handler will park or reap us. A retry always goes through the
+// deflater of the new connection, so it's compressed afresh rather than reusing
+// deflate_buf.
+bool client::send(const string_view& msg, enum ws::opcode opcode) {
+    lock_guard<mutex> lg(send_lock);
+
+    if (parked)
+        return false;
+
+    // browser's gone for good
+    if (!ct)
+        return true;
+
+    // file chunks are already compressed, if XLSX, and are too big to be worth trying
+    bool is_file = opcode == ws::opcode::binary && !msg.empty() && (uint8_t)msg[0] == BINARY_FRAME_FILE;
+
+    bool compressed = deflater && msg.length() >= DEFLATE_THRESHOLD && !is_file;
+
+    // once compressed, a message has to be sent compressed even if it got bigger, as it's
+    // now part of the deflate stream's history
+    if (compressed) {
+        try {
+            deflater->compress(msg, (uint8_t)opcode, deflate_buf);
+        } catch (const exception& e) {
+            // no point trying again
+            cerr << "Compression failed: " << e.what() << endl;
+            return true;
+        }
+    }
+
+    try {
+        if (compressed)
+            ct->send(deflate_buf, ws::opcode::binary);
+        else
+            ct->send(msg, opcode);
+    } catch (...) {
+        return false;
+    }
+
+    return true;
+}
+
+static void notify_job(const string& key, const json& job) {
+    lock_guard<mutex> lg(clients_lock);
+
+    for (auto c : clients) {
+        c->job_changed(key, job);
+    }
+}
+
+static void expire_session(const string& token) {
+    client* c;
+
+    {
+        lock_guard<mutex> lg(parked_lock);
+
+        auto it = parked_sessions.find(token);
+
+        if (it == parked_sessions.end())
+            return;
+
+        c = it->second;
+        parked_sessions.erase(it);
+    }
+
+    stats.sessions_expired++;
+
+    c->reap();
+}
+
+static void release_idle_conns() {
+    vector<shared_ptr<pooled_conn>> idle;
+    auto cutoff = chrono::steady_clock::now() - config.idle_timeout;
+
+    {
+        lock_guard<mutex> lg(clients_lock);
+
+        for (auto c : clients) {
+            if (auto pc = c->take_idle_conn(cutoff))
+                idle.push_back(move(pc));
+        }
+    }
+
+    // Resetting connections for the pool involves a round trip, so is done without the
+    // lock, and not on the housekeeper, which a slow server would otherwise hold up.
+    for (auto& pc : idle) {
+        workers->submit([pc = move(pc)]() mutable {
+            pool->release(pc);
+            stats.idle_releases++;
+        });
+    }
+}
+
+// at shutdown, nobody's coming back
+static void expire_sessions() {
+    vector<client*> cs;
+
+    {
+        lock_guard<mutex> lg(parked_lock);
+
+        for (const auto& ps : parked_sessions) {
+            cs.push_back(ps.second);
+        }
+
+        parked_sessions.clear();
+    }
+
+    for (auto c : cs) {
+        c->reap();
+    }
+}
+
+static void ws_recv(ws::client_thread& ct, const string_view& msg) {
+    try {
+        json j = json::parse(msg);
+
+        if (j.count("type") == 0)
+            throw runtime_error("No message type given.");
+
+        auto& c = *(client*)ct.context;
+
+        string type = j["type"];
+
+        if (type == "login")
+            c.login(j);
+        else if (type == "logout")
+            c.logout();
+        else if (type == "query")
+            c.query(j);
+        else if (type == "cancel")
+            c.cancel();
+        else if (type == "change_database")
+            c.change_database(j);
+        else if (type == "ping")
+            c.ping();
+        else if (type == "compression")
+            c.compression(j);
+        else if (type == "stats")
+            c.get_stats();
+        else if (type == "credit")
+            c.credit(j);
+        else if (type == "export_jobs")
+            c.list_jobs();
+        else if (type == "export_cancel")
+            c.cancel_job(j);
+        else if (type == "export_delete")
+            c.delete_job(j);
+        else if (type == "export_download")
+            c.download_job(j);
+        else if (type == "resume") {
+            auto old = c.resume(j);
+
+            if (old) {
+                ct.context = old;
+                c.reap();
+            }
+        } else
+            throw runtime_error("Unrecognized message type \"" + type + "\".");
+    } catch (const exception& e) {
+        send_error(ct, e.what());
+    }
+}
+
+static void disconn_handler(ws::client_thread& ct, const std::exception_ptr&) {
+    if (ct.context) {
+        auto c = (client*)ct.context;
+
+        ct.context = nullptr;
+
+        c->orphan();
+    }
+}
+
+#ifdef _WIN32
+void init(const string& server, uint16_t port, bool service = false) {
+#else
+void init(const string& server, uint16_t port) {
+#endif
+    pool.reset(new conn_pool);
+    workers.reset(new executor(config.executor_threads));
+    blocking_workers.reset(new executor(config.blocking_threads));
+    audit.reset(new audit_log);
+    housekeeper.reset(new scheduler);
+    background_exports.reset(new export_jobs(notify_job));
+
+    housekeeper->every(POOL_SWEEP_INTERVAL, []() {
+        pool->evict_idle();
+    });
+
+    if (config.idle_timeout.count() > 0) {
+        housekeeper->every(IDLE_SWEEP_INTERVAL, []() {
+            release_idle_conns();
+        });
+    }
+
+    if (config.download_port != 0) {
+        downloads.reset(new download_server((uint16_t)config.download_port));
+
+        housekeeper->every(DOWNLOAD_SWEEP_INTERVAL, []() {
+            downloads->expire();
+        });
+    }
+
+    housekeeper->every(EXPORT_JOB_SWEEP_INTERVAL, []() {
+        background_exports->expire();
+    });
+
+    wsserv.reset(new ws::server(port, BACKLOG, ws_recv, [&](ws::client_thread& ct) {
+        ct.context = new client(ct, server);
+    }, disconn_handler));
 
 #ifdef _WIN32
     if (service)
@@ -411,6 +1938,14 @@ void init(const string& server, uint16_t port) {
     wsserv->start();
 
     wsserv.reset(nullptr);
+    expire_sessions();
+    housekeeper.reset();
+    downloads.reset();
+    background_exports.reset();
+    blocking_workers.reset();
+    workers.reset();
+    audit.reset();
+    pool.reset();
 }
 
 int main(int argc, char* argv[]) {
@@ -430,7 +1965,7 @@ int main(int argc, char* argv[]) {
         }
 #endif
         if (argc < 3) {
-            fprintf(stderr, "Usage: tdsweb server port\n");
+            fprintf(stderr, "Usage: tdsweb server port [option=value ...]\n");
             return 1;
         }
 
@@ -439,6 +1974,10 @@ int main(int argc, char* argv[]) {
         if (port > 0xffff)
             throw runtime_error("Port out of range.");
 
+        for (int i = 3; i < argc; i++) {
+            parse_option(argv[i]);
+        }
+
         init(argv[1], (uint16_t)port);
     } catch (const exception& e) {
         cerr << e.what() << endl;
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <tdscpp.h>
+#include <string>
+#include <type_traits>
+#include <stdint.h>
+
+// What each tds::server_type is, as far as any of the encoders care. This is the only
+// place server types get sorted out - everything else goes by these - so a new one only
+// needs adding here.
+
+enum class type_class {
+    int32, // TINYINT, SMALLINT, INT
+    int64, // BIGINT, and INTN, which can be any size
+    floating,
+    decimal, // DECIMAL, NUMERIC, MONEY, SMALLMONEY
+    bit,
+    date,
+    time,
+    datetime, // DATETIME
+    other_datetime, // SMALLDATETIME, DATETIME2, DATETIMEOFFSET
+    string // text, GUIDs, binary, XML, UDTs, SQL_VARIANT
+};
+
+type_class classify_type(tds::server_type type);
+
+// broad categories of type_class, which decide how a column gets encoded for the browser
+// and for CSV
+
+enum class col_kind {
+    integer,
+    floating,
+    bit,
+    date,
+    time,
+    datetime,
+    string
+};
+
+col_kind get_col_kind(tds::server_type type);
+
+// Calls f with std::integral_constant<col_kind, K> for kind, so that encoders templated
+// on col_kind can be picked without a switch of their own.
+template<typename F>
+static inline auto with_col_kind(col_kind kind, F&& f) {
+    switch (kind) {
+        case col_kind::integer:
+            return f(std::integral_constant<col_kind, col_kind::integer>());
+
+        case col_kind::floating:
+            return f(std::integral_constant<col_kind, col_kind::floating>());
+
+        case col_kind::bit:
+            return f(std::integral_constant<col_kind, col_kind::bit>());
+
+        case col_kind::date:
+            return f(std::integral_constant<col_kind, col_kind::date>());
+
+        case col_kind::time:
+            return f(std::integral_constant<col_kind, col_kind::time>());
+
+        case col_kind::datetime:
+            return f(std::integral_constant<col_kind, col_kind::datetime>());
+
+        default:
+            return f(std::integral_constant<col_kind, col_kind::string>());
+    }
+}
+
+// random 64-character hex string, for session and download tokens
+std::string make_token();
+
+// days since 1970-01-01
+static inline int32_t days_from_civil(int y, unsigned int m, unsigned int d) {
+    y -= m <= 2;
+
+    int era = (y >= 0 ? y : y - 399) / 400;
+    auto yoe = (unsigned int)(y - (era * 400));
+    auto doy = ((153 * (m > 2 ? m - 3 : m + 9)) + 2) / 5 + d - 1;
+    auto doe = (yoe * 365) + (yoe / 4) - (yoe / 100) + doy;
+
+    return (era * 146097) + (int32_t)doe - 719468;
+}
@@ -8,6 +8,7 @@
 #include <memory>
 #include <wscpp.h>
 #include <windows.h>
+#include "config.h"
 
 using namespace std;
 
@@ -355,6 +356,11 @@ static void service_proc(unsigned long, wchar_t**) {
         auto server = k.query_string_value("Server");
         auto port = k.query_dword_value("Port");
 
+        try {
+            parse_options(k.query_string_value("Options"));
+        } catch (const registry_not_found&) {
+        }
+
         init(server, (uint16_t)port, true);
 
         set_status(SERVICE_STOPPED);
@@ -0,0 +1,69 @@
+#include <stdexcept>
+#include "ws_deflate.h"
+
+using namespace std;
+
+static const int DEFLATE_LEVEL = Z_DEFAULT_COMPRESSION;
+static const int DEFLATE_MEM_LEVEL = 8;
+
+ws_deflate::ws_deflate(int window_bits, bool context_takeover) : context_takeover(context_takeover) {
+    // zlib won't do raw deflate with 8-bit windows
+    if (window_bits < 9)
+        window_bits = 9;
+    else if (window_bits > 15)
+        window_bits = 15;
+
+    this->window_bits = window_bits;
+
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+
+    auto err = deflateInit2(&strm, DEFLATE_LEVEL, Z_DEFLATED, -window_bits, DEFLATE_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+
+    if (err != Z_OK)
+        throw runtime_error("deflateInit2 returned " + to_string(err) + ".");
+}
+
+ws_deflate::~ws_deflate() {
+    deflateEnd(&strm);
+}
+
+void ws_deflate::compress(const string_view& msg, uint8_t opcode, string& out) {
+    auto len = (uint32_t)msg.length();
+    int flush = context_takeover ? Z_SYNC_FLUSH : Z_FINISH;
+    int err;
+
+    out.clear();
+    out += (char)BINARY_FRAME_DEFLATE;
+    out += (char)opcode;
+    out += (char)0;
+    out += (char)0;
+
+    for (unsigned int i = 0; i < 4; i++) {
+        out += (char)((len >> (i * 8)) & 0xff);
+    }
+
+    strm.next_in = (Bytef*)msg.data();
+    strm.avail_in = (uInt)msg.length();
+
+    do {
+        auto off = out.length();
+        auto bound = deflateBound(&strm, strm.avail_in) + 16;
+
+        out.resize(off + bound);
+
+        strm.next_out = (Bytef*)out.data() + off;
+        strm.avail_out = (uInt)bound;
+
+        err = deflate(&strm, flush);
+
+        if (err != Z_OK && err != Z_STREAM_END && err != Z_BUF_ERROR)
+            throw runtime_error("deflate returned " + to_string(err) + ".");
+
+        out.resize(out.length() - strm.avail_out);
+    } while (strm.avail_out == 0 || (flush == Z_FINISH && err != Z_STREAM_END));
+
+    if (!context_takeover)
+        deflateReset(&strm);
+}
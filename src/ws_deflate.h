@@ -0,0 +1,36 @@
+#pragma once
+
+#include <zlib.h>
+#include <string>
+#include <string_view>
+#include <stdint.h>
+
+// Compression of outgoing WebSocket messages, in the spirit of permessage-deflate
+// (RFC 7692). The handshake and framing belong to wscpp, so rather than a WebSocket
+// extension this is negotiated by a "compression" message from the browser, and
+// compressed messages go out as binary frames:
+//
+//   u8  frame type (BINARY_FRAME_DEFLATE)
+//   u8  opcode of the original message (1 = text, 2 = binary)
+//   u16 reserved (0)
+//   u32 length of the original message, little-endian
+//   raw deflate data
+//
+// With context takeover, the deflate stream carries on from one message to the next
+// and each message ends with a sync flush. Without it, each message is a complete
+// deflate stream of its own.
+
+static const uint8_t BINARY_FRAME_DEFLATE = 2;
+
+class ws_deflate {
+public:
+    ws_deflate(int window_bits, bool context_takeover);
+    ~ws_deflate();
+    void compress(const std::string_view& msg, uint8_t opcode, std::string& out);
+
+    int window_bits;
+    bool context_takeover;
+
+private:
+    z_stream strm;
+};
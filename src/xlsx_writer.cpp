@@ -0,0 +1,455 @@
+#include <charconv>
+#include <stdio.h>
+#include "xlsx_writer.h"
+#include "tdsweb.h"
+
+using namespace std;
+
+// the sheet XML gets deflated in chunks of about this size
+static const size_t XLSX_FLUSH_SIZE = 65536;
+
+// Excel won't open a sheet with more rows than this
+static const unsigned int XLSX_MAX_ROWS = 1048576;
+
+// limits on the shared strings table, and on the strings waiting to see if they repeat
+static const size_t SST_MAX_ENTRIES = 262144;
+static const size_t SST_MAX_BYTES = 16777216;
+static const size_t SST_MAX_STRING = 256;
+static const size_t SEEN_MAX_BYTES = 4194304;
+
+// day 0 for Excel is 1899-12-30, or 25569 days before 1970-01-01
+static const int32_t EXCEL_EPOCH = 25569;
+
+// Excel thinks 1900 was a leap year, so serial numbers before 1900-03-01 are off by one
+static const int32_t EXCEL_FIRST_SERIAL = 61;
+
+// Excel only keeps 15 significant digits, so anything bigger goes in as text rather than
+// being silently rounded - BIGINT IDs, for instance
+static const int64_t EXCEL_MAX_EXACT = 999999999999999;
+static const unsigned int EXCEL_DIGITS = 15;
+
+static const char CONTENT_TYPES[] = R"(<?xml version="1.0" encoding="UTF-8" standalone="yes"?>
+<Types xmlns="http://schemas.openxmlformats.org/package/2006/content-types"><Default Extension="rels" ContentType="application/vnd.openxmlformats-package.relationships+xml"/><Default Extension="xml" ContentType="application/xml"/><Override PartName="/xl/workbook.xml" ContentType="application/vnd.openxmlformats-officedocument.spreadsheetml.sheet.main+xml"/><Override PartName="/xl/worksheets/sheet1.xml" ContentType="application/vnd.openxmlformats-officedocument.spreadsheetml.worksheet+xml"/><Override PartName="/xl/styles.xml" ContentType="application/vnd.openxmlformats-officedocument.spreadsheetml.styles+xml"/><Override PartName="/xl/sharedStrings.xml" ContentType="application/vnd.openxmlformats-officedocument.spreadsheetml.sharedStrings+xml"/></Types>)";
+
+static const char RELS[] = R"(<?xml version="1.0" encoding="UTF-8" standalone="yes"?>
+<Relationships xmlns="http://schemas.openxmlformats.org/package/2006/relationships"><Relationship Id="rId1" Type="http://schemas.openxmlformats.org/officeDocument/2006/relationships/officeDocument" Target="xl/workbook.xml"/></Relationships>)";
+
+static const char WORKBOOK[] = R"(<?xml version="1.0" encoding="UTF-8" standalone="yes"?>
+<workbook xmlns="http://schemas.openxmlformats.org/spreadsheetml/2006/main" xmlns:r="http://schemas.openxmlformats.org/officeDocument/2006/relationships"><sheets><sheet name="Sheet1" sheetId="1" r:id="rId1"/></sheets></workbook>)";
+
+static const char WORKBOOK_RELS[] = R"(<?xml version="1.0" encoding="UTF-8" standalone="yes"?>
+<Relationships xmlns="http://schemas.openxmlformats.org/package/2006/relationships"><Relationship Id="rId1" Type="http://schemas.openxmlformats.org/officeDocument/2006/relationships/worksheet" Target="worksheets/sheet1.xml"/><Relationship Id="rId2" Type="http://schemas.openxmlformats.org/officeDocument/2006/relationships/styles" Target="styles.xml"/><Relationship Id="rId3" Type="http://schemas.openxmlformats.org/officeDocument/2006/relationships/sharedStrings" Target="sharedStrings.xml"/></Relationships>)";
+
+// in the same order as enum xlsx_style
+static const char STYLES[] = R"(<?xml version="1.0" encoding="UTF-8" standalone="yes"?>
+<styleSheet xmlns="http://schemas.openxmlformats.org/spreadsheetml/2006/main"><numFmts count="2"><numFmt numFmtId="164" formatCode="hh:mm:ss"/><numFmt numFmtId="165" formatCode="yyyy\-mm\-dd hh:mm:ss"/></numFmts><fonts count="2"><font><sz val="10"/><name val="Arial"/></font><font><b/><sz val="10"/><name val="Arial"/></font></fonts><fills count="2"><fill><patternFill patternType="none"/></fill><fill><patternFill patternType="gray125"/></fill></fills><borders count="1"><border><left/><right/><top/><bottom/><diagonal/></border></borders><cellStyleXfs count="1"><xf numFmtId="0" fontId="0" fillId="0" borderId="0"/></cellStyleXfs><cellXfs count="5"><xf numFmtId="0" fontId="0" fillId="0" borderId="0" xfId="0"/><xf numFmtId="0" fontId="1" fillId="0" borderId="0" xfId="0" applyFont="1"/><xf numFmtId="14" fontId="0" fillId="0" borderId="0" xfId="0" applyNumberFormat="1"/><xf numFmtId="164" fontId="0" fillId="0" borderId="0" xfId="0" applyNumberFormat="1"/><xf numFmtId="165" fontId="0" fillId="0" borderId="0" xfId="0" applyNumberFormat="1"/></cellXfs><cellStyles count="1"><cellStyle name="Normal" xfId="0" builtinId="0"/></cellStyles></styleSheet>)";
+
+static const char SHEET_START[] = R"(<?xml version="1.0" encoding="UTF-8" standalone="yes"?>
+<worksheet xmlns="http://schemas.openxmlformats.org/spreadsheetml/2006/main"><sheetData>)";
+
+static const char SHEET_END[] = "</sheetData></worksheet>";
+
+// XML 1.0 doesn't allow most control characters at all, even escaped, so they get dropped
+static void xml_append_escaped(string& s, const string_view& v) {
+    auto start = v.data();
+    auto end = v.data() + v.length();
+
+    for (auto p = start; p < end; p++) {
+        auto c = (unsigned char)*p;
+
+        if (c >= 0x20 && c != '&' && c != '<' && c != '>')
+            continue;
+
+        if (c == '\t' || c == '\n' || c == '\r')
+            continue;
+
+        s.append(start, p - start);
+        start = p + 1;
+
+        switch (c) {
+            case '&':
+                s += "&amp;";
+                break;
+
+            case '<':
+                s += "&lt;";
+                break;
+
+            case '>':
+                s += "&gt;";
+                break;
+        }
+    }
+
+    s.append(start, end - start);
+}
+
+static void append_uint(string& s, uint64_t v) {
+    char buf[24];
+
+    auto r = to_chars(buf, buf + sizeof(buf), v);
+
+    s.append(buf, r.ptr - buf);
+}
+
+template<col_kind K>
+static void encode_xlsx(xlsx_writer& w, const tds::Field& col);
+
+template<>
+void encode_xlsx<col_kind::integer>(xlsx_writer& w, const tds::Field& col) {
+    if (col.is_null()) {
+        w.string_cell("NULL");
+        return;
+    }
+
+    auto v = (int64_t)col;
+
+    if (v >= -EXCEL_MAX_EXACT && v <= EXCEL_MAX_EXACT) {
+        w.number_cell(v);
+        return;
+    }
+
+    char buf[24];
+
+    auto r = to_chars(buf, buf + sizeof(buf), v);
+
+    w.string_cell(string_view(buf, r.ptr - buf));
+}
+
+template<>
+void encode_xlsx<col_kind::floating>(xlsx_writer& w, const tds::Field& col) {
+    if (col.is_null())
+        w.string_cell("NULL");
+    else
+        w.number_cell((double)col);
+}
+
+// Significant digits in a decimal's text form, from the first non-zero digit. Zeros at
+// the end of the fraction don't count, as DECIMAL(10, 6) gives 1.500000 for 1.5.
+static unsigned int significant_digits(const string_view& s) {
+    unsigned int digits = 0, zeros = 0;
+    bool started = false, frac = false;
+
+    for (auto c : s) {
+        if (c == '.') {
+            frac = true;
+            continue;
+        }
+
+        if (c < '0' || c > '9' || (c == '0' && !started))
+            continue;
+
+        started = true;
+
+        if (c == '0' && frac)
+            zeros++;
+        else {
+            digits += zeros + 1;
+            zeros = 0;
+        }
+    }
+
+    return digits;
+}
+
+// DECIMAL, NUMERIC, and MONEY. Ones with more digits than Excel keeps go in as text, as
+// small ones can lose precision just as well as big ones. Otherwise the text is already
+// a number Excel can read, so goes in as it is.
+static void encode_xlsx_decimal(xlsx_writer& w, const tds::Field& col) {
+    if (col.is_null()) {
+        w.string_cell("NULL");
+        return;
+    }
+
+    auto s = (string)col;
+
+    if (significant_digits(s) > EXCEL_DIGITS)
+        w.string_cell(s);
+    else
+        w.number_cell(string_view(s));
+}
+
+template<>
+void encode_xlsx<col_kind::bit>(xlsx_writer& w, const tds::Field& col) {
+    if (col.is_null())
+        w.string_cell("NULL");
+    else
+        w.bool_cell((int)col != 0);
+}
+
+template<>
+void encode_xlsx<col_kind::date>(xlsx_writer& w, const tds::Field& col) {
+    if (col.is_null()) {
+        w.string_cell("NULL");
+        return;
+    }
+
+    auto d = (tds::Date)col;
+    auto serial = days_from_civil(d.year(), d.month(), d.day()) + EXCEL_EPOCH;
+
+    if (serial < EXCEL_FIRST_SERIAL) {
+        w.string_cell((string)col);
+        return;
+    }
+
+    w.number_cell((int64_t)serial, xlsx_style::date);
+}
+
+template<>
+void encode_xlsx<col_kind::time>(xlsx_writer& w, const tds::Field& col) {
+    if (col.is_null()) {
+        w.string_cell("NULL");
+        return;
+    }
+
+    auto t = (tds::Time)col;
+
+    w.number_cell((double)((t.h * 3600) + (t.m * 60) + t.s) / 86400.0, xlsx_style::time);
+}
+
+template<>
+void encode_xlsx<col_kind::datetime>(xlsx_writer& w, const tds::Field& col) {
+    if (col.is_null()) {
+        w.string_cell("NULL");
+        return;
+    }
+
+    auto dt = (tds::DateTime)col;
+    auto serial = days_from_civil(dt.d.year(), dt.d.month(), dt.d.day()) + EXCEL_EPOCH;
+
+    if (serial < EXCEL_FIRST_SERIAL) {
+        w.string_cell((string)col);
+        return;
+    }
+
+    w.number_cell((double)serial + ((double)((dt.t.h * 3600) + (dt.t.m * 60) + dt.t.s) / 86400.0), xlsx_style::datetime);
+}
+
+template<>
+void encode_xlsx<col_kind::string>(xlsx_writer& w, const tds::Field& col) {
+    if (col.is_null())
+        w.string_cell("NULL");
+    else
+        w.string_cell((string)col);
+}
+
+// This deliberately doesn't use get_col_kind, as Excel wants numbers and dates as numbers
+// even where the browser is better off with text, e.g. DECIMAL or DATETIME2.
+static xlsx_encoder get_xlsx_encoder(tds::server_type type) {
+    switch (classify_type(type)) {
+        case type_class::int32:
+        case type_class::int64:
+            return encode_xlsx<col_kind::integer>;
+
+        case type_class::floating:
+            return encode_xlsx<col_kind::floating>;
+
+        case type_class::decimal:
+            return encode_xlsx_decimal;
+
+        case type_class::bit:
+            return encode_xlsx<col_kind::bit>;
+
+        case type_class::date:
+            return encode_xlsx<col_kind::date>;
+
+        case type_class::time:
+            return encode_xlsx<col_kind::time>;
+
+        // Excel has no time zones, so DATETIMEOFFSET is written as its local time
+        case type_class::datetime:
+        case type_class::other_datetime:
+            return encode_xlsx<col_kind::datetime>;
+
+        // no better representation in a cell
+        default:
+            return encode_xlsx<col_kind::string>;
+    }
+}
+
+xlsx_writer::xlsx_writer(const filesystem::path& fn) : zip(fn) {
+    zip.add("[Content_Types].xml", CONTENT_TYPES);
+    zip.add("_rels/.rels", RELS);
+    zip.add("xl/workbook.xml", WORKBOOK);
+    zip.add("xl/_rels/workbook.xml.rels", WORKBOOK_RELS);
+    zip.add("xl/styles.xml", STYLES);
+
+    zip.begin("xl/worksheets/sheet1.xml");
+
+    sheet = SHEET_START;
+}
+
+void xlsx_writer::flush() {
+    zip.write(sheet);
+    sheet.clear();
+}
+
+// FIXME - add blank row if not first table
+void xlsx_writer::header(const vector<pair<string, tds::server_type>>& columns) {
+    plan.clear();
+
+    if (rows >= XLSX_MAX_ROWS) {
+        truncated = true;
+        return;
+    }
+
+    rows++;
+
+    sheet += "<row>";
+
+    for (const auto& col : columns) {
+        string_cell(get<0>(col), xlsx_style::header);
+        plan.push_back(get_xlsx_encoder(get<1>(col)));
+    }
+
+    sheet += "</row>";
+}
+
+void xlsx_writer::row(const vector<tds::Field>& columns) {
+    if (rows >= XLSX_MAX_ROWS) {
+        truncated = true;
+        return;
+    }
+
+    rows++;
+
+    sheet += "<row>";
+
+    for (size_t i = 0; i < columns.size(); i++) {
+        plan[i](*this, columns[i]);
+    }
+
+    sheet += "</row>";
+
+    if (sheet.length() >= XLSX_FLUSH_SIZE)
+        flush();
+}
+
+void xlsx_writer::number_cell(const string_view& v, xlsx_style style) {
+    if (style == xlsx_style::normal)
+        sheet += "<c><v>";
+    else {
+        sheet += "<c s=\"";
+        append_uint(sheet, (unsigned int)style);
+        sheet += "\"><v>";
+    }
+
+    sheet += v;
+    sheet += "</v></c>";
+}
+
+void xlsx_writer::number_cell(int64_t v) {
+    char buf[24];
+
+    auto r = to_chars(buf, buf + sizeof(buf), v);
+
+    number_cell(string_view(buf, r.ptr - buf));
+}
+
+void xlsx_writer::number_cell(double v, xlsx_style style) {
+    char buf[32];
+
+    // there's no way to store NaN or infinity in a cell
+    if (!isfinite(v)) {
+        sheet += "<c/>";
+        return;
+    }
+
+#ifdef __cpp_lib_to_chars
+    auto r = to_chars(buf, buf + sizeof(buf), v);
+
+    number_cell(string_view(buf, r.ptr - buf), style);
+#else
+    auto len = snprintf(buf, sizeof(buf), "%.17g", v);
+
+    number_cell(string_view(buf, (size_t)len), style);
+#endif
+}
+
+void xlsx_writer::bool_cell(bool v) {
+    sheet += v ? "<c t=\"b\"><v>1</v></c>" : "<c t=\"b\"><v>0</v></c>";
+}
+
+void xlsx_writer::string_cell(const string_view& v, xlsx_style style) {
+    auto style_attr = [&]() {
+        if (style != xlsx_style::normal) {
+            sheet += " s=\"";
+            append_uint(sheet, (unsigned int)style);
+            sheet += "\"";
+        }
+    };
+
+    auto it = sst_index.find(v);
+
+    if (it == sst_index.end() && v.length() <= SST_MAX_STRING && sst.size() < SST_MAX_ENTRIES &&
+        sst_bytes + v.length() <= SST_MAX_BYTES) {
+        string s{v};
+        auto st = seen.find(s);
+
+        if (st != seen.end()) {
+            // second time we've seen it, so worth sharing
+            seen_bytes -= v.length();
+            seen.erase(st);
+
+            sst.push_back(move(s));
+            sst_bytes += v.length();
+            it = sst_index.emplace(sst.back(), (uint32_t)(sst.size() - 1)).first;
+        } else {
+            if (seen_bytes + v.length() > SEEN_MAX_BYTES) {
+                seen.clear();
+                seen_bytes = 0;
+            }
+
+            seen_bytes += v.length();
+            seen.insert(move(s));
+        }
+    }
+
+    if (it != sst_index.end()) {
+        sheet += "<c t=\"s\"";
+        style_attr();
+        sheet += "><v>";
+        append_uint(sheet, it->second);
+        sheet += "</v></c>";
+        sst_refs++;
+    } else {
+        sheet += "<c t=\"inlineStr\"";
+        style_attr();
+        sheet += "><is><t xml:space=\"preserve\">";
+        xml_append_escaped(sheet, v);
+        sheet += "</t></is></c>";
+    }
+}
+
+void xlsx_writer::finish() {
+    sheet += SHEET_END;
+    flush();
+    zip.end();
+
+    string s = R"(<?xml version="1.0" encoding="UTF-8" standalone="yes"?>
+<sst xmlns="http://schemas.openxmlformats.org/spreadsheetml/2006/main" count=")";
+
+    append_uint(s, sst_refs);
+    s += "\" uniqueCount=\"";
+    append_uint(s, sst.size());
+    s += "\">";
+
+    for (const auto& str : sst) {
+        s += "<si><t xml:space=\"preserve\">";
+        xml_append_escaped(s, str);
+        s += "</t></si>";
+    }
+
+    s += "</sst>";
+
+    zip.add("xl/sharedStrings.xml", s);
+    zip.finish();
+}
+
+string xlsx_writer::mime() const {
+    return "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet";
+}
+
+string xlsx_writer::filename() const {
+    return "results.xlsx";
+}
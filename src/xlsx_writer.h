@@ -0,0 +1,65 @@
+#pragma once
+
+#include <tdscpp.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <filesystem>
+#include <stdint.h>
+#include "zip_writer.h"
+#include "exporter.h"
+
+// Writes results to an XLSX file as they arrive, rather than building a workbook in
+// memory. The sheet XML is deflated straight to disk, and the only things which grow are
+// the shared strings table and the strings we're considering for it, both of which have
+// limits.
+//
+// Strings go inline the first time we see them, and into the shared strings table if
+// they turn up again, so that only values which repeat pay for being shared.
+
+class xlsx_writer;
+
+typedef void (*xlsx_encoder)(xlsx_writer& w, const tds::Field& col);
+
+// cell styles, see styles.xml in xlsx_writer.cpp
+enum class xlsx_style : unsigned int {
+    normal = 0,
+    header,
+    date,
+    time,
+    datetime
+};
+
+class xlsx_writer : public exporter {
+public:
+    xlsx_writer(const std::filesystem::path& fn);
+    void header(const std::vector<std::pair<std::string, tds::server_type>>& columns) override;
+    void row(const std::vector<tds::Field>& columns) override;
+    void finish() override;
+    std::string mime() const override;
+    std::string filename() const override;
+
+    // for the encoders
+    void number_cell(const std::string_view& v, xlsx_style style = xlsx_style::normal);
+    void number_cell(int64_t v);
+    void number_cell(double v, xlsx_style style = xlsx_style::normal);
+    void bool_cell(bool v);
+    void string_cell(const std::string_view& v, xlsx_style style = xlsx_style::normal);
+
+private:
+    void flush();
+
+    zip_writer zip;
+    std::string sheet;
+    std::vector<xlsx_encoder> plan;
+    unsigned int rows = 0;
+    std::deque<std::string> sst;
+    std::unordered_map<std::string_view, uint32_t> sst_index;
+    size_t sst_bytes = 0;
+    uint64_t sst_refs = 0;
+    std::unordered_set<std::string> seen;
+    size_t seen_bytes = 0;
+};
@@ -0,0 +1,191 @@
+#include <stdexcept>
+#include <algorithm>
+#include <time.h>
+#include <zlib.h>
+#include "zip_writer.h"
+#include "byte_writer.h"
+
+using namespace std;
+
+// names are UTF-8, and sizes come after the data
+static const uint16_t ZIP_FLAGS = 0x0808;
+
+// version needed to extract: 2.0 for deflate, 4.5 for Zip64
+static const uint16_t ZIP_VERSION = 20;
+static const uint16_t ZIP64_VERSION = 45;
+
+zip_writer::zip_writer(const filesystem::path& fn) : f(fn, ios::binary | ios::trunc),
+                                                     pd(Z_DEFAULT_COMPRESSION, [this](const string_view& s) { out(s); }) {
+    if (!f.good())
+        throw runtime_error("Could not create " + fn.u8string() + ".");
+
+    auto t = time(nullptr);
+    struct tm tm;
+
+#ifdef _WIN32
+    localtime_s(&tm, &t);
+#else
+    localtime_r(&t, &tm);
+#endif
+
+    dos_time = (uint16_t)((tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2));
+    dos_date = (uint16_t)(((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday);
+}
+
+void zip_writer::out(const string_view& s) {
+    f.write(s.data(), (streamsize)s.length());
+
+    if (!f.good())
+        throw runtime_error("Error writing ZIP file.");
+
+    offset += s.length();
+}
+
+void zip_writer::add(const string& name, const string_view& data) {
+    begin(name);
+    write(data);
+    end();
+}
+
+void zip_writer::begin(const string& name) {
+    string h;
+
+    entries.push_back({name, 0, 0, 0, offset});
+
+    append_le<uint32_t>(h, 0x04034b50);
+    append_le<uint16_t>(h, ZIP_VERSION);
+    append_le<uint16_t>(h, ZIP_FLAGS);
+    append_le<uint16_t>(h, Z_DEFLATED);
+    append_le<uint16_t>(h, dos_time);
+    append_le<uint16_t>(h, dos_date);
+    append_le<uint32_t>(h, 0); // CRC
+    append_le<uint32_t>(h, 0); // compressed size
+    append_le<uint32_t>(h, 0); // uncompressed size
+    append_le<uint16_t>(h, (uint16_t)name.length());
+    append_le<uint16_t>(h, 0); // extra length
+    h += name;
+
+    out(h);
+
+    entry_offset = offset;
+
+    pd.reset();
+}
+
+void zip_writer::write(const string_view& data) {
+    pd.write(data);
+}
+
+void zip_writer::end() {
+    string d;
+
+    pd.finish();
+
+    auto& e = entries.back();
+
+    e.crc = pd.crc;
+    e.compressed = offset - entry_offset;
+    e.size = pd.size;
+
+    append_le<uint32_t>(d, 0x08074b50);
+    append_le<uint32_t>(d, e.crc);
+
+    // The local header was written before we knew, so has no Zip64 field, and readers
+    // take the sizes from the central directory.
+    if (e.compressed > UINT32_MAX || e.size > UINT32_MAX) {
+        append_le<uint64_t>(d, e.compressed);
+        append_le<uint64_t>(d, e.size);
+    } else {
+        append_le<uint32_t>(d, (uint32_t)e.compressed);
+        append_le<uint32_t>(d, (uint32_t)e.size);
+    }
+
+    out(d);
+}
+
+// Anything too big for its field in the central directory or end record is set to all
+// ones, with the real value in a Zip64 extra field or end record.
+void zip_writer::finish() {
+    string cd;
+    auto cd_offset = offset;
+
+    for (const auto& e : entries) {
+        string extra;
+
+        if (e.size > UINT32_MAX)
+            append_le<uint64_t>(extra, e.size);
+
+        if (e.compressed > UINT32_MAX)
+            append_le<uint64_t>(extra, e.compressed);
+
+        if (e.offset > UINT32_MAX)
+            append_le<uint64_t>(extra, e.offset);
+
+        if (!extra.empty()) {
+            string hdr;
+
+            append_le<uint16_t>(hdr, 0x0001);
+            append_le<uint16_t>(hdr, (uint16_t)extra.length());
+
+            extra = hdr + extra;
+        }
+
+        auto version = extra.empty() ? ZIP_VERSION : ZIP64_VERSION;
+
+        append_le<uint32_t>(cd, 0x02014b50);
+        append_le<uint16_t>(cd, version); // version made by
+        append_le<uint16_t>(cd, version); // version needed
+        append_le<uint16_t>(cd, ZIP_FLAGS);
+        append_le<uint16_t>(cd, Z_DEFLATED);
+        append_le<uint16_t>(cd, dos_time);
+        append_le<uint16_t>(cd, dos_date);
+        append_le<uint32_t>(cd, e.crc);
+        append_le<uint32_t>(cd, (uint32_t)min<uint64_t>(e.compressed, UINT32_MAX));
+        append_le<uint32_t>(cd, (uint32_t)min<uint64_t>(e.size, UINT32_MAX));
+        append_le<uint16_t>(cd, (uint16_t)e.name.length());
+        append_le<uint16_t>(cd, (uint16_t)extra.length());
+        append_le<uint16_t>(cd, 0); // comment length
+        append_le<uint16_t>(cd, 0); // disk number
+        append_le<uint16_t>(cd, 0); // internal attributes
+        append_le<uint32_t>(cd, 0); // external attributes
+        append_le<uint32_t>(cd, (uint32_t)min<uint64_t>(e.offset, UINT32_MAX));
+        cd += e.name;
+        cd += extra;
+    }
+
+    uint64_t cd_size = cd.length();
+    uint64_t count = entries.size();
+
+    if (cd_offset > UINT32_MAX || cd_size > UINT32_MAX || count > UINT16_MAX) {
+        auto eocd64_offset = cd_offset + cd_size;
+
+        append_le<uint32_t>(cd, 0x06064b50);
+        append_le<uint64_t>(cd, 44); // size of the rest of the record
+        append_le<uint16_t>(cd, ZIP64_VERSION); // version made by
+        append_le<uint16_t>(cd, ZIP64_VERSION); // version needed
+        append_le<uint32_t>(cd, 0); // disk number
+        append_le<uint32_t>(cd, 0); // disk with central directory
+        append_le<uint64_t>(cd, count);
+        append_le<uint64_t>(cd, count);
+        append_le<uint64_t>(cd, cd_size);
+        append_le<uint64_t>(cd, cd_offset);
+
+        append_le<uint32_t>(cd, 0x07064b50);
+        append_le<uint32_t>(cd, 0); // disk with Zip64 end record
+        append_le<uint64_t>(cd, eocd64_offset);
+        append_le<uint32_t>(cd, 1); // number of disks
+    }
+
+    append_le<uint32_t>(cd, 0x06054b50);
+    append_le<uint16_t>(cd, 0); // disk number
+    append_le<uint16_t>(cd, 0); // disk with central directory
+    append_le<uint16_t>(cd, (uint16_t)min<uint64_t>(count, UINT16_MAX));
+    append_le<uint16_t>(cd, (uint16_t)min<uint64_t>(count, UINT16_MAX));
+    append_le<uint32_t>(cd, (uint32_t)min<uint64_t>(cd_size, UINT32_MAX));
+    append_le<uint32_t>(cd, (uint32_t)min<uint64_t>(cd_offset, UINT32_MAX));
+    append_le<uint16_t>(cd, 0); // comment length
+
+    out(cd);
+
+    f.close();
+}
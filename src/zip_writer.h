@@ -0,0 +1,46 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+#include <stdint.h>
+#include "parallel_deflate.h"
+
+// Writes a ZIP file as it goes, deflating each entry straight to disk, so that how much
+// memory it uses doesn't depend on how big the entries are. Sizes and CRCs go in data
+// descriptors after each entry, as we don't know them until the end. Entries are
+// compressed on the worker pool, see parallel_deflate.h.
+//
+// Zip64 is only used where something doesn't fit, so that ordinary files open in readers
+// which don't understand it.
+
+class zip_writer {
+public:
+    zip_writer(const std::filesystem::path& fn);
+    void add(const std::string& name, const std::string_view& data);
+    void begin(const std::string& name);
+    void write(const std::string_view& data);
+    void end();
+    void finish();
+
+private:
+    struct entry {
+        std::string name;
+        uint32_t crc;
+        uint64_t compressed;
+        uint64_t size;
+        uint64_t offset;
+    };
+
+    void out(const std::string_view& s);
+
+    std::ofstream f;
+    parallel_deflate pd;
+    std::vector<entry> entries;
+    uint64_t offset = 0;
+    uint64_t entry_offset;
+    uint16_t dos_time;
+    uint16_t dos_date;
+};
@@ -2,7 +2,40 @@
 
 let ws;
 let logged_in = false, logging_in = false;
+
+// lets us pick up where we left off if the connection drops
+let session_token = null;
 let res_tbody = null;
+let res_dicts = [];
+
+// rows the server can send before it has to wait for us to ask for more, which we do
+// as the user scrolls towards the bottom of the results
+const CREDIT_ROWS = 5000;
+let query_running = false;
+let rows_received = 0, rows_granted = 0;
+
+// ask for rows in the binary columnar format, if the browser can decode it
+const binary_rows = (typeof BigInt64Array != "undefined" && typeof TextDecoder != "undefined");
+
+// see binary_batch.h
+const BINARY_FRAME_ROWS = 1;
+const BIN_INT32 = 1, BIN_INT64 = 2, BIN_FLOAT64 = 3, BIN_BOOL = 4, BIN_STRING = 5, BIN_DATE = 6, BIN_TIME = 7, BIN_DATETIME = 8;
+const BIN_STRING_DICT = 9;
+
+// see ws_deflate.h
+const BINARY_FRAME_DEFLATE = 2;
+let compression = null;
+let inflater = null;
+let recv_chain = Promise.resolve();
+
+// see BINARY_FRAME_FILE in tdsweb.cpp
+const BINARY_FRAME_FILE = 3;
+let download = null;
+
+// background exports, by ID - see export_jobs.h
+let jobs = new Map();
+let jobs_timer = null;
+const JOBS_POLL_INTERVAL = 2000;
 
 document.addEventListener("DOMContentLoaded", init);
 
@@ -32,6 +65,8 @@ function recv_login(msg) {
     document.getElementById("go-button").disabled = false;
     document.getElementById("stop-button").disabled = true;
     document.getElementById("excel-button").disabled = false;
+    document.getElementById("csv-button").disabled = false;
+    document.getElementById("background-check").disabled = false;
 
     let dbc = document.getElementById("database-changer");
 
@@ -52,6 +87,37 @@ function recv_login(msg) {
     document.getElementById("database-changer-container").style.display = "";
 
     logged_in = true;
+    session_token = msg.token;
+
+    // including any started from an earlier session
+    ws.send(JSON.stringify({
+        "type": "export_jobs"
+    }));
+}
+
+function recv_resumed(msg) {
+    if (!msg.success) {
+        session_token = null;
+        query_running = false;
+
+        change_status("Session expired, please log in again.", true);
+
+        document.getElementById("username").disabled = false;
+        document.getElementById("password").disabled = false;
+        document.getElementById("login-button").disabled = false;
+        return;
+    }
+
+    recv_login(msg);
+
+    if (msg.query_running) {
+        document.getElementById("go-button").disabled = true;
+        document.getElementById("stop-button").disabled = false;
+        document.getElementById("excel-button").disabled = true;
+        document.getElementById("csv-button").disabled = true;
+        document.getElementById("query-box").readOnly = true;
+        document.getElementById("database-changer").disabled = true;
+    }
 }
 
 function recv_logout(msg) {
@@ -65,9 +131,14 @@ function recv_logout(msg) {
     document.getElementById("go-button").disabled = true;
     document.getElementById("stop-button").disabled = true;
     document.getElementById("excel-button").disabled = true;
+    document.getElementById("csv-button").disabled = true;
+    document.getElementById("background-check").disabled = true;
     document.getElementById("database-changer-container").style.display = "none";
 
     logged_in = false;
+    session_token = null;
+
+    clear_jobs();
 }
 
 function recv_message(msg) {
@@ -121,14 +192,13 @@ function recv_table(msg) {
     let res = document.getElementById("results");
 
     res_tbody = document.createElement("tbody");
+    res_dicts = [];
     tbl.appendChild(res_tbody);
 
     res.appendChild(tbl);
 }
 
-function recv_row(msg) {
-    let col = msg.columns;
-
+function make_row(col) {
     let tr = document.createElement("tr");
 
     for (let i = 0; i < col.length; i++) {
@@ -137,13 +207,266 @@ function recv_row(msg) {
         if (col[i] === null) {
             td.appendChild(document.createTextNode("NULL"));
             td.classList.add("null");
-        } else
+        } else if (typeof col[i] == "boolean")
+            td.appendChild(document.createTextNode(col[i] ? "1" : "0"));
+        else {
             td.appendChild(document.createTextNode(col[i]));
 
+            if (typeof col[i] == "number")
+                td.classList.add("num");
+        }
+
         tr.appendChild(td);
     }
 
-    res_tbody.appendChild(tr);
+    return tr;
+}
+
+function recv_rows(msg) {
+    let frag = document.createDocumentFragment();
+
+    // dictionary-encoded strings are sent as numbers - see json_batch.h
+    if (msg.dict !== undefined) {
+        for (let i = 0; i < msg.dict.length; i++) {
+            let col = msg.dict[i][0];
+
+            if (res_dicts[col] === undefined)
+                res_dicts[col] = [];
+
+            for (let j = 1; j < msg.dict[i].length; j++) {
+                res_dicts[col].push(msg.dict[i][j]);
+            }
+        }
+    }
+
+    for (let col = 0; col < res_dicts.length; col++) {
+        if (res_dicts[col] === undefined)
+            continue;
+
+        for (let i = 0; i < msg.rows.length; i++) {
+            if (typeof msg.rows[i][col] == "number")
+                msg.rows[i][col] = res_dicts[col][msg.rows[i][col]];
+        }
+    }
+
+    for (let i = 0; i < msg.rows.length; i++) {
+        frag.appendChild(make_row(msg.rows[i]));
+    }
+
+    res_tbody.appendChild(frag);
+
+    rows_received += msg.rows.length;
+    grant_credit();
+}
+
+function grant_credit() {
+    if (!query_running || rows_granted - rows_received >= CREDIT_ROWS / 2)
+        return;
+
+    let res = document.getElementById("results");
+
+    // only if within a screen of the bottom
+    if (res.scrollTop + (2 * res.clientHeight) < res.scrollHeight)
+        return;
+
+    ws.send(JSON.stringify({
+        "type": "credit",
+        "rows": CREDIT_ROWS
+    }));
+
+    rows_granted += CREDIT_ROWS;
+}
+
+function pad8(off) {
+    return (off + 7) & ~7;
+}
+
+function two_digits(n) {
+    return (n < 10 ? "0" : "") + n;
+}
+
+function format_time(secs) {
+    return two_digits(Math.floor(secs / 3600)) + ":" + two_digits(Math.floor(secs / 60) % 60) + ":" + two_digits(secs % 60);
+}
+
+function decode_column(buf, off, type, num_rows, col, rows) {
+    let vals;
+    let nulls = new Uint8Array(buf, off, (num_rows + 7) >> 3);
+
+    off = pad8(off + nulls.length);
+
+    function is_null(r) {
+        return (nulls[r >> 3] & (1 << (r & 7))) != 0;
+    }
+
+    switch (type) {
+        case BIN_INT32:
+        case BIN_DATE:
+        case BIN_TIME:
+            vals = new Int32Array(buf, off, num_rows);
+            off = pad8(off + (num_rows * 4));
+        break;
+
+        case BIN_INT64:
+            vals = new BigInt64Array(buf, off, num_rows);
+            off += num_rows * 8;
+        break;
+
+        case BIN_FLOAT64:
+        case BIN_DATETIME:
+            vals = new Float64Array(buf, off, num_rows);
+            off += num_rows * 8;
+        break;
+
+        case BIN_BOOL:
+            vals = new Uint8Array(buf, off, num_rows);
+            off = pad8(off + num_rows);
+        break;
+
+        case BIN_STRING:
+        {
+            let offsets = new Uint32Array(buf, off, num_rows + 1);
+            off = pad8(off + ((num_rows + 1) * 4));
+
+            let data = new Uint8Array(buf, off, offsets[num_rows]);
+            off = pad8(off + data.length);
+
+            let dec = new TextDecoder();
+
+            for (let r = 0; r < num_rows; r++) {
+                rows[r][col] = is_null(r) ? null : dec.decode(data.subarray(offsets[r], offsets[r + 1]));
+            }
+
+            return off;
+        }
+
+        case BIN_STRING_DICT:
+        {
+            let ids = new Uint32Array(buf, off, num_rows);
+            off = pad8(off + (num_rows * 4));
+
+            let count = new Uint32Array(buf, off, 1)[0];
+            let offsets = new Uint32Array(buf, off + 4, count + 1);
+            off = pad8(off + ((count + 2) * 4));
+
+            let data = new Uint8Array(buf, off, offsets[count]);
+            off = pad8(off + data.length);
+
+            let dec = new TextDecoder();
+
+            if (res_dicts[col] === undefined)
+                res_dicts[col] = [];
+
+            let dict = res_dicts[col];
+
+            for (let i = 0; i < count; i++) {
+                dict.push(dec.decode(data.subarray(offsets[i], offsets[i + 1])));
+            }
+
+            for (let r = 0; r < num_rows; r++) {
+                rows[r][col] = is_null(r) ? null : dict[ids[r]];
+            }
+
+            return off;
+        }
+
+        default:
+            throw Error("Unrecognized binary column type " + type + ".");
+    }
+
+    for (let r = 0; r < num_rows; r++) {
+        if (is_null(r)) {
+            rows[r][col] = null;
+            continue;
+        }
+
+        switch (type) {
+            case BIN_INT32:
+            case BIN_FLOAT64:
+                rows[r][col] = vals[r];
+            break;
+
+            case BIN_INT64:
+                // as with JSON, leave as a string if too big for a Number
+                if (vals[r] <= Number.MAX_SAFE_INTEGER && vals[r] >= -Number.MAX_SAFE_INTEGER)
+                    rows[r][col] = Number(vals[r]);
+                else
+                    rows[r][col] = vals[r].toString();
+            break;
+
+            case BIN_BOOL:
+                rows[r][col] = vals[r] != 0;
+            break;
+
+            case BIN_DATE:
+                rows[r][col] = new Date(vals[r] * 86400000).toISOString().substring(0, 10);
+            break;
+
+            case BIN_TIME:
+                rows[r][col] = format_time(vals[r]);
+            break;
+
+            case BIN_DATETIME:
+                rows[r][col] = new Date(vals[r] * 1000).toISOString().substring(0, 19);
+            break;
+        }
+    }
+
+    return off;
+}
+
+function recv_file(msg) {
+    download = {
+        mime: msg.mime,
+        filename: msg.filename,
+        size: msg.size,
+        received: 0,
+        chunks: []
+    };
+}
+
+function recv_file_chunk(buf) {
+    if (download === null)
+        throw Error("Received file data without file message.");
+
+    let dv = new DataView(buf);
+
+    if (dv.getUint32(4, true) != download.chunks.length)
+        throw Error("File chunk " + dv.getUint32(4, true) + " out of sequence.");
+
+    download.chunks.push(new Uint8Array(buf, 8));
+    download.received += buf.byteLength - 8;
+}
+
+function recv_binary(buf) {
+    let dv = new DataView(buf);
+
+    if (dv.getUint8(0) == BINARY_FRAME_FILE) {
+        recv_file_chunk(buf);
+        return;
+    }
+
+    if (dv.getUint8(0) != BINARY_FRAME_ROWS)
+        throw Error("Unrecognized binary frame type " + dv.getUint8(0) + ".");
+
+    if (dv.getUint8(1) != 1)
+        throw Error("Unsupported binary frame version " + dv.getUint8(1) + ".");
+
+    let num_cols = dv.getUint16(2, true);
+    let num_rows = dv.getUint32(4, true);
+    let types = new Uint8Array(buf, 8, num_cols);
+    let off = pad8(8 + num_cols);
+    let rows = [];
+
+    for (let r = 0; r < num_rows; r++) {
+        rows.push(new Array(num_cols));
+    }
+
+    for (let c = 0; c < num_cols; c++) {
+        off = decode_column(buf, off, types[c], num_rows, c, rows);
+    }
+
+    recv_rows({ "rows": rows });
 }
 
 function recv_row_count(msg) {
@@ -166,58 +489,331 @@ function recv_row_count(msg) {
     p.scrollIntoView();
 }
 
+function recv_query_queued(msg) {
+    let p = document.createElement("p");
+
+    p.appendChild(document.createTextNode("Server busy, query waiting to start."));
+    document.getElementById("messages").appendChild(p);
+
+    p.scrollIntoView();
+}
+
 function recv_query_finished(msg) {
+    query_running = false;
+
     document.getElementById("query-box").readOnly = false;
     document.getElementById("go-button").disabled = false;
     document.getElementById("stop-button").disabled = true;
     document.getElementById("excel-button").disabled = false;
+    document.getElementById("csv-button").disabled = false;
     document.getElementById("database-changer").disabled = false;
 
-    if (msg.data != undefined) {
+    if (msg.cancelled) {
+        let p = document.createElement("p");
+
+        p.appendChild(document.createTextNode("Query cancelled after " + msg.cancel_ms.toFixed(0) + " ms" +
+                                              (msg.killed ? " (session killed)." : ".")));
+        document.getElementById("messages").appendChild(p);
+    }
+
+    if (msg.truncated) {
+        let p = document.createElement("p");
+
+        p.appendChild(document.createTextNode("Export incomplete, as the format couldn't hold all of the results."));
+        document.getElementById("messages").appendChild(p);
+    }
+
+    save_download(msg);
+}
+
+// msg.download is set if the file's on the download server, otherwise it's just come
+// over the WebSocket
+function save_download(msg) {
+    if (msg.download != undefined) {
+        let link = document.createElement("a");
+
+        // relative to the page, as the proxy in front of tdsweb maps it to the download port
+        link.href = new URL(msg.download, location.href).href;
+        document.body.appendChild(link);
+        link.click();
+        document.body.removeChild(link);
+    }
+
+    if (download !== null) {
+        let d = download;
+
+        download = null;
+
+        if (d.received != d.size)
+            throw Error("Download incomplete, received " + d.received + " of " + d.size + " bytes.");
+
         let link = document.createElement("a");
+        let url = URL.createObjectURL(new Blob(d.chunks, {type: d.mime}));
 
-        link.href = "data:" + msg.mime + ";base64," + msg.data;
-        link.download = msg.filename;
+        link.href = url;
+        link.download = d.filename;
         document.body.appendChild(link);
         link.click();
         document.body.removeChild(link);
+
+        setTimeout(function() {
+            URL.revokeObjectURL(url);
+        }, 0);
     }
 }
 
-function message_received(ev) {
-    try {
-        let msg = JSON.parse(ev.data);
+function format_bytes(n) {
+    if (n < 1024)
+        return n + " B";
+    else if (n < 1048576)
+        return (n / 1024).toFixed(1) + " KB";
+    else if (n < 1073741824)
+        return (n / 1048576).toFixed(1) + " MB";
+    else
+        return (n / 1073741824).toFixed(1) + " GB";
+}
+
+function job_button(label, type, id) {
+    let button = document.createElement("button");
+
+    button.appendChild(document.createTextNode(label));
+
+    button.addEventListener("click", function(ev) {
+        ws.send(JSON.stringify({
+            "type": type,
+            "id": id
+        }));
+        ev.preventDefault();
+    });
+
+    return button;
+}
+
+function show_jobs() {
+    let div = document.getElementById("jobs");
+
+    while (div.hasChildNodes()) {
+        div.removeChild(div.firstChild);
+    }
+
+    if (jobs.size == 0)
+        return;
+
+    let tbl = document.createElement("table");
+    let running = false;
+
+    for (const job of [...jobs.values()].sort((a, b) => b.submitted - a.submitted)) {
+        let tr = document.createElement("tr");
+        let cells = [
+            job.filename,
+            new Date(job.submitted).toLocaleString(),
+            job.state + (job.error != undefined ? ": " + job.error : "") + (job.truncated ? " (incomplete)" : ""),
+            job.rows + " rows",
+            format_bytes(job.bytes),
+            (job.elapsed_ms / 1000).toFixed(0) + " s"
+        ];
+
+        tr.setAttribute("title", job.query);
+
+        for (const c of cells) {
+            let td = document.createElement("td");
+
+            td.appendChild(document.createTextNode(c));
+            tr.appendChild(td);
+        }
+
+        if (job.error != undefined)
+            tr.children[2].classList.add("error");
+
+        let td = document.createElement("td");
+
+        if (job.state == "finished")
+            td.appendChild(job_button("Download", "export_download", job.id));
+
+        if (job.state == "running")
+            td.appendChild(job_button("Cancel", "export_cancel", job.id));
+        else if (job.state != "cancelling")
+            td.appendChild(job_button("Delete", "export_delete", job.id));
+
+        tr.appendChild(td);
+        tbl.appendChild(tr);
+
+        if (job.state == "running" || job.state == "cancelling")
+            running = true;
+    }
+
+    div.appendChild(tbl);
 
-        if (msg.type == undefined)
-            throw Error("No message type given.");
+    // the server only tells us when a job's finished, so ask for the progress
+    if (running && jobs_timer === null) {
+        jobs_timer = setTimeout(function() {
+            jobs_timer = null;
 
-        if (msg.type == "error") {
-            if (logging_in) {
-                logging_in = false;
-                document.getElementById("login-button").disabled = false;
+            if (logged_in) {
+                ws.send(JSON.stringify({
+                    "type": "export_jobs"
+                }));
             }
+        }, JOBS_POLL_INTERVAL);
+    }
+}
 
-            throw Error(msg.message);
-        } else if (msg.type == "login")
-            recv_login(msg);
-        else if (msg.type == "logout")
-            recv_logout(msg);
-        else if (msg.type == "message")
-            recv_message(msg);
-        else if (msg.type == "table")
-            recv_table(msg);
-        else if (msg.type == "row")
-            recv_row(msg);
-        else if (msg.type == "row_count")
-            recv_row_count(msg);
-        else if (msg.type == "query_finished")
-            recv_query_finished(msg);
-        else if (msg.type == "pong") {
-            // nop
-        } else
-            throw Error("Unrecognized message type " + msg.type + ".");
-    } catch (e) {
+function clear_jobs() {
+    jobs.clear();
+    show_jobs();
+}
+
+function recv_export_jobs(msg) {
+    jobs = new Map(msg.jobs.map(j => [j.id, j]));
+    show_jobs();
+}
+
+function recv_export_job(msg) {
+    jobs.set(msg.job.id, msg.job);
+    show_jobs();
+}
+
+function recv_export_deleted(msg) {
+    jobs.delete(msg.id);
+    show_jobs();
+}
+
+function recv_compression(msg) {
+    compression = msg.enabled ? msg : null;
+    inflater = null;
+}
+
+async function inflate_message(data, len) {
+    if (!compression.context_takeover) {
+        let ds = new DecompressionStream("deflate-raw");
+
+        return await new Response(new Blob([data]).stream().pipeThrough(ds)).arrayBuffer();
+    }
+
+    // with context takeover, the whole connection is one deflate stream, sync-flushed
+    // after each message
+    if (inflater === null) {
+        let ds = new DecompressionStream("deflate-raw");
+
+        inflater = {
+            writer: ds.writable.getWriter(),
+            reader: ds.readable.getReader()
+        };
+    }
+
+    let out = new Uint8Array(len);
+    let got = 0;
+
+    inflater.writer.write(data).catch(function() { });
+
+    while (got < len) {
+        let r = await inflater.reader.read();
+
+        if (r.done)
+            throw Error("Compressed stream ended unexpectedly.");
+
+        if (got + r.value.length > len)
+            throw Error("Compressed message was longer than expected.");
+
+        out.set(r.value, got);
+        got += r.value.length;
+    }
+
+    return out.buffer;
+}
+
+function recv_json(data) {
+    let msg = JSON.parse(data);
+
+    if (msg.type == undefined)
+        throw Error("No message type given.");
+
+    if (msg.type == "error") {
+        if (logging_in) {
+            logging_in = false;
+            document.getElementById("login-button").disabled = false;
+        }
+
+        throw Error(msg.message);
+    } else if (msg.type == "login")
+        recv_login(msg);
+    else if (msg.type == "resumed")
+        recv_resumed(msg);
+    else if (msg.type == "logout")
+        recv_logout(msg);
+    else if (msg.type == "message")
+        recv_message(msg);
+    else if (msg.type == "table")
+        recv_table(msg);
+    else if (msg.type == "rows")
+        recv_rows(msg);
+    else if (msg.type == "row_count")
+        recv_row_count(msg);
+    else if (msg.type == "query_queued")
+        recv_query_queued(msg);
+    else if (msg.type == "query_finished")
+        recv_query_finished(msg);
+    else if (msg.type == "file")
+        recv_file(msg);
+    else if (msg.type == "export_jobs")
+        recv_export_jobs(msg);
+    else if (msg.type == "export_job")
+        recv_export_job(msg);
+    else if (msg.type == "export_deleted")
+        recv_export_deleted(msg);
+    else if (msg.type == "export_download")
+        save_download(msg);
+    else if (msg.type == "compression")
+        recv_compression(msg);
+    else if (msg.type == "pong") {
+        // nop
+    } else
+        throw Error("Unrecognized message type " + msg.type + ".");
+}
+
+async function process_message(data) {
+    if (data instanceof ArrayBuffer) {
+        let dv = new DataView(data);
+
+        if (dv.getUint8(0) != BINARY_FRAME_DEFLATE) {
+            recv_binary(data);
+            return;
+        }
+
+        if (compression === null)
+            throw Error("Received compressed message without negotiating compression.");
+
+        let opcode = dv.getUint8(1);
+        let buf = await inflate_message(new Uint8Array(data, 8), dv.getUint32(4, true));
+
+        if (opcode == 2) {
+            recv_binary(buf);
+            return;
+        }
+
+        data = new TextDecoder().decode(buf);
+    }
+
+    recv_json(data);
+}
+
+function message_received(ev) {
+    // decompression is asynchronous, so chain the messages to keep them in order
+    let data = ev.data;
+
+    recv_chain = recv_chain.then(function() {
+        return process_message(data);
+    }).catch(function(e) {
         change_status(e.message, true);
+    });
+}
+
+function deflate_supported() {
+    try {
+        new DecompressionStream("deflate-raw");
+        return true;
+    } catch (e) {
+        return false;
     }
 }
 
@@ -229,6 +825,31 @@ function socket_opened() {
     document.getElementById("login-button").disabled = false;
 
     ws.addEventListener("message", message_received);
+
+    compression = null;
+    inflater = null;
+    recv_chain = Promise.resolve();
+
+    if (deflate_supported()) {
+        ws.send(JSON.stringify({
+            "type": "compression",
+            "window_bits": 15,
+            "context_takeover": true
+        }));
+    }
+
+    if (session_token !== null) {
+        change_status("Reconnecting...", false);
+
+        document.getElementById("username").disabled = true;
+        document.getElementById("password").disabled = true;
+        document.getElementById("login-button").disabled = true;
+
+        ws.send(JSON.stringify({
+            "type": "resume",
+            "token": session_token
+        }));
+    }
 }
 
 function socket_closed() {
@@ -236,6 +857,10 @@ function socket_closed() {
 
     ws = undefined;
 
+    // if we can resume, the server will carry on with the query while we're away
+    if (session_token === null)
+        query_running = false;
+
     logged_in = false;
     logging_in = false;
 
@@ -247,8 +872,12 @@ function socket_closed() {
     document.getElementById("go-button").disabled = true;
     document.getElementById("stop-button").disabled = true;
     document.getElementById("excel-button").disabled = true;
+    document.getElementById("csv-button").disabled = true;
+    document.getElementById("background-check").disabled = true;
     document.getElementById("database-changer-container").style.display = "none";
 
+    clear_jobs();
+
     setTimeout(function() {
         init_websocket();
     }, 5000);
@@ -273,37 +902,55 @@ function login_button_clicked() {
     }
 }
 
-function go_button_clicked(excel) {
+// exp is the export format, or null to show the results
+function go_button_clicked(exp) {
     if (!logged_in)
         return;
 
+    let q = document.getElementById("query-box").value;
+
+    if (q == "")
+        return;
+
+    let msg = {
+        "type": "query",
+        "query": q
+    };
+
+    // doesn't tie up the session, and carries on if we go away
+    if (exp && document.getElementById("background-check").checked) {
+        msg.export = exp;
+        msg.background = true;
+
+        ws.send(JSON.stringify(msg));
+        return;
+    }
+
     let res = document.getElementById("results");
 
     while (res.hasChildNodes()) {
         res.removeChild(res.firstChild);
     }
 
-    let q = document.getElementById("query-box").value;
+    if (exp)
+        msg.export = exp;
+    else {
+        if (binary_rows)
+            msg.format = "binary";
 
-    if (q == "")
-        return;
+        msg.credits = { "rows": CREDIT_ROWS };
 
-    if (excel) {
-        ws.send(JSON.stringify({
-            "type": "query",
-            "query": q,
-            "export": "excel"
-        }));
-    } else {
-        ws.send(JSON.stringify({
-            "type": "query",
-            "query": q
-        }));
+        query_running = true;
+        rows_received = 0;
+        rows_granted = CREDIT_ROWS;
     }
 
+    ws.send(JSON.stringify(msg));
+
     document.getElementById("go-button").disabled = true;
     document.getElementById("stop-button").disabled = false;
     document.getElementById("excel-button").disabled = true;
+    document.getElementById("csv-button").disabled = true;
     document.getElementById("query-box").readOnly = true;
     document.getElementById("database-changer").disabled = true;
 }
@@ -339,6 +986,7 @@ function ws_ping() {
 
 function init_websocket() {
     ws = new WebSocket((location.protocol == "https:" ? "wss" : "ws") + "://" + location.host + "/ws");
+    ws.binaryType = "arraybuffer";
 
     ws.addEventListener("open", socket_opened);
     ws.addEventListener("close", socket_closed);
@@ -353,7 +1001,7 @@ function init() {
     });
 
     document.getElementById("go-button").addEventListener("click", function(ev) {
-        go_button_clicked(false);
+        go_button_clicked(null);
         ev.preventDefault();
     });
 
@@ -363,7 +1011,12 @@ function init() {
     });
 
     document.getElementById("excel-button").addEventListener("click", function(ev) {
-        go_button_clicked(true);
+        go_button_clicked("excel");
+        ev.preventDefault();
+    });
+
+    document.getElementById("csv-button").addEventListener("click", function(ev) {
+        go_button_clicked("csv");
         ev.preventDefault();
     });
 
@@ -371,10 +1024,14 @@ function init() {
         database_changed();
     });
 
+    document.getElementById("results").addEventListener("scroll", function(ev) {
+        grant_credit();
+    });
+
     window.addEventListener("keydown", function(e) {
         if (e.keyCode == 116) {
             if (!document.getElementById("go-button").disabled)
-                go_button_clicked(false);
+                go_button_clicked(null);
 
             e.preventDefault();
         }